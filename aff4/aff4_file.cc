@@ -22,6 +22,13 @@ specific language governing permissions and limitations under the License.
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <algorithm>
+
+#ifdef HAVE_FALLOCATE
+#include <sys/statvfs.h>
+#endif
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -96,68 +103,307 @@ AFF4Status CreateIntermediateDirectories(DataStore *resolver, std::string dir_na
 }
 
 AFF4Status FileBackedObject::ReadBuffer(char * data, size_t * length) {
-    // If we're trying to read larger than a cache block, then we skip the cache
-    if (*length > cache_block_size) {
-        return _ReadBuffer(data, length);
+    // Direct I/O must not populate any cache.
+    if (direct_io) {
+        return _ReadBufferDirect(data, length);
     }
 
-    // Save current position
-    const auto startpos = readptr;
+    // Track sequential access so long scans do not flush the cache.
+    if (readptr == last_read_end) {
+        sequential_run += *length;
+    } else {
+        sequential_run = 0;
+    }
 
-    // Calculate block number
-    const auto bn = startpos / cache_block_size;
+    // Reads of a cache block or more gain nothing from the cache.
+    if (cache_block_size == 0 || cache_block_limit == 0 ||
+        *length >= cache_block_size) {
+        AFF4Status result = _ReadBuffer(data, length);
+        last_read_end = readptr;
+        return result;
+    }
 
-    // Calculate block offset
-    const auto offset = startpos % cache_block_size;
+    // Copy from each block the read covers. Small reads may straddle
+    // two blocks.
+    size_t total = 0;
+    while (total < *length) {
+        const size_t bn = readptr / cache_block_size;
+        const size_t offset = readptr % cache_block_size;
+
+        const std::string* block;
+        AFF4Status result = GetCacheBlock(bn, &block);
+        if (result != STATUS_OK) {
+            if (total == 0) {
+                *length = 0;
+                return result;
+            }
+            break;
+        }
 
-    // If there's an overlap, then skip the cache
-    if (offset + *length > cache_block_size) {
-        return _ReadBuffer(data, length);
+        if (offset >= block->size()) {
+            break;
+        }
+
+        const size_t copied = block->copy(data + total, *length - total, offset);
+        total += copied;
+        readptr += copied;
+
+        // A short block is the end of the file.
+        if (offset + copied < cache_block_size) {
+            break;
+        }
     }
 
-    // Search the cache for a block
-    const auto block = read_cache.find(bn);
-    if (block != read_cache.end()) {
-        // We've got a cache hit!
-        const auto & block_data = block->second;
+    *length = total;
+    last_read_end = readptr;
 
-        // Copy data to buffer
-        *length = block_data.copy(data, *length, offset);
+    return STATUS_OK;
+}
 
-        // Adjust the read pointer
-        readptr += *length;
+AFF4Status FileBackedObject::GetCacheBlock(
+    size_t bn, const std::string** block) {
+    const bool sequential = (
+        sequential_run >= SEQUENTIAL_BLOCKS * (aff4_off_t)cache_block_size);
 
+    const auto it = read_cache.find(bn);
+    if (it != read_cache.end()) {
+        cache_hits++;
+
+        // Blocks touched by a scan are not promoted.
+        if (!sequential) {
+            cache_lru.splice(cache_lru.begin(), cache_lru, it->second);
+        }
+
+        *block = &it->second->data;
         return STATUS_OK;
     }
 
-    // We've got a cache miss
+    cache_misses++;
 
-    // Read a block of data
     std::string block_data(cache_block_size, 0);
     size_t read = cache_block_size;
+
+    const aff4_off_t position = readptr;
     readptr = bn * cache_block_size;
-    RETURN_IF_ERROR(_ReadBuffer(&block_data[0], &read));
+    AFF4Status result = _ReadBuffer(&block_data[0], &read);
+    readptr = position;
+
+    RETURN_IF_ERROR(result);
     block_data.resize(read);
 
-    // Copy data to buffer
-    *length = block_data.copy(data, *length, offset);
+    if (read_cache.size() >= cache_block_limit) {
+        read_cache.erase(cache_lru.back().number);
+        cache_lru.pop_back();
+    }
+
+    // Blocks read by a scan are unlikely to be read again, so they go in
+    // at the cold end. The scan then keeps recycling the same slot
+    // rather than evicting the working set (e.g. zip headers).
+    const auto position_in_lru = sequential ? cache_lru.end() : cache_lru.begin();
+    const auto inserted = cache_lru.insert(
+        position_in_lru, CacheBlock{bn, std::move(block_data)});
+    read_cache[bn] = inserted;
+
+    *block = &inserted->data;
+    return STATUS_OK;
+}
+
+void FileBackedObject::InvalidateCache(aff4_off_t offset, size_t length) {
+    if (read_cache.empty() || length == 0) {
+        return;
+    }
+
+    const size_t first = offset / cache_block_size;
+    const size_t last = (offset + length - 1) / cache_block_size;
+
+    // Large writes cover more blocks than we hold.
+    if (last - first >= read_cache.size()) {
+        for (auto it = cache_lru.begin(); it != cache_lru.end();) {
+            if (it->number >= first && it->number <= last) {
+                read_cache.erase(it->number);
+                it = cache_lru.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return;
+    }
+
+    for (size_t bn = first; bn <= last; bn++) {
+        const auto it = read_cache.find(bn);
+        if (it != read_cache.end()) {
+            cache_lru.erase(it->second);
+            read_cache.erase(it);
+        }
+    }
+}
+
+void FileBackedObject::ClearCache() {
+    read_cache.clear();
+    cache_lru.clear();
+}
+
+AFF4Status FileBackedObject::SetAccessPattern(AFF4AccessPattern pattern) {
+    RETURN_IF_ERROR(AFF4Stream::SetAccessPattern(pattern));
+
+#ifdef HAVE_POSIX_FADVISE
+    int advice = POSIX_FADV_NORMAL;
+    if (pattern == AFF4_ACCESS_SEQUENTIAL) {
+        advice = POSIX_FADV_SEQUENTIAL;
+    } else if (pattern == AFF4_ACCESS_RANDOM) {
+        advice = POSIX_FADV_RANDOM;
+    }
+
+    // The advice is only a hint - it fails harmlessly on pipes.
+    if (posix_fadvise(fd, 0, 0, advice) != 0) {
+        resolver->logger->debug("posix_fadvise failed on {}", urn);
+    }
+#endif
+
+    return STATUS_OK;
+}
+
+AFF4Status FileBackedObject::DropCachedData(aff4_off_t offset, aff4_off_t length) {
+    if (length == 0 && size > offset) {
+        InvalidateCache(offset, size - offset);
+    } else {
+        InvalidateCache(offset, length);
+    }
+
+#ifdef HAVE_POSIX_FADVISE
+    if (posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED) != 0) {
+        resolver->logger->debug("posix_fadvise failed on {}", urn);
+    }
+#endif
+
+    return STATUS_OK;
+}
+
+void FileBackedObject::reserve(size_t size) {
+    Preallocate(size);
+}
+
+void FileBackedObject::Preallocate(aff4_off_t end) {
+    if (!preallocate || end <= preallocated) {
+        return;
+    }
+
+#ifdef HAVE_FALLOCATE
+    // Grow in large steps so the file is laid out in few extents.
+    const aff4_off_t start = std::max(preallocated, size);
+    end = std::max(end, start + preallocation_increment);
+
+    // Callers only estimate how much they will write, so never reserve
+    // more than the free space.
+    struct statvfs fs;
+    if (fstatvfs(fd, &fs) == 0) {
+        end = std::min(end, start + (aff4_off_t)(fs.f_bavail * fs.f_frsize));
+    }
 
-    // Adjust the read pointer
-    readptr = startpos + *length;
+    if (end <= start) {
+        return;
+    }
 
-    // If the cache is full then remove a random block from the cache
-    if (read_cache.size() == cache_block_limit) {
-        auto el = read_cache.begin();
-        std::advance(el, rand() % cache_block_limit);
-        read_cache.erase(el);
+    // The file size is not changed so Seek(0, SEEK_END) still finds the
+    // end of the data.
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, start, end - start) != 0) {
+        resolver->logger->warn("Unable to preallocate {}, disk space will "
+                               "not be reserved: {}", urn,
+                               GetLastErrorMessage());
+        preallocate = false;
+        return;
     }
 
-    // Add block to cache
-    read_cache.emplace(bn, std::move(block_data));
+    preallocated = end;
+#endif
+}
+
+AFF4Status FileBackedObject::TrimToSize() {
+    if (preallocated <= size) {
+        return STATUS_OK;
+    }
+
+#ifdef HAVE_FALLOCATE
+    // Truncating to the current size releases blocks allocated past it.
+    if (ftruncate(fd, size) != 0) {
+        return IO_ERROR;
+    }
+#endif
+
+    preallocated = size;
 
     return STATUS_OK;
 }
 
+// Unaligned direct reads are split into pieces of at most this size.
+static const size_t DIRECT_IO_BOUNCE_SIZE = 1024 * 1024;
+
+bool FileBackedObject::IsAligned(
+    aff4_off_t offset, const char* data, size_t length) const {
+    return (offset % direct_io_alignment == 0 &&
+            length % direct_io_alignment == 0 &&
+            reinterpret_cast<uintptr_t>(data) % direct_io_alignment == 0);
+}
+
+AFF4Status FileBackedObject::_ReadBufferDirect(char* data, size_t *length) {
+    // The device can transfer straight into the caller's buffer. A short
+    // read at the end of the file is fine.
+    if (IsAligned(readptr, data, *length)) {
+        return _ReadBuffer(data, length);
+    }
+
+    if (bounce_buffer.size() == 0) {
+        bounce_buffer = AlignedBuffer(DIRECT_IO_BOUNCE_SIZE,
+                                      direct_io_alignment);
+        if (bounce_buffer.size() == 0) {
+            return MEMORY_ERROR;
+        }
+    }
+
+    // Read the aligned blocks covering the request and copy out the
+    // part the caller asked for.
+    size_t total = 0;
+    while (total < *length) {
+        const aff4_off_t start = readptr - readptr % direct_io_alignment;
+        const size_t skip = readptr - start;
+        const size_t wanted = std::min(*length - total,
+                                       bounce_buffer.size() - skip);
+        size_t to_read = skip + wanted;
+        to_read += (direct_io_alignment - to_read % direct_io_alignment) %
+            direct_io_alignment;
+
+        const aff4_off_t position = readptr;
+        readptr = start;
+        AFF4Status result = _ReadBuffer(bounce_buffer.data(), &to_read);
+        readptr = position;
+
+        if (result != STATUS_OK) {
+            if (total == 0) {
+                *length = 0;
+                return result;
+            }
+            break;
+        }
+
+        // The file ends before the requested range.
+        if (to_read <= skip) {
+            break;
+        }
+
+        const size_t available = std::min(wanted, to_read - skip);
+        std::memcpy(data + total, bounce_buffer.data() + skip, available);
+        total += available;
+        readptr += available;
+
+        if (available < wanted) {
+            break;
+        }
+    }
+
+    *length = total;
+    return STATUS_OK;
+}
+
 
 // Windows files are read through the CreateFile() API so that devices can be
 // read.
@@ -195,6 +441,9 @@ AFF4Status FileBackedObject::ReadBuffer(char * data, size_t * length) {
         // Only create directories if we are allowed to.
         RETURN_IF_ERROR(
             CreateIntermediateDirectories(resolver, directory_components));
+
+    } else if (mode == "direct") {
+        new_object->direct_io = true;
     }
 
     new_object->fd = CreateFile(
@@ -203,12 +452,13 @@ AFF4Status FileBackedObject::ReadBuffer(char * data, size_t * length) {
         FILE_SHARE_READ | FILE_SHARE_WRITE,
         nullptr,
         creation_disposition,
-        FILE_ATTRIBUTE_NORMAL,
+        new_object->direct_io ?
+        FILE_FLAG_NO_BUFFERING : FILE_ATTRIBUTE_NORMAL,
         nullptr);
 
     // Set defaults for file cache.
     new_object->cache_block_size = 2*1024*1024;  // 2 MiB
-    new_object->cache_block_limit = 32;  // 32 MiB total
+    new_object->cache_block_limit = 32;  // 64 MiB total
 
     if (new_object->fd == INVALID_HANDLE_VALUE) {
         resolver->logger->error(
@@ -281,6 +531,9 @@ AFF4Status FileBackedObject::Write(const char* data, size_t length) {
         return IO_ERROR;
     }
 
+    InvalidateCache(readptr, length);
+    Preallocate(readptr + length);
+
     if (properties.seekable) {
         LARGE_INTEGER tmp;
         tmp.QuadPart = readptr;
@@ -307,6 +560,8 @@ AFF4Status FileBackedObject::Truncate() {
         return IO_ERROR;
     }
 
+    ClearCache();
+
     LARGE_INTEGER tmp;
     tmp.QuadPart = 0;
 
@@ -354,13 +609,33 @@ FileBackedObject::~FileBackedObject() {
          // Only create directories if we are allowed to.
          RETURN_IF_ERROR(
              CreateIntermediateDirectories(resolver, directory_components));
+
+     } else if (mode == "direct") {
+         new_object->direct_io = true;
      }
 
     resolver->logger->debug("Opening file {}", filename);
 
-    new_object->fd = open(filename.c_str(), flags,
+    auto open_flags = flags;
+#ifdef O_DIRECT
+    if (new_object->direct_io) {
+        open_flags |= O_DIRECT;
+    }
+#endif
+
+    new_object->fd = open(filename.c_str(), open_flags,
               S_IRWXU | S_IRWXG | S_IRWXO);
 
+    // Some filesystems do not support direct I/O.
+    if (new_object->fd < 0 && errno == EINVAL && open_flags != flags) {
+        resolver->logger->warn(
+            "Direct I/O is not supported for {}, reading through "
+            "the page cache.", filename);
+        new_object->direct_io = false;
+        new_object->fd = open(filename.c_str(), flags,
+                              S_IRWXU | S_IRWXG | S_IRWXO);
+    }
+
     if (new_object->fd < 0) {
         resolver->logger->error("Cannot open file {}: {}", filename,
                                 GetLastErrorMessage());
@@ -379,6 +654,13 @@ FileBackedObject::~FileBackedObject() {
         new_object->properties.seekable = false;
     }
 
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    // OSX has no O_DIRECT but can turn off caching for the descriptor.
+    if (new_object->direct_io) {
+        fcntl(new_object->fd, F_NOCACHE, 1);
+    }
+#endif
+
      result = std::move(new_object);
 
      return STATUS_OK;
@@ -402,6 +684,9 @@ AFF4Status FileBackedObject::Write(const char* data, size_t length) {
         return IO_ERROR;
     }
 
+    InvalidateCache(readptr, length);
+    Preallocate(readptr + length);
+
     // Since all file operations are synchronous this object cannot be dirty.
     if (properties.seekable) {
         lseek(fd, readptr, SEEK_SET);
@@ -422,23 +707,131 @@ AFF4Status FileBackedObject::Write(const char* data, size_t length) {
 }
 
 AFF4Status FileBackedObject::Truncate() {
+    ClearCache();
+
     if (ftruncate(fd, 0) != 0) {
         return IO_ERROR;
     }
 
     RETURN_IF_ERROR(Seek(0, SEEK_SET));
     size = 0;
+    preallocated = 0;
 
     return STATUS_OK;
 }
 
 
 FileBackedObject::~FileBackedObject() {
+#ifdef AFF4_HAS_IO_URING
+    // The kernel may still be using the buffers of outstanding requests.
+    while (ring && ring->in_flight() > 0) {
+        if (ReapCompletion() != STATUS_OK) {
+            break;
+        }
+    }
+#endif
+
     if (fd >= 0) {
+        TrimToSize();
         close(fd);
     }
 }
 
+#ifdef AFF4_HAS_IO_URING
+
+IoUring* FileBackedObject::GetRing() {
+    if (ring_unavailable) {
+        return nullptr;
+    }
+
+    if (!ring) {
+        ring.reset(new IoUring());
+        if (ring->Setup(io_queue_depth) != STATUS_OK) {
+            resolver->logger->debug(
+                "io_uring is not available, using synchronous I/O.");
+            ring.reset();
+            ring_unavailable = true;
+            return nullptr;
+        }
+    }
+
+    // Make room for the new request.
+    if (ring->in_flight() >= ring->capacity() &&
+        ReapCompletion() != STATUS_OK) {
+        return nullptr;
+    }
+
+    return ring.get();
+}
+
+AFF4Status FileBackedObject::ReapCompletion() {
+    uint64_t tag;
+    int result;
+    RETURN_IF_ERROR(ring->Wait(&tag, &result));
+
+    AFF4Completion completion;
+    completion.tag = tag;
+    if (result < 0) {
+        completion.status = IO_ERROR;
+    } else {
+        completion.length = result;
+    }
+
+    completions.push_back(completion);
+
+    return STATUS_OK;
+}
+
+AFF4Status FileBackedObject::SubmitRead(aff4_off_t offset, char* data,
+                                        size_t length, uint64_t tag) {
+    // The kernel rejects unaligned direct reads, so those go through
+    // the bounce buffer.
+    if (direct_io && !IsAligned(offset, data, length)) {
+        return AFF4Stream::SubmitRead(offset, data, length, tag);
+    }
+
+    IoUring* uring = GetRing();
+    if (!uring) {
+        return AFF4Stream::SubmitRead(offset, data, length, tag);
+    }
+
+    return uring->SubmitRead(fd, offset, data, length, tag);
+}
+
+AFF4Status FileBackedObject::SubmitWrite(aff4_off_t offset, const char* data,
+                                         size_t length, uint64_t tag) {
+    if (!properties.writable) {
+        return IO_ERROR;
+    }
+
+    InvalidateCache(offset, length);
+    Preallocate(offset + length);
+
+    IoUring* uring = GetRing();
+    if (!uring) {
+        return AFF4Stream::SubmitWrite(offset, data, length, tag);
+    }
+
+    RETURN_IF_ERROR(uring->SubmitWrite(fd, offset, data, length, tag));
+
+    // The size is updated when the write is submitted.
+    if (offset + (aff4_off_t)length > size) {
+        size = offset + length;
+    }
+
+    return STATUS_OK;
+}
+
+AFF4Status FileBackedObject::WaitForCompletion(AFF4Completion& completion) {
+    if (completions.empty() && ring && ring->in_flight() > 0) {
+        RETURN_IF_ERROR(ReapCompletion());
+    }
+
+    return AFF4Stream::WaitForCompletion(completion);
+}
+
+#endif  // AFF4_HAS_IO_URING
+
 #endif
 
 
@@ -500,4 +893,194 @@ AFF4Status AFF4Stdout::Seek(aff4_off_t offset, int whence) {
 }
 
 
+/***************************************************************
+AFF4QueuedWriter implementation.
+****************************************************************/
+AFF4Status AFF4QueuedWriter::NewAFF4QueuedWriter(
+    DataStore *resolver,
+    AFF4Flusher<AFF4Stream> &&target,
+    size_t max_queued_bytes,
+    AFF4Flusher<AFF4Stream> &result) {
+    auto new_object = make_flusher<AFF4QueuedWriter>(resolver);
+
+    new_object->urn = target->urn;
+    new_object->properties = target->properties;
+    new_object->size = target->Size();
+    new_object->readptr = target->Tell();
+    new_object->max_queued_bytes = max_queued_bytes;
+    new_object->target = std::move(target);
+
+    new_object->writer = std::thread(
+        &AFF4QueuedWriter::WriterLoop, new_object.get());
+
+    result = std::move(new_object);
+
+    return STATUS_OK;
+}
+
+AFF4QueuedWriter::~AFF4QueuedWriter() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+        queue_changed.notify_all();
+    }
+
+    // The writer empties the queue before it exits.
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+void AFF4QueuedWriter::WriterLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        queue_changed.wait(lock, [this]() {
+                return stopping || !queue.empty();
+            });
+
+        if (queue.empty()) {
+            return;
+        }
+
+        QueuedRequest request = std::move(queue.front());
+        queue.pop_front();
+
+        // After an error the rest of the queue is discarded.
+        AFF4Status result = error;
+        lock.unlock();
+
+        if (result == STATUS_OK && request.drop) {
+            result = target->DropCachedData(request.offset,
+                                            request.drop_length);
+
+        } else if (result == STATUS_OK) {
+            if (target->properties.seekable) {
+                result = target->Seek(request.offset, SEEK_SET);
+            }
+
+            if (result == STATUS_OK) {
+                result = target->Write(request.data.data(),
+                                       request.data.size());
+            }
+        }
+
+        lock.lock();
+        if (error == STATUS_OK && result != STATUS_OK) {
+            resolver->logger->error("Unable to write to {}: {}", urn,
+                                    AFF4StatusToString(result));
+            error = result;
+        }
+
+        queued_bytes -= request.data.size();
+        queue_changed.notify_all();
+    }
+}
+
+AFF4Status AFF4QueuedWriter::Enqueue(QueuedRequest&& request) {
+    const size_t length = request.data.size();
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // Wait for room in the queue. A write larger than the whole queue
+    // is accepted once the queue is empty.
+    queue_changed.wait(lock, [this, length]() {
+            return (error != STATUS_OK || queued_bytes == 0 ||
+                    queued_bytes + length <= max_queued_bytes);
+        });
+
+    if (error != STATUS_OK) {
+        return error;
+    }
+
+    queue.push_back(std::move(request));
+    queued_bytes += length;
+    queue_changed.notify_all();
+
+    return STATUS_OK;
+}
+
+AFF4Status AFF4QueuedWriter::Write(const char* data, size_t length) {
+    QueuedRequest request;
+    request.offset = readptr;
+    request.data.assign(data, length);
+    RETURN_IF_ERROR(Enqueue(std::move(request)));
+
+    readptr += length;
+    if (readptr > size) {
+        size = readptr;
+    }
+
+    return STATUS_OK;
+}
+
+AFF4Status AFF4QueuedWriter::Drain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue_changed.wait(lock, [this]() {
+            return queued_bytes == 0;
+        });
+
+    return error;
+}
+
+size_t AFF4QueuedWriter::QueuedBytes() const {
+    std::unique_lock<std::mutex> lock(mutex);
+    return queued_bytes;
+}
+
+AFF4Status AFF4QueuedWriter::ReadBuffer(char* data, size_t* length) {
+    RETURN_IF_ERROR(Drain());
+    RETURN_IF_ERROR(target->Seek(readptr, SEEK_SET));
+
+    AFF4Status result = target->ReadBuffer(data, length);
+    if (result == STATUS_OK) {
+        readptr += *length;
+    }
+
+    return result;
+}
+
+AFF4Status AFF4QueuedWriter::Flush() {
+    RETURN_IF_ERROR(Drain());
+    RETURN_IF_ERROR(target->Flush());
+
+    return AFF4Stream::Flush();
+}
+
+AFF4Status AFF4QueuedWriter::Truncate() {
+    RETURN_IF_ERROR(Drain());
+    RETURN_IF_ERROR(target->Truncate());
+
+    readptr = 0;
+    size = 0;
+
+    return STATUS_OK;
+}
+
+void AFF4QueuedWriter::reserve(size_t size) {
+    if (Drain() == STATUS_OK) {
+        target->reserve(size);
+    }
+}
+
+AFF4Status AFF4QueuedWriter::TrimToSize() {
+    RETURN_IF_ERROR(Drain());
+    return target->TrimToSize();
+}
+
+AFF4Status AFF4QueuedWriter::SetAccessPattern(AFF4AccessPattern pattern) {
+    RETURN_IF_ERROR(AFF4Stream::SetAccessPattern(pattern));
+    RETURN_IF_ERROR(Drain());
+    return target->SetAccessPattern(pattern);
+}
+
+AFF4Status AFF4QueuedWriter::DropCachedData(aff4_off_t offset, aff4_off_t length) {
+    QueuedRequest request;
+    request.offset = offset;
+    request.drop = true;
+    request.drop_length = length;
+
+    return Enqueue(std::move(request));
+}
+
+
 } // namespace aff4
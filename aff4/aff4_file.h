@@ -22,8 +22,14 @@ specific language governing permissions and limitations under the License.
 #include "aff4/data_store.h"
 #include "aff4/aff4_utils.h"
 #include "aff4/rdf.h"
+#include "aff4/aff4_io_uring.h"
 
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 
 namespace aff4 {
@@ -57,6 +63,16 @@ class FileBackedObject: public AFF4Stream {
 
     AFF4Status Truncate() override;
 
+    // When preallocate is set, disk space is reserved ahead of writes
+    // in chunks of preallocation_increment bytes. This keeps large
+    // output files in few extents.
+    void reserve(size_t size) override;
+    AFF4Status TrimToSize() override;
+
+    // Passed on to posix_fadvise() where available.
+    AFF4Status SetAccessPattern(AFF4AccessPattern pattern) override;
+    AFF4Status DropCachedData(aff4_off_t offset, aff4_off_t length) override;
+
     // We provide access to the underlying file handle so callers can do other
     // things with the stream (i.e. ioctl on raw devices).
 #if defined(_WIN32)
@@ -65,17 +81,108 @@ class FileBackedObject: public AFF4Stream {
     int fd;
 #endif
 
-    size_t cache_block_size;
-    size_t cache_block_limit;
+    // Reads smaller than cache_block_size are served from a least
+    // recently used cache of up to cache_block_limit blocks. Writes
+    // through this object invalidate the blocks they touch. Setting
+    // either to 0 disables the cache.
+    size_t cache_block_size = 256 * 1024;
+    size_t cache_block_limit = 64;
+
+    // Reserve disk space with fallocate() where available. Space past
+    // the end of the data is released by TrimToSize() or when the file
+    // is closed.
+    bool preallocate = false;
+    aff4_off_t preallocation_increment = 256 * 1024 * 1024;
+
+    // Cache statistics.
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+
+    // Set when the file was opened in "direct" mode. Reads then bypass
+    // the operating system's page cache and our read cache. The device
+    // requires reads aligned to direct_io_alignment, so unaligned
+    // requests go through a bounce buffer.
+    bool direct_io = false;
+    size_t direct_io_alignment = 4096;
+
+#ifdef AFF4_HAS_IO_URING
+    // Asynchronous requests go through io_uring, falling back to the
+    // synchronous implementation if the kernel does not support it.
+    AFF4Status SubmitRead(aff4_off_t offset, char* data,
+                          size_t length, uint64_t tag) override;
+    AFF4Status SubmitWrite(aff4_off_t offset, const char* data,
+                           size_t length, uint64_t tag) override;
+    AFF4Status WaitForCompletion(AFF4Completion& completion) override;
+
+    // The number of asynchronous requests kept in flight.
+    unsigned io_queue_depth = 32;
+#endif
 
   private:
     // Read buffer, bypassing cache
     AFF4Status _ReadBuffer(char* data, size_t *length);
 
-    std::unordered_map<size_t, std::string> read_cache{};
+    // Read buffer with direct I/O. Aligned requests are read straight
+    // into data.
+    AFF4Status _ReadBufferDirect(char* data, size_t *length);
+
+    // Disk space is reserved up to this offset.
+    aff4_off_t preallocated = 0;
+
+    // Reserves disk space up to end.
+    void Preallocate(aff4_off_t end);
+
+    // Reused for unaligned direct I/O reads.
+    AlignedBuffer bounce_buffer;
+
+    bool IsAligned(aff4_off_t offset, const char* data, size_t length) const;
+
+#ifdef AFF4_HAS_IO_URING
+    std::unique_ptr<IoUring> ring;
+    bool ring_unavailable = false;
+
+    // Returns the ring with room for another request, or nullptr if
+    // io_uring can not be used.
+    IoUring* GetRing();
+
+    // Moves one completion from the ring to completions.
+    AFF4Status ReapCompletion();
+#endif
+
+    struct CacheBlock {
+        size_t number;
+        std::string data;
+    };
+
+    // Cached blocks, most recently used first, and an index into the
+    // list by block number.
+    std::list<CacheBlock> cache_lru;
+    std::unordered_map<size_t, std::list<CacheBlock>::iterator> read_cache{};
+
+    // Reads continuing a sequential run of this many blocks are treated
+    // as a scan.
+    static const int SEQUENTIAL_BLOCKS = 2;
+    aff4_off_t last_read_end = -1;
+    aff4_off_t sequential_run = 0;
+
+    // Finds or reads the block. The pointer is valid until the next
+    // cache operation.
+    AFF4Status GetCacheBlock(size_t bn, const std::string** block);
+    void InvalidateCache(aff4_off_t offset, size_t length);
+    void ClearCache();
 };
 
 
+/*
+  Modes understood by NewFileBackedObject():
+
+  "read" - Open an existing file read only.
+  "truncate" - Create or truncate the file for writing.
+  "append" - Create the file if needed and write to it.
+  "direct" - Open an existing file read only, bypassing the page cache.
+  Intended for imaging raw devices on a live system. Falls back to
+  "read" if the filesystem does not support direct I/O.
+ */
 AFF4Status NewFileBackedObject(
      DataStore *resolver,
      std::string filename,
@@ -129,6 +236,81 @@ class AFF4Stdout : public AFF4Stream {
     int fd;
 };
 
+/*
+  Writes to another stream from a background thread.
+
+  Write() copies the data into a queue and returns immediately. A writer
+  thread drains the queue into the target stream. When more than
+  max_queued_bytes are waiting, Write() blocks until the target catches
+  up. A slow output device then only stalls the producer when the queue
+  is full, instead of on every write.
+
+  Reads and other operations on the target wait for the queue to drain
+  first. Write errors are returned from the next Write() or Flush().
+ */
+class AFF4QueuedWriter: public AFF4Stream {
+  public:
+    static AFF4Status NewAFF4QueuedWriter(
+        DataStore *resolver,
+        AFF4Flusher<AFF4Stream> &&target,
+        size_t max_queued_bytes,
+        AFF4Flusher<AFF4Stream> &result);
+
+    explicit AFF4QueuedWriter(DataStore *resolver): AFF4Stream(resolver) {}
+    virtual ~AFF4QueuedWriter();
+
+    AFF4Status Write(const char* data, size_t length) override;
+    AFF4Status ReadBuffer(char* data, size_t* length) override;
+    AFF4Status Flush() override;
+    AFF4Status Truncate() override;
+
+    void reserve(size_t size) override;
+    AFF4Status TrimToSize() override;
+    AFF4Status SetAccessPattern(AFF4AccessPattern pattern) override;
+    AFF4Status DropCachedData(aff4_off_t offset, aff4_off_t length) override;
+
+    size_t QueuedBytes() const override;
+
+    using AFF4Stream::Write;
+
+  private:
+    struct QueuedRequest {
+        aff4_off_t offset;
+        std::string data;
+
+        // DropCachedData() requests are queued so they are carried out
+        // after the writes before them.
+        bool drop = false;
+        aff4_off_t drop_length = 0;
+    };
+
+    // Queues the request, waiting for room first.
+    AFF4Status Enqueue(QueuedRequest&& request);
+
+    // Waits until everything queued is written.
+    AFF4Status Drain();
+    void WriterLoop();
+
+    AFF4Flusher<AFF4Stream> target;
+    size_t max_queued_bytes = 0;
+
+    // Protects everything below. The condition is signalled whenever the
+    // queue changes.
+    mutable std::mutex mutex;
+    std::condition_variable queue_changed;
+
+    std::deque<QueuedRequest> queue;
+
+    // Bytes queued or being written.
+    size_t queued_bytes = 0;
+
+    // The first write error.
+    AFF4Status error = STATUS_OK;
+    bool stopping = false;
+
+    std::thread writer;
+};
+
 AFF4Status _CreateIntermediateDirectories(DataStore *resolver,
                                           std::string dir_name);
 
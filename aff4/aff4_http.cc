@@ -0,0 +1,572 @@
+/*
+Copyright 2014 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use
+this file except in compliance with the License.  You may obtain a copy of the
+License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License.
+*/
+
+#include "aff4/aff4_http.h"
+#include "aff4/libaff4.h"
+
+#include <algorithm>
+#include <cctype>
+#include <set>
+#include <sstream>
+
+#if !defined(_WIN32)
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+namespace aff4 {
+
+static const char HTTP_SCHEME[] = "http://";
+
+// Responses with larger headers are rejected.
+static const size_t MAX_HEADER_SIZE = 64 * 1024;
+
+bool HTTPStream::IsHTTPURL(const std::string& url) {
+    return url.compare(0, sizeof(HTTP_SCHEME) - 1, HTTP_SCHEME) == 0;
+}
+
+AFF4Status HTTPStream::NewHTTPStream(
+    DataStore* resolver, const std::string& url,
+    AFF4Flusher<AFF4Stream>& result) {
+    if (!IsHTTPURL(url)) {
+        resolver->logger->error("Not an http:// URL: {}", url);
+        return INVALID_INPUT;
+    }
+
+    auto new_object = make_flusher<HTTPStream>(resolver);
+    new_object->urn = URN(url);
+
+    // Split http://host[:port]/path into its parts.
+    std::string authority = url.substr(sizeof(HTTP_SCHEME) - 1);
+    const size_t path_start = authority.find('/');
+    if (path_start != std::string::npos) {
+        new_object->path = authority.substr(path_start);
+        authority.resize(path_start);
+    } else {
+        new_object->path = "/";
+    }
+
+    new_object->host = authority;
+    new_object->port = "80";
+
+    const size_t port_start = authority.rfind(':');
+    if (port_start != std::string::npos &&
+            authority.find(']', port_start) == std::string::npos) {
+        new_object->host = authority.substr(0, port_start);
+        new_object->port = authority.substr(port_start + 1);
+    }
+
+    // IPv6 literals are bracketed.
+    if (new_object->host.size() > 2 && new_object->host.front() == '[' &&
+            new_object->host.back() == ']') {
+        new_object->host = new_object->host.substr(
+            1, new_object->host.size() - 2);
+    }
+
+    if (new_object->host.empty()) {
+        resolver->logger->error("No host in URL: {}", url);
+        return INVALID_INPUT;
+    }
+
+    // Ask for the first byte to learn the size and check the server
+    // supports ranges.
+    std::string data;
+    aff4_off_t total_size = -1;
+    RETURN_IF_ERROR(new_object->Fetch(0, 1, data, &total_size));
+
+    if (total_size < 0) {
+        resolver->logger->error("{} did not report its size", url);
+        return IO_ERROR;
+    }
+
+    new_object->size = total_size;
+    new_object->properties.writable = false;
+
+    result = std::move(new_object);
+
+    return STATUS_OK;
+}
+
+HTTPStream::~HTTPStream() {
+    // Wait for outstanding fetches before the cache goes away.
+    fetchers.reset();
+}
+
+HTTPStream::CacheBlock HTTPStream::StartFetch(size_t bn) {
+    auto it = cache.find(bn);
+    if (it != cache.end()) {
+        cache_hits++;
+        cache_lru.splice(cache_lru.begin(), cache_lru, it->second);
+        return *it->second;
+    }
+
+    cache_misses++;
+
+    if (!fetchers) {
+        fetchers.reset(new ThreadPool(std::max(1u, fetch_threads)));
+    }
+
+    CacheBlock block;
+    block.number = bn;
+    block.data = std::make_shared<std::string>();
+
+    const aff4_off_t offset = (aff4_off_t)bn * block_size;
+    const size_t length = std::min(
+        (aff4_off_t)block_size, std::max((aff4_off_t)0, size - offset));
+    std::shared_ptr<std::string> data = block.data;
+
+    block.ready = fetchers->enqueue([this, offset, length, data]() {
+            return Fetch(offset, length, *data, nullptr);
+        }).share();
+
+    cache_lru.push_front(block);
+    cache[bn] = cache_lru.begin();
+
+    // Evicting a block still in flight is safe since the fetch holds
+    // its own reference to the data.
+    while (cache_lru.size() > std::max((size_t)1, cache_block_limit)) {
+        cache.erase(cache_lru.back().number);
+        cache_lru.pop_back();
+    }
+
+    return block;
+}
+
+AFF4Status HTTPStream::WaitForBlock(const CacheBlock& block) const {
+    RETURN_IF_ERROR(block.ready.get());
+
+    const aff4_off_t offset = (aff4_off_t)block.number * block_size;
+    const size_t expected = std::min(
+        (aff4_off_t)block_size, std::max((aff4_off_t)0, size - offset));
+    if (block.data->size() != expected) {
+        resolver->logger->error("{}: Short read of block {} ({} of {} bytes)",
+                                urn, block.number, block.data->size(),
+                                expected);
+        return IO_ERROR;
+    }
+
+    return STATUS_OK;
+}
+
+AFF4Status HTTPStream::ReadBuffer(char* data, size_t* length) {
+    if (block_size == 0 || readptr >= size) {
+        *length = 0;
+        return STATUS_OK;
+    }
+
+    size_t remaining = std::min((aff4_off_t)*length, size - readptr);
+    *length = 0;
+
+    const aff4_off_t first_block = readptr / block_size;
+    bool prefetch = false;
+    switch (properties.access_pattern) {
+        case AFF4_ACCESS_SEQUENTIAL:
+            prefetch = true;
+            break;
+        case AFF4_ACCESS_RANDOM:
+            break;
+        default:
+            prefetch = (last_block >= 0 && (first_block == last_block ||
+                                            first_block == last_block + 1));
+    }
+
+    const size_t last_bn = (size - 1) / block_size;
+    const size_t prefetch_count = std::min(
+        prefetch_blocks, std::max((size_t)1, cache_block_limit) - 1);
+
+    while (remaining > 0) {
+        const size_t bn = readptr / block_size;
+        const size_t offset_in_block = readptr % block_size;
+
+        CacheBlock block = StartFetch(bn);
+
+        if (prefetch) {
+            const size_t prefetch_end = std::min(last_bn, bn + prefetch_count);
+            for (size_t i = bn + 1; i <= prefetch_end; i++) {
+                StartFetch(i);
+            }
+        }
+
+        AFF4Status status = WaitForBlock(block);
+        if (status != STATUS_OK) {
+            // Drop the failed block so the next read tries again.
+            auto it = cache.find(bn);
+            if (it != cache.end()) {
+                cache_lru.erase(it->second);
+                cache.erase(it);
+            }
+
+            if (*length > 0) {
+                break;
+            }
+            return status;
+        }
+
+        const size_t to_copy = std::min(
+            remaining, block.data->size() - offset_in_block);
+        std::memcpy(data + *length, block.data->data() + offset_in_block,
+                    to_copy);
+
+        *length += to_copy;
+        readptr += to_copy;
+        remaining -= to_copy;
+        last_block = bn;
+    }
+
+    return STATUS_OK;
+}
+
+AFF4Status HTTPStream::ReadV(std::vector<AFF4ReadRequest>& requests) {
+    if (block_size == 0) {
+        return AFF4Stream::ReadV(requests);
+    }
+
+    // Start fetching every block before waiting for any of them.
+    std::set<size_t> needed;
+    for (auto& request : requests) {
+        request.status = STATUS_OK;
+        request.result_length = std::min(
+            (aff4_off_t)request.length,
+            std::max((aff4_off_t)0, size - request.offset));
+
+        if (request.result_length > 0) {
+            const size_t first = request.offset / block_size;
+            const size_t last = (request.offset + request.result_length - 1) /
+                block_size;
+            for (size_t bn = first; bn <= last; bn++) {
+                needed.insert(bn);
+            }
+        }
+    }
+
+    // Keep our own references since a large batch may not fit in the
+    // cache.
+    std::unordered_map<size_t, CacheBlock> blocks;
+    for (size_t bn : needed) {
+        blocks[bn] = StartFetch(bn);
+    }
+
+    AFF4Status result = STATUS_OK;
+    for (auto& request : requests) {
+        size_t copied = 0;
+        aff4_off_t offset = request.offset;
+
+        while (copied < request.result_length) {
+            const CacheBlock& block = blocks[offset / block_size];
+            const size_t offset_in_block = offset % block_size;
+
+            AFF4Status status = WaitForBlock(block);
+            if (status != STATUS_OK) {
+                request.status = status;
+                break;
+            }
+
+            const size_t to_copy = std::min(
+                request.result_length - copied,
+                block.data->size() - offset_in_block);
+            std::memcpy(request.data + copied,
+                        block.data->data() + offset_in_block, to_copy);
+            copied += to_copy;
+            offset += to_copy;
+        }
+
+        request.result_length = copied;
+        if (result == STATUS_OK) {
+            result = request.status;
+        }
+    }
+
+    return result;
+}
+
+AFF4Status HTTPStream::Fetch(aff4_off_t offset, size_t length,
+                             std::string& data, aff4_off_t* total_size) {
+    AFF4Status status = STATUS_OK;
+
+    for (int attempt = 0; attempt <= max_retries; attempt++) {
+        requests_sent++;
+        status = FetchOnce(offset, length, data, total_size);
+        if (status == STATUS_OK) {
+            break;
+        }
+
+        resolver->logger->warn("{}: Fetching {} bytes at {} failed ({})",
+                               urn, length, offset,
+                               AFF4StatusToString(status));
+    }
+
+    return status;
+}
+
+#if defined(_WIN32)
+
+AFF4Status HTTPStream::FetchOnce(aff4_off_t offset, size_t length,
+                                 std::string& data,
+                                 aff4_off_t* total_size) const {
+    UNUSED(offset);
+    UNUSED(length);
+    UNUSED(data);
+    UNUSED(total_size);
+    return NOT_IMPLEMENTED;
+}
+
+#else
+
+// Closes the socket when it goes out of scope.
+class HTTPConnection {
+  public:
+    int fd = -1;
+
+    ~HTTPConnection() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+static AFF4Status SendAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int flags = 0;
+#ifdef MSG_NOSIGNAL
+        flags = MSG_NOSIGNAL;
+#endif
+        ssize_t res = send(fd, data.data() + sent, data.size() - sent, flags);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            return IO_ERROR;
+        }
+        sent += res;
+    }
+
+    return STATUS_OK;
+}
+
+// Appends up to length bytes to data. Returns 0 at the end of the
+// response.
+static ssize_t Receive(int fd, std::string& data, size_t length) {
+    char buffer[64 * 1024];
+    while (true) {
+        ssize_t res = recv(fd, buffer, std::min(length, sizeof(buffer)), 0);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res > 0) {
+            data.append(buffer, res);
+        }
+        return res;
+    }
+}
+
+AFF4Status HTTPStream::FetchOnce(aff4_off_t offset, size_t length,
+                                 std::string& data,
+                                 aff4_off_t* total_size) const {
+    data.clear();
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* addresses = nullptr;
+    int res = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+    if (res != 0) {
+        resolver->logger->error("Unable to resolve {}: {}", host,
+                                gai_strerror(res));
+        return IO_ERROR;
+    }
+
+    HTTPConnection connection;
+    for (struct addrinfo* address = addresses; address;
+         address = address->ai_next) {
+        connection.fd = socket(address->ai_family, address->ai_socktype,
+                               address->ai_protocol);
+        if (connection.fd < 0) {
+            continue;
+        }
+
+        if (connect(connection.fd, address->ai_addr,
+                    address->ai_addrlen) == 0) {
+            break;
+        }
+
+        close(connection.fd);
+        connection.fd = -1;
+    }
+    freeaddrinfo(addresses);
+
+    if (connection.fd < 0) {
+        resolver->logger->error("Unable to connect to {}:{}: {}", host, port,
+                                GetLastErrorMessage());
+        return IO_ERROR;
+    }
+
+    struct timeval timeout = {};
+    timeout.tv_sec = timeout_seconds;
+    setsockopt(connection.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+               sizeof(timeout));
+    setsockopt(connection.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+               sizeof(timeout));
+
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(connection.fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    // HTTP/1.0 keeps the server from sending a chunked response.
+    const aff4_off_t last = offset + std::max((size_t)1, length) - 1;
+    RETURN_IF_ERROR(SendAll(connection.fd, aff4_sprintf(
+        "GET %s HTTP/1.0\r\n"
+        "Host: %s\r\n"
+        "Range: bytes=%lld-%lld\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        path.c_str(), host.c_str(), (long long)offset, (long long)last)));
+
+    std::string response;
+    size_t header_end;
+    while ((header_end = response.find("\r\n\r\n")) == std::string::npos) {
+        if (response.size() > MAX_HEADER_SIZE ||
+                Receive(connection.fd, response, MAX_HEADER_SIZE) <= 0) {
+            resolver->logger->error("{}: Bad response header", urn);
+            return IO_ERROR;
+        }
+    }
+
+    std::istringstream headers(response.substr(0, header_end));
+    std::string line;
+    int status_code = 0;
+
+    std::getline(headers, line);
+    if (sscanf(line.c_str(), "HTTP/%*s %d", &status_code) != 1) {
+        resolver->logger->error("{}: Bad status line: {}", urn, line);
+        return PARSING_ERROR;
+    }
+
+    long long content_length = -1;
+    long long range_start = -1;
+    long long range_total = -1;
+    bool identity_encoding = true;
+
+    while (std::getline(headers, line)) {
+        const size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        const char* value = line.c_str() + colon + 1;
+
+        if (name == "content-length") {
+            sscanf(value, " %lld", &content_length);
+        } else if (name == "content-range") {
+            // Either "bytes start-end/total" or "bytes */total".
+            long long range_end = -1;
+            if (sscanf(value, " bytes %lld-%lld/%lld",
+                       &range_start, &range_end, &range_total) != 3) {
+                sscanf(value, " bytes */%lld", &range_total);
+            }
+        } else if (name == "transfer-encoding") {
+            std::string encoding = value;
+            encoding.erase(std::remove_if(encoding.begin(), encoding.end(),
+                                          ::isspace), encoding.end());
+            std::transform(encoding.begin(), encoding.end(),
+                           encoding.begin(), ::tolower);
+            identity_encoding = encoding == "identity";
+        }
+    }
+
+    // We do not decode chunked bodies, which would otherwise be
+    // stored with their framing.
+    if (!identity_encoding) {
+        resolver->logger->error("{}: Unsupported transfer encoding", urn);
+        return PARSING_ERROR;
+    }
+
+    switch (status_code) {
+        case 206:
+            if (range_start != offset) {
+                resolver->logger->error(
+                    "{}: Asked for data at {} but got {}",
+                    urn, offset, range_start);
+                return PARSING_ERROR;
+            }
+            if (total_size) {
+                *total_size = range_total;
+            }
+            break;
+
+        // The server ignored the range and is sending the whole file. We
+        // can use its start but must not download everything before
+        // the data we want.
+        case 200:
+            if (offset != 0) {
+                resolver->logger->error(
+                    "{}: The server does not support range requests", urn);
+                return IO_ERROR;
+            }
+            if (total_size) {
+                *total_size = content_length;
+            }
+            break;
+
+        // Reading past the end of the file.
+        case 416:
+            if (total_size) {
+                *total_size = range_total;
+            }
+            return STATUS_OK;
+
+        default:
+            resolver->logger->error("{}: HTTP status {}", urn, status_code);
+            return status_code == 404 ? NOT_FOUND : IO_ERROR;
+    }
+
+    // Never read past the body the server said it is sending.
+    size_t wanted = length;
+    if (content_length >= 0) {
+        wanted = std::min(wanted, (size_t)content_length);
+    }
+
+    data = response.substr(header_end + 4, wanted);
+    while (data.size() < wanted) {
+        ssize_t received = Receive(connection.fd, data, wanted - data.size());
+        if (received == 0) {
+            break;
+        }
+        if (received < 0) {
+            resolver->logger->error("{}: {}", urn, GetLastErrorMessage());
+            return IO_ERROR;
+        }
+    }
+
+    if (content_length >= 0 && data.size() < wanted) {
+        resolver->logger->error("{}: Response body was truncated", urn);
+        return IO_ERROR;
+    }
+
+    return STATUS_OK;
+}
+
+#endif
+
+} // namespace aff4
@@ -0,0 +1,118 @@
+/*
+Copyright 2014 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use
+this file except in compliance with the License.  You may obtain a copy of the
+License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License.
+*/
+
+#ifndef  SRC_AFF4_HTTP_H_
+#define  SRC_AFF4_HTTP_H_
+
+#include "aff4/config.h"
+
+#include "aff4/aff4_io.h"
+#include "aff4/threadpool.h"
+
+#include <atomic>
+#include <future>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+namespace aff4 {
+
+/*
+  A read only stream backed by a file on an HTTP server, such as an
+  object in an S3 compatible object store. This allows a volume to be
+  opened and read in place without first copying it to local disk.
+
+  Data is fetched with ranged GET requests in blocks of block_size bytes
+  and kept in a least recently used cache of up to cache_block_limit
+  blocks. Up to fetch_threads blocks are fetched in parallel. Sequential
+  reads prefetch the next prefetch_blocks blocks, and ReadV() fetches all
+  the blocks it needs at once.
+
+  Only plain http:// URLs are supported. Objects which are not public
+  can be read through presigned URLs since the query string is sent
+  as is.
+ */
+class HTTPStream: public AFF4Stream {
+  public:
+    static AFF4Status NewHTTPStream(
+        DataStore* resolver, const std::string& url,
+        AFF4Flusher<AFF4Stream>& result);
+
+    // Is this a URL NewHTTPStream() can open?
+    static bool IsHTTPURL(const std::string& url);
+
+    explicit HTTPStream(DataStore* resolver): AFF4Stream(resolver) {}
+    virtual ~HTTPStream();
+
+    AFF4Status ReadBuffer(char* data, size_t* length) override;
+    AFF4Status ReadV(std::vector<AFF4ReadRequest>& requests) override;
+
+    // With AFF4_ACCESS_SEQUENTIAL reads always prefetch and with
+    // AFF4_ACCESS_RANDOM they never do. Otherwise we prefetch once reads
+    // look sequential.
+    size_t block_size = 1024 * 1024;
+    size_t cache_block_limit = 64;
+    size_t prefetch_blocks = 8;
+
+    // These take effect before the first read.
+    unsigned int fetch_threads = 8;
+    int timeout_seconds = 60;
+
+    // Failed requests are retried this many times.
+    int max_retries = 3;
+
+    // Statistics.
+    std::atomic<uint64_t> requests_sent{0};
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+
+  private:
+    std::string host;
+    std::string port;
+    std::string path;
+
+    struct CacheBlock {
+        size_t number;
+        std::shared_ptr<std::string> data;
+        std::shared_future<AFF4Status> ready;
+    };
+
+    // Cached and in flight blocks, most recently used first, and an
+    // index into the list by block number.
+    std::list<CacheBlock> cache_lru;
+    std::unordered_map<size_t, std::list<CacheBlock>::iterator> cache;
+
+    std::unique_ptr<ThreadPool> fetchers;
+
+    // The block the last read ended in.
+    aff4_off_t last_block = -1;
+
+    // Returns the block, starting a fetch if it is not cached.
+    CacheBlock StartFetch(size_t bn);
+
+    // Waits for the block and checks it is complete.
+    AFF4Status WaitForBlock(const CacheBlock& block) const;
+
+    // Sends a ranged GET for the data. total_size is set from the
+    // response's Content-Range. Safe to call from the fetch threads.
+    AFF4Status Fetch(aff4_off_t offset, size_t length, std::string& data,
+                     aff4_off_t* total_size);
+    AFF4Status FetchOnce(aff4_off_t offset, size_t length,
+                         std::string& data, aff4_off_t* total_size) const;
+};
+
+} // namespace aff4
+
+#endif  // SRC_AFF4_HTTP_H_
@@ -19,20 +19,22 @@ specific language governing permissions and limitations under the License.
 #include <zlib.h>
 #include <snappy.h>
 #include <lz4.h>
+#include <map>
+#include <set>
 #include "aff4/aff4_utils.h"
 #include "aff4/volume_group.h"
 
 namespace aff4 {
 
 
-AFF4Status CompressZlib_(const std::string &input, std::string* output) {
-    uLongf c_length = compressBound(input.size()) + 1;
+AFF4Status CompressZlib_(const char* data, size_t length, std::string* output) {
+    uLongf c_length = compressBound(length) + 1;
     output->resize(c_length);
 
     if (compress2(reinterpret_cast<Bytef*>(&(*output)[0]),
                   &c_length,
-                  reinterpret_cast<Bytef*>(const_cast<char*>(input.data())),
-                  input.size(), 1) != Z_OK) {
+                  reinterpret_cast<const Bytef*>(data),
+                  length, 1) != Z_OK) {
         return MEMORY_ERROR;
     }
 
@@ -42,12 +44,12 @@ AFF4Status CompressZlib_(const std::string &input, std::string* output) {
 }
 
 
-AFF4Status DeCompressZlib_(const std::string &input, std::string* output) {
+AFF4Status DeCompressZlib_(const char* data, size_t length, std::string* output) {
     uLongf buffer_size = output->size();
 
     if (uncompress(reinterpret_cast<Bytef*>(&(*output)[0]),
                    &buffer_size,
-                   (const Bytef*)input.data(), input.size()) == Z_OK) {
+                   (const Bytef*)data, length) == Z_OK) {
         output->resize(buffer_size);
         return STATUS_OK;
     }
@@ -56,7 +58,7 @@ AFF4Status DeCompressZlib_(const std::string &input, std::string* output) {
 }
 
 
-AFF4Status CompressDeflate_(const std::string &input, std::string* output) {
+AFF4Status CompressDeflate_(const char* data, size_t length, std::string* output) {
     z_stream zs{};
     if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
         return MEMORY_ERROR;
@@ -64,10 +66,10 @@ AFF4Status CompressDeflate_(const std::string &input, std::string* output) {
 
     int ret = Z_OK;
 
-    zs.next_in = (Bytef *) input.c_str();
-    zs.avail_in = input.length();
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = length;
 
-    auto size = deflateBound(&zs, input.length());
+    auto size = deflateBound(&zs, length);
 
     // Allocate space for another chunk of output
     output->resize(size);
@@ -86,7 +88,7 @@ AFF4Status CompressDeflate_(const std::string &input, std::string* output) {
 }
 
 
-AFF4Status DeCompressDeflate_(const std::string &input, std::string* output) {
+AFF4Status DeCompressDeflate_(const char* data, size_t length, std::string* output) {
     constexpr size_t chunk_size = 16 * 1024;
 
     z_stream zs{};
@@ -96,8 +98,8 @@ AFF4Status DeCompressDeflate_(const std::string &input, std::string* output) {
 
     int ret = Z_OK;
 
-    zs.next_in = (Bytef *) input.c_str();
-    zs.avail_in = input.length();
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = length;
 
     while (ret == Z_OK) {
         // Allocate space for another chunk of output
@@ -116,26 +118,26 @@ AFF4Status DeCompressDeflate_(const std::string &input, std::string* output) {
 }
 
 
-AFF4Status CompressSnappy_(const std::string &input, std::string* output) {
-    snappy::Compress(input.data(), input.size(), output);
+AFF4Status CompressSnappy_(const char* data, size_t length, std::string* output) {
+    snappy::Compress(data, length, output);
 
     return STATUS_OK;
 }
 
 
-AFF4Status DeCompressSnappy_(const std::string &input, std::string* output) {
-    if (!snappy::Uncompress(input.data(), input.size(), output)) {
+AFF4Status DeCompressSnappy_(const char* data, size_t length, std::string* output) {
+    if (!snappy::Uncompress(data, length, output)) {
         return GENERIC_ERROR;
     }
 
     return STATUS_OK;
 }
 
-AFF4Status CompressLZ4_(const std::string &input, std::string* output) {
-    output->resize(LZ4_compressBound(input.size()));
+AFF4Status CompressLZ4_(const char* data, size_t length, std::string* output) {
+    output->resize(LZ4_compressBound(length));
 
-    int size = LZ4_compress_default(input.data(), &(*output)[0],
-                                    input.size(), output->size());
+    int size = LZ4_compress_default(data, &(*output)[0],
+                                    length, output->size());
     if (size == 0) {
         return GENERIC_ERROR;
     }
@@ -146,9 +148,9 @@ AFF4Status CompressLZ4_(const std::string &input, std::string* output) {
 }
 
 
-AFF4Status DeCompressLZ4_(const std::string &input, std::string* output) {
-    int size = LZ4_decompress_safe(input.data(), &(*output)[0],
-                                   input.size(), output->size());
+AFF4Status DeCompressLZ4_(const char* data, size_t length, std::string* output) {
+    int size = LZ4_decompress_safe(data, &(*output)[0],
+                                   length, output->size());
     if (size == 0) {
         return GENERIC_ERROR;
     }
@@ -175,6 +177,25 @@ public:
         return bevy;
     }
 
+    // The compressed bevy. Only valid after Finalize().
+    const std::string& bevy_data() const {
+        return bevy.buffer;
+    }
+
+    // Prepares the writer for the next bevy. The bevy's memory is
+    // kept for reuse.
+    void Reset() {
+        std::unique_lock<std::mutex> lock(mutex);
+        results.clear();
+
+        std::unique_lock<std::mutex> bevy_lock(bevy_mutex);
+        bevy.buffer.clear();
+        bevy.Seek(0, SEEK_SET);
+        std::fill(bevy_index_data.begin(), bevy_index_data.end(),
+                  BevyIndex());
+        chunks_written_ = 0;
+    }
+
     // Generate the index stream.
     std::string index_stream() {
         std::unique_lock<std::mutex> lock(mutex);
@@ -199,11 +220,12 @@ public:
     // done asyncronously, the chunks are not stored in the bevy
     // contiguously. Instead, the index is sorted by chunk id and
     // refer to chunks in the bevy in any order.
-    void EnqueueCompressChunk(int chunk_id, const std::string& data) {
+    void EnqueueCompressChunk(int chunk_id, PooledBuffer&& chunk,
+                              size_t length) {
         std::future<AFF4Status> new_task = resolver->pool->enqueue(
-            [this, chunk_id, data]() {
-                return _CompressChunk(chunk_id, data);
-            });
+            [this, chunk_id, length](const PooledBuffer& chunk) {
+                return _CompressChunk(chunk_id, chunk.data(), length);
+            }, std::move(chunk));
 
         std::unique_lock<std::mutex> lock(mutex);
         results.push_back(std::move(new_task));
@@ -239,34 +261,35 @@ private:
 
     std::vector<std::future<AFF4Status>> results;
 
-    AFF4Status _CompressChunk(int chunk_id, const std::string data) {
-        std::string c_data;
+    AFF4Status _CompressChunk(int chunk_id, const char* data, size_t length) {
+        // Each pool thread reuses its own output buffer.
+        static thread_local std::string c_data;
+        c_data.clear();
 
         switch (compression) {
         case AFF4_IMAGE_COMPRESSION_ENUM_ZLIB: {
-            RETURN_IF_ERROR(CompressZlib_(data, &c_data));
+            RETURN_IF_ERROR(CompressZlib_(data, length, &c_data));
         }
             break;
 
         case AFF4_IMAGE_COMPRESSION_ENUM_DEFLATE: {
-            RETURN_IF_ERROR(CompressDeflate_(data, &c_data));
+            RETURN_IF_ERROR(CompressDeflate_(data, length, &c_data));
         }
             break;
 
         case AFF4_IMAGE_COMPRESSION_ENUM_SNAPPY: {
-            RETURN_IF_ERROR(CompressSnappy_(data, &c_data));
+            RETURN_IF_ERROR(CompressSnappy_(data, length, &c_data));
         }
             break;
 
         case AFF4_IMAGE_COMPRESSION_ENUM_LZ4: {
-            RETURN_IF_ERROR(CompressLZ4_(data, &c_data));
+            RETURN_IF_ERROR(CompressLZ4_(data, length, &c_data));
         }
             break;
 
-        case AFF4_IMAGE_COMPRESSION_ENUM_STORED: {
-            c_data = data;
-        }
-            break;
+        // Stored chunks are written straight from the input.
+        case AFF4_IMAGE_COMPRESSION_ENUM_STORED:
+            return WriteChunk(data, length, data, length, chunk_id);
 
         // Should never happen because the object should never accept this
         // compression URN.
@@ -276,13 +299,14 @@ private:
             return NOT_IMPLEMENTED;
         }
 
-        RETURN_IF_ERROR(WriteChunk(data, c_data, chunk_id));
+        RETURN_IF_ERROR(WriteChunk(data, length, c_data.data(), c_data.size(),
+                                   chunk_id));
         return STATUS_OK;
     }
 
 
-    AFF4Status WriteChunk(const std::string &data,
-                          const std::string &c_data,
+    AFF4Status WriteChunk(const char* data, size_t length,
+                          const char* c_data, size_t c_length,
                           uint32_t chunk_id) {
         if (chunk_id > chunks_per_segment) {
             return IO_ERROR;
@@ -304,14 +328,14 @@ private:
         //    is not applied to stored chunks.
 
         // Chunk is compressible - store it compressed.
-        if (c_data.size() < chunk_size - 16) {
-            index.length = c_data.size();
-            RETURN_IF_ERROR(bevy.Write(c_data));
+        if (c_length < chunk_size - 16) {
+            index.length = c_length;
+            RETURN_IF_ERROR(bevy.Write(c_data, c_length));
 
             // Chunk is not compressible enough, store it uncompressed.
         } else {
-            index.length = data.size();
-            RETURN_IF_ERROR(bevy.Write(data));
+            index.length = length;
+            RETURN_IF_ERROR(bevy.Write(data, length));
         }
         chunks_written_++;
 
@@ -331,6 +355,7 @@ class _CompressorStream: public AFF4Stream {
     aff4_off_t initial_offset;
     size_t chunk_size;
     int chunks_per_segment;
+    std::shared_ptr<BufferPool> chunk_buffers;
 
   public:
     _BevyWriter bevy_writer;
@@ -338,26 +363,195 @@ class _CompressorStream: public AFF4Stream {
     _CompressorStream(DataStore* resolver,
                       AFF4_IMAGE_COMPRESSION_ENUM compression,
                       size_t chunk_size,
-                      int chunks_per_segment, AFF4Stream* source):
+                      int chunks_per_segment, AFF4Stream* source,
+                      std::shared_ptr<BufferPool> chunk_buffers):
         AFF4Stream(resolver), source(source), initial_offset(source->Tell()),
         chunk_size(chunk_size), chunks_per_segment(chunks_per_segment),
+        chunk_buffers(chunk_buffers),
         bevy_writer(resolver, compression, chunk_size,
                     chunks_per_segment) {}
 
+    // Number of source reads kept in flight when the source is seekable.
+    static const int READ_AHEAD = 16;
+
+    // Starts the next bevy from the source's current position, reusing
+    // this bevy's memory.
+    void Reset() {
+        initial_offset = source->Tell();
+        readptr = 0;
+        size = 0;
+        bevy_writer.Reset();
+    }
+
     // Populate the entire bevy into the writer at once.
     AFF4Status PrepareBevy() {
-        for (int chunk_id = 0 ; chunk_id < chunks_per_segment; chunk_id++) {
-            const std::string data = source->Read(chunk_size);
+        if (source->properties.seekable) {
+            RETURN_IF_ERROR(ReadAheadBevy());
+        } else {
+            for (int chunk_id = 0 ; chunk_id < chunks_per_segment; chunk_id++) {
+                PooledBuffer chunk = chunk_buffers->Acquire();
+                if (!chunk) {
+                    return MEMORY_ERROR;
+                }
+
+                size_t length = chunk_size;
+
+                // Ran out of source data - we are done early.
+                if (source->ReadBuffer(chunk.data(), &length) != STATUS_OK ||
+                        length == 0) {
+                    break;
+                }
+                size += length;
+                bevy_writer.EnqueueCompressChunk(
+                    chunk_id, std::move(chunk), length);
+            }
+        }
+        RETURN_IF_ERROR(bevy_writer.Finalize());
+        return bevy_writer.bevy_stream().Seek(0, SEEK_SET);
+    }
+
+    // Reads the bevy's chunks with several asynchronous reads in flight
+    // so sources which support it are read at queue depth.
+    AFF4Status ReadAheadBevy() {
+        // Do not read past the end of sources that know their size.
+        int chunks = chunks_per_segment;
+        if (source->properties.sizeable) {
+            aff4_off_t remaining = std::max(
+                (aff4_off_t)0, source->Size() - initial_offset);
+            chunks = std::min((aff4_off_t)chunks,
+                              (aff4_off_t)((remaining + chunk_size - 1) /
+                                           chunk_size));
+        }
+
+        if (chunks == 0) {
+            return STATUS_OK;
+        }
+
+        // Chunks are read straight into pooled buffers, which are then
+        // handed to the compressor. The buffers are page aligned so
+        // direct I/O sources can read into them without a bounce
+        // buffer.
+        const int depth = std::min(READ_AHEAD, chunks);
+        std::vector<PooledBuffer> buffers(depth);
+        std::vector<AFF4Completion> results(depth);
+        std::vector<bool> completed(depth);
+
+        AFF4Status result = STATUS_OK;
+        int submitted = 0;
+        int outstanding = 0;
+        bool done = false;
+
+        for (int chunk_id = 0; chunk_id < chunks && !done; chunk_id++) {
+            while (result == STATUS_OK && submitted < chunks &&
+                   submitted < chunk_id + depth) {
+                int slot = submitted % depth;
+                completed[slot] = false;
+                buffers[slot] = chunk_buffers->Acquire();
+                if (!buffers[slot]) {
+                    result = MEMORY_ERROR;
+                    break;
+                }
+
+                result = source->SubmitRead(
+                    initial_offset + (aff4_off_t)submitted * chunk_size,
+                    buffers[slot].data(), chunk_size, submitted);
+                if (result == STATUS_OK) {
+                    submitted++;
+                    outstanding++;
+                }
+            }
+
+            // Reads may complete short before the end of the source, so
+            // keep reading until the chunk is full or we reach the end.
+            int slot = chunk_id % depth;
+            const aff4_off_t chunk_offset = (
+                initial_offset + (aff4_off_t)chunk_id * chunk_size);
+            size_t expected = chunk_size;
+            if (source->properties.sizeable) {
+                expected = std::min((aff4_off_t)chunk_size, std::max(
+                    (aff4_off_t)0, source->Size() - chunk_offset));
+            }
+
+            size_t filled = 0;
+            while (result == STATUS_OK) {
+                while (result == STATUS_OK && !completed[slot]) {
+                    AFF4Completion completion;
+                    result = source->WaitForCompletion(completion);
+                    if (result == STATUS_OK) {
+                        outstanding--;
+                        results[completion.tag % depth] = completion;
+                        completed[completion.tag % depth] = true;
+                    }
+                }
+
+                if (result != STATUS_OK) {
+                    break;
+                }
+
+                const AFF4Completion& chunk = results[slot];
+                if (chunk.status != STATUS_OK) {
+                    resolver->logger->error(
+                        "Unable to read source at offset {}: {}",
+                        chunk_offset + filled, AFF4StatusToString(chunk.status));
+                    result = chunk.status;
+                    break;
+                }
+
+                filled += chunk.length;
+
+                // Only a read which returns nothing marks the end.
+                if (chunk.length == 0 || filled >= expected) {
+                    break;
+                }
+
+                completed[slot] = false;
+                result = source->SubmitRead(
+                    chunk_offset + filled, buffers[slot].data() + filled,
+                    expected - filled, chunk_id);
+                if (result == STATUS_OK) {
+                    outstanding++;
+                }
+            }
+
+            if (result != STATUS_OK) {
+                break;
+            }
+
+            // A sizeable source must not end before its size.
+            if (source->properties.sizeable && filled < expected) {
+                resolver->logger->error(
+                    "Source ended at offset {} before its size {}",
+                    chunk_offset + filled, source->Size());
+                result = IO_ERROR;
+                break;
+            }
 
             // Ran out of source data - we are done early.
-            if (data.size() == 0) {
+            if (filled == 0) {
                 break;
             }
-            size += data.size();
-            bevy_writer.EnqueueCompressChunk(chunk_id, data);
+
+            size += filled;
+            bevy_writer.EnqueueCompressChunk(
+                chunk_id, std::move(buffers[slot]), filled);
+            if (filled < chunk_size) {
+                done = true;
+            }
         }
-        RETURN_IF_ERROR(bevy_writer.Finalize());
-        return bevy_writer.bevy_stream().Seek(0, SEEK_SET);
+
+        // The buffers must outlive any reads still in flight.
+        while (outstanding > 0) {
+            AFF4Completion completion;
+            if (source->WaitForCompletion(completion) != STATUS_OK) {
+                break;
+            }
+            outstanding--;
+        }
+
+        RETURN_IF_ERROR(result);
+
+        // Leave the source after the data we used.
+        return source->Seek(initial_offset + size, SEEK_SET);
     }
 
     // The progress reporting calls us to figure out how much work we
@@ -506,6 +700,18 @@ AFF4Status AFF4Image::NewAFF4Image(
     return STATUS_OK;
 }
 
+std::shared_ptr<BufferPool> AFF4Image::ChunkBuffers() {
+    // The chunk size may be changed before the first write.
+    if (!chunk_buffers || chunk_buffers->buffer_size() != chunk_size) {
+        // Enough to recycle every buffer used for a bevy.
+        chunk_buffers = BufferPool::NewBufferPool(
+            chunk_size, chunks_per_segment + _CompressorStream::READ_AHEAD,
+            huge_pages);
+    }
+
+    return chunk_buffers;
+}
+
 // Bevy is full - flush it to the image and start the next one. Takes
 // and disposes of the bevy_writer. Next Write() will make a new
 // writer.
@@ -536,14 +742,12 @@ AFF4Status AFF4Image::FlushBevy() {
     RETURN_IF_ERROR(bevy_index_member->Write(
                         bevy_writer->index_stream()));
 
-    ProgressContext empty_progress(resolver);
-    bevy_index_member->reserve(chunks_per_segment * chunk_size);
-    RETURN_IF_ERROR(bevy_member->WriteStream(&bevy_stream, &empty_progress));
+    // Write the compressed bevy out of the writer's buffer directly.
+    bevy_member->reserve(bevy_stream.Size());
+    RETURN_IF_ERROR(bevy_member->Write(bevy_writer->bevy_data()));
 
-    // Done with this bevy - make a new writer.
-    bevy_writer.reset(new _BevyWriter(
-                          resolver, compression, chunk_size,
-                          chunks_per_segment));
+    // Done with this bevy - reuse the writer for the next one.
+    bevy_writer->Reset();
     bevy_number++;
     chunk_count_in_bevy = 0;
 
@@ -563,29 +767,37 @@ AFF4Status AFF4Image::Write(const char* data, size_t length) {
     // This object is now dirty.
     MarkDirty();
 
-    // Append small reads to the buffer.
-    buffer.append(data, length);
     size_t offset = 0;
+    while (offset < length) {
+        if (!pending_chunk) {
+            pending_chunk = ChunkBuffers()->Acquire();
+            if (!pending_chunk) {
+                return MEMORY_ERROR;
+            }
+            pending_length = 0;
+        }
 
-    // Consume full chunks from the buffer and send them to the bevy
-    // writer.
-    while (buffer.size() - offset >= chunk_size) {
-        bevy_writer->EnqueueCompressChunk(
-            chunk_count_in_bevy,
-            buffer.substr(offset, chunk_size));
+        const size_t to_copy = std::min(
+            length - offset, (size_t)chunk_size - pending_length);
+        std::memcpy(pending_chunk.data() + pending_length, data + offset,
+                    to_copy);
+        pending_length += to_copy;
+        offset += to_copy;
 
-        chunk_count_in_bevy++;
+        // The full chunk is moved to the bevy writer without copying.
+        if (pending_length == chunk_size) {
+            bevy_writer->EnqueueCompressChunk(
+                chunk_count_in_bevy, std::move(pending_chunk), chunk_size);
+            pending_length = 0;
 
-        if (chunk_count_in_bevy >= chunks_per_segment) {
-            RETURN_IF_ERROR(FlushBevy());
-        }
+            chunk_count_in_bevy++;
 
-        offset += chunk_size;
+            if (chunk_count_in_bevy >= chunks_per_segment) {
+                RETURN_IF_ERROR(FlushBevy());
+            }
+        }
     }
 
-    // Keep the last part of the buffer which is smaller than a chunk size.
-    buffer.erase(0, offset);
-
     readptr += length;
     if (readptr > size) {
         size = readptr;
@@ -609,11 +821,16 @@ AFF4Status AFF4Image::WriteStream(AFF4Stream* source,
         progress = &default_progress;
     }
 
+    // The source is read once from start to end.
+    RETURN_IF_ERROR(source->SetAccessPattern(AFF4_ACCESS_SEQUENTIAL));
+
+    // This looks like a stream but can only read a bevy at a time.
+    _CompressorStream stream(resolver, compression, chunk_size,
+                             chunks_per_segment, source, ChunkBuffers());
+
     // Write a bevy at a time.
     while (1) {
-        // This looks like a stream but can only read a bevy at a time.
-        _CompressorStream stream(resolver, compression, chunk_size,
-                                 chunks_per_segment, source);
+        stream.Reset();
 
         // Read and compress the bevy into memory.
         RETURN_IF_ERROR(stream.PrepareBevy());
@@ -635,6 +852,9 @@ AFF4Status AFF4Image::WriteStream(AFF4Stream* source,
             bevy->reserve(chunks_per_segment * chunk_size);
 
             RETURN_IF_ERROR(bevy->WriteStream(&stream, progress));
+
+            // We will not read the bevy back.
+            RETURN_IF_ERROR(bevy->DropCachedData(0, 0));
         }
 
         // Now write the index.
@@ -686,9 +906,6 @@ AFF4Status AFF4Image::WriteStream(AFF4Stream* source,
 AFF4Status AFF4Image::ReadChunkFromBevy(
     std::string& result, unsigned int chunk_id, AFF4Flusher<AFF4Stream>& bevy,
     BevyIndex bevy_index[], uint32_t index_size) {
-    unsigned int chunk_id_in_bevy = chunk_id % chunks_per_segment;
-    BevyIndex entry;
-
     // Check first to see if the chunk is in the cache
     const auto it = chunk_cache.find(chunk_id);
     if (it != chunk_cache.end()) {
@@ -696,6 +913,37 @@ AFF4Status AFF4Image::ReadChunkFromBevy(
         return STATUS_OK;
     }
 
+    BevyIndex entry;
+    AFF4Status res = GetBevyIndexEntry(chunk_id, bevy_index, index_size, entry);
+    if (res != STATUS_OK) {
+        return res;
+    }
+
+    CompressedChunk cbuffer;
+    res = ReadCompressedChunk(bevy.get(), entry, cbuffer);
+    if (res != STATUS_OK) {
+        return res;
+    }
+
+    std::string buffer;
+    res = DecompressChunk(cbuffer.data(), cbuffer.length, buffer);
+    if (res != STATUS_OK) {
+        resolver->logger->error(" {} : Unable to uncompress chunk {}",
+                                urn, chunk_id);
+        return res;
+    }
+
+    CacheChunk(chunk_id, buffer);
+
+    result += buffer;
+    return STATUS_OK;
+}
+
+AFF4Status AFF4Image::GetBevyIndexEntry(
+    unsigned int chunk_id, BevyIndex bevy_index[], uint32_t index_size,
+    BevyIndex& entry) {
+    unsigned int chunk_id_in_bevy = chunk_id % chunks_per_segment;
+
     if (index_size == 0) {
         resolver->logger->error("Index empty in {} : chunk {}",
                                urn, chunk_id);
@@ -707,63 +955,69 @@ AFF4Status AFF4Image::ReadChunkFromBevy(
         resolver->logger->error("Bevy index too short in {} : {}",
                                urn, chunk_id);
         return IO_ERROR;
-
-    } else {
-        entry = (bevy_index[chunk_id_in_bevy]);
     }
 
+    entry = bevy_index[chunk_id_in_bevy];
+    return STATUS_OK;
+}
 
-    bevy->Seek(entry.offset, SEEK_SET);
-    std::string cbuffer = bevy->Read(entry.length);
+AFF4Status AFF4Image::ReadCompressedChunk(
+    AFF4Stream* bevy, const BevyIndex& entry, CompressedChunk& chunk) {
+    RETURN_IF_ERROR(bevy->Seek(entry.offset, SEEK_SET));
 
-    std::string buffer;
+    if (entry.length <= chunk_size) {
+        chunk.pooled = ChunkBuffers()->Acquire();
+        if (!chunk.pooled) {
+            return MEMORY_ERROR;
+        }
+
+        chunk.length = entry.length;
+        return bevy->ReadBuffer(chunk.pooled.data(), &chunk.length);
+    }
+
+    chunk.oversized = bevy->Read(entry.length);
+    chunk.length = chunk.oversized.size();
+    return STATUS_OK;
+}
+
+AFF4Status AFF4Image::DecompressChunk(const char* cbuffer, size_t length,
+                                      std::string& buffer) const {
     // We expect the decompressed buffer to be maximum chunk_size. If
     // it ends up decompressing to longer we error out.
     buffer.resize(chunk_size);
 
-    AFF4Status res;
-
-    if(entry.length == chunk_size) {
+    if (length == chunk_size) {
         // Chunk not compressed.
-        buffer = cbuffer;
-        res = STATUS_OK;
-    } else {
-        switch (compression) {
-        case AFF4_IMAGE_COMPRESSION_ENUM_ZLIB:
-            res = DeCompressZlib_(cbuffer, &buffer);
-            break;
+        buffer.assign(cbuffer, length);
+        return STATUS_OK;
+    }
 
-        case AFF4_IMAGE_COMPRESSION_ENUM_DEFLATE:
-            res = DeCompressDeflate_(cbuffer, &buffer);
-            break;
+    switch (compression) {
+    case AFF4_IMAGE_COMPRESSION_ENUM_ZLIB:
+        return DeCompressZlib_(cbuffer, length, &buffer);
 
-        case AFF4_IMAGE_COMPRESSION_ENUM_SNAPPY:
-            res = DeCompressSnappy_(cbuffer, &buffer);
-            break;
+    case AFF4_IMAGE_COMPRESSION_ENUM_DEFLATE:
+        return DeCompressDeflate_(cbuffer, length, &buffer);
 
-        case AFF4_IMAGE_COMPRESSION_ENUM_LZ4:
-            res = DeCompressLZ4_(cbuffer, &buffer);
-            break;
+    case AFF4_IMAGE_COMPRESSION_ENUM_SNAPPY:
+        return DeCompressSnappy_(cbuffer, length, &buffer);
 
-        case AFF4_IMAGE_COMPRESSION_ENUM_STORED:
-            buffer = cbuffer;
-            res = STATUS_OK;
-            break;
+    case AFF4_IMAGE_COMPRESSION_ENUM_LZ4:
+        return DeCompressLZ4_(cbuffer, length, &buffer);
 
-            // Should never happen because the object should never accept this
-            // compression URN.
-        default:
-            resolver->logger->critical("Unexpected compression type set");
-            res = NOT_IMPLEMENTED;
-        }
-    }
+    case AFF4_IMAGE_COMPRESSION_ENUM_STORED:
+        buffer.assign(cbuffer, length);
+        return STATUS_OK;
 
-    if (res != STATUS_OK) {
-        resolver->logger->error(" {} : Unable to uncompress chunk {}",
-                                urn, chunk_id);
-        return res;
+        // Should never happen because the object should never accept this
+        // compression URN.
+    default:
+        resolver->logger->critical("Unexpected compression type set");
+        return NOT_IMPLEMENTED;
     }
+}
 
+void AFF4Image::CacheChunk(unsigned int chunk_id, const std::string& buffer) {
     // Empty the cache if it's full
     if (chunk_cache.size() >= chunk_cache_size) {
         chunk_cache.clear();
@@ -771,8 +1025,42 @@ AFF4Status AFF4Image::ReadChunkFromBevy(
 
     // Add the decompressed chunk to the cache
     chunk_cache[chunk_id] = buffer;
+}
+
+AFF4Status AFF4Image::OpenBevy(unsigned int bevy_id,
+                               AFF4Flusher<AFF4Stream>& bevy,
+                               std::string& bevy_index_data,
+                               uint32_t& index_size) {
+    URN bevy_urn = urn.Append(aff4_sprintf("%08d", bevy_id));
+    URN bevy_index_urn;
+
+    if  (isAFF4Legacy) {
+        bevy_index_urn = bevy_urn.value + ("/index");
+    } else {
+        bevy_index_urn = bevy_urn.value + (".index");
+    }
+
+    // Missing bevies are not an error worth reporting here - the
+    // caller decides.
+    AFF4Flusher<AFF4Stream> bevy_index;
+    AFF4Status result = volumes->GetStream(bevy_index_urn, bevy_index);
+    if (result == STATUS_OK) {
+        result = volumes->GetStream(bevy_urn, bevy);
+    }
+
+    if (result != STATUS_OK) {
+        return result;
+    }
+
+    index_size = bevy_index->Size() / sizeof(BevyIndex);
+    bevy_index_data = bevy_index->Read(bevy_index->Size());
+
+    if (isAFF4Legacy) {
+        // Massage the bevvy data format from the old into the new.
+        bevy_index_data = _FixupBevyData(&bevy_index_data);
+        index_size = bevy_index->Size() / sizeof(uint32_t);
+    }
 
-    result += buffer;
     return STATUS_OK;
 }
 
@@ -782,35 +1070,15 @@ int AFF4Image::_ReadPartial(unsigned int chunk_id, int chunks_to_read,
 
     while (chunks_to_read > 0) {
         unsigned int bevy_id = chunk_id / chunks_per_segment;
-        URN bevy_urn = urn.Append(aff4_sprintf("%08d", bevy_id));
-        URN bevy_index_urn;
-
-        if  (isAFF4Legacy) {
-            bevy_index_urn = bevy_urn.value + ("/index");
-        } else {
-            bevy_index_urn = bevy_urn.value + (".index");
-        }
 
-        AFF4Flusher<AFF4Stream> bevy_index;
         AFF4Flusher<AFF4Stream> bevy;
+        std::string bevy_index_data;
+        uint32_t index_size;
 
-        if (volumes->GetStream(bevy_index_urn, bevy_index) != STATUS_OK) {
+        if (OpenBevy(bevy_id, bevy, bevy_index_data, index_size) != STATUS_OK) {
             return -1;
         }
 
-        if (volumes->GetStream(bevy_urn, bevy) != STATUS_OK) {
-            return -1;
-        }
-
-        uint32_t index_size = bevy_index->Size() / sizeof(BevyIndex);
-        std::string bevy_index_data = bevy_index->Read(bevy_index->Size());
-
-        if (isAFF4Legacy) {
-            // Massage the bevvy data format from the old into the new.
-            bevy_index_data = _FixupBevyData(&bevy_index_data);
-            index_size = bevy_index->Size() / sizeof(uint32_t);
-        }
-
         BevyIndex* bevy_index_array = reinterpret_cast<BevyIndex*>(
             &bevy_index_data[0]);
 
@@ -881,19 +1149,148 @@ AFF4Status AFF4Image::ReadBuffer(char* data, size_t* length) {
     return STATUS_OK;
 }
 
+AFF4Status AFF4Image::ReadV(std::vector<AFF4ReadRequest>& requests) {
+    // The chunks the requests touch, ordered so chunks from the same
+    // bevy are adjacent.
+    std::map<unsigned int, std::string> chunks;
+
+    for (auto& request : requests) {
+        request.status = STATUS_OK;
+        request.result_length = std::min(
+            (aff4_off_t)request.length,
+            std::max((aff4_off_t)0, Size() - request.offset));
+
+        if (request.result_length == 0) {
+            continue;
+        }
+
+        const unsigned int first = request.offset / chunk_size;
+        const unsigned int last = (
+            (request.offset + request.result_length - 1) / chunk_size);
+        for (unsigned int chunk_id = first; chunk_id <= last; chunk_id++) {
+            chunks.emplace(chunk_id, std::string());
+        }
+    }
+
+    std::vector<std::pair<unsigned int, std::future<AFF4Status>>> tasks;
+    std::set<unsigned int> failed;
+
+    AFF4Flusher<AFF4Stream> bevy;
+    std::string bevy_index_data;
+    uint32_t index_size = 0;
+    unsigned int bevy_id = 0;
+
+    for (auto& chunk : chunks) {
+        const unsigned int chunk_id = chunk.first;
+
+        const auto cached = chunk_cache.find(chunk_id);
+        if (cached != chunk_cache.end()) {
+            chunk.second = cached->second;
+            continue;
+        }
+
+        if (!bevy || bevy_id != chunk_id / chunks_per_segment) {
+            bevy_id = chunk_id / chunks_per_segment;
+            bevy.reset();
+            if (OpenBevy(bevy_id, bevy, bevy_index_data,
+                         index_size) != STATUS_OK) {
+                bevy.reset();
+                failed.insert(chunk_id);
+                continue;
+            }
+        }
+
+        BevyIndex entry;
+        if (GetBevyIndexEntry(
+                chunk_id, reinterpret_cast<BevyIndex*>(&bevy_index_data[0]),
+                index_size, entry) != STATUS_OK) {
+            failed.insert(chunk_id);
+            continue;
+        }
+
+        // The compressed chunks are read in order from the bevy, and
+        // decompressed in parallel.
+        CompressedChunk cbuffer;
+        if (ReadCompressedChunk(bevy.get(), entry, cbuffer) != STATUS_OK) {
+            failed.insert(chunk_id);
+            continue;
+        }
+
+        std::string* buffer = &chunk.second;
+
+        tasks.emplace_back(chunk_id, resolver->pool->enqueue(
+            [this, buffer](const CompressedChunk& cbuffer) {
+                return DecompressChunk(cbuffer.data(), cbuffer.length,
+                                       *buffer);
+            }, std::move(cbuffer)));
+    }
+
+    for (auto& task : tasks) {
+        if (task.second.get() == STATUS_OK) {
+            CacheChunk(task.first, chunks[task.first]);
+        } else {
+            resolver->logger->error(" {} : Unable to uncompress chunk {}",
+                                    urn, task.first);
+            failed.insert(task.first);
+        }
+    }
+
+    AFF4Status result = STATUS_OK;
+    for (auto& request : requests) {
+        size_t copied = 0;
+        aff4_off_t offset = request.offset;
+
+        while (copied < request.result_length) {
+            const unsigned int chunk_id = offset / chunk_size;
+            const size_t offset_in_chunk = offset % chunk_size;
+
+            if (failed.count(chunk_id)) {
+                request.status = IO_ERROR;
+                break;
+            }
+
+            const std::string& buffer = chunks[chunk_id];
+            if (offset_in_chunk >= buffer.size()) {
+                break;
+            }
+
+            const size_t length = buffer.copy(
+                request.data + copied, request.result_length - copied,
+                offset_in_chunk);
+            copied += length;
+            offset += length;
+        }
+
+        request.result_length = copied;
+        if (result == STATUS_OK) {
+            result = request.status;
+        }
+    }
+
+    return result;
+}
+
 AFF4Status AFF4Image::_write_metadata() {
-    resolver->Set(urn, AFF4_TYPE, new URN(AFF4_IMAGESTREAM_TYPE),
-                  /* replace = */ false);
+    StatementBatch metadata;
+    metadata.reserve(5);
+
+    metadata.Add(urn, AFF4_TYPE,
+                 resolver->MakeValue<URN>(AFF4_IMAGESTREAM_TYPE),
+                 /* replace = */ false);
 
-    resolver->Set(urn, AFF4_STREAM_CHUNK_SIZE, new XSDInteger(chunk_size));
+    metadata.Add(urn, AFF4_STREAM_CHUNK_SIZE,
+                 resolver->MakeValue<XSDInteger>((uint64_t)chunk_size));
 
-    resolver->Set(urn, AFF4_STREAM_CHUNKS_PER_SEGMENT,
-                  new XSDInteger(chunks_per_segment));
+    metadata.Add(urn, AFF4_STREAM_CHUNKS_PER_SEGMENT,
+                 resolver->MakeValue<XSDInteger>((uint64_t)chunks_per_segment));
 
-    resolver->Set(urn, AFF4_STREAM_SIZE, new XSDInteger(size));
+    metadata.Add(urn, AFF4_STREAM_SIZE,
+                 resolver->MakeValue<XSDInteger>((uint64_t)size));
 
-    resolver->Set(urn, AFF4_IMAGE_COMPRESSION, new URN(
-                      CompressionMethodToURN(compression)));
+    metadata.Add(urn, AFF4_IMAGE_COMPRESSION, resolver->MakeValue<URN>(
+                     CompressionMethodToURN(compression)));
+
+    resolver->SetBatch(metadata);
 
     return STATUS_OK;
 }
@@ -911,12 +1308,15 @@ AFF4Status AFF4Image::SwitchVolume(AFF4Volume *volume) {
 
 AFF4Status AFF4Image::Flush() {
     if (IsDirty()) {
-        // Flush the last chunk.
-        bevy_writer->EnqueueCompressChunk(chunk_count_in_bevy, buffer);
+        // Flush the last partial chunk.
+        if (pending_length > 0) {
+            bevy_writer->EnqueueCompressChunk(
+                chunk_count_in_bevy, std::move(pending_chunk), pending_length);
+            pending_length = 0;
+        }
         RETURN_IF_ERROR(FlushBevy());
 
         _write_metadata();
-        buffer.resize(0);
     }
 
     // Always call the baseclass to ensure the object is marked non dirty.
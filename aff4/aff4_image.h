@@ -18,6 +18,7 @@ specific language governing permissions and limitations under the License.
 
 #include "aff4/config.h"
 #include "aff4/aff4_io.h"
+#include "aff4/aff4_utils.h"
 #include "aff4/volume_group.h"
 
 #include <unordered_map>
@@ -101,18 +102,52 @@ class AFF4Image: public AFF4Stream {
         AFF4Flusher<AFF4Stream>& bevy, BevyIndex bevy_index[],
         uint32_t index_size);
 
+    // Opens a bevy and reads its index.
+    AFF4Status OpenBevy(unsigned int bevy_id, AFF4Flusher<AFF4Stream>& bevy,
+                        std::string& bevy_index_data, uint32_t& index_size);
+
+    AFF4Status GetBevyIndexEntry(
+        unsigned int chunk_id, BevyIndex bevy_index[], uint32_t index_size,
+        BevyIndex& entry);
+
+    // A compressed chunk read from a bevy. Chunks are normally no
+    // larger than chunk_size and are read into a pooled buffer.
+    struct CompressedChunk {
+        PooledBuffer pooled;
+        std::string oversized;
+        size_t length = 0;
+
+        const char* data() const {
+            return pooled ? pooled.data() : oversized.data();
+        }
+    };
+
+    AFF4Status ReadCompressedChunk(AFF4Stream* bevy, const BevyIndex& entry,
+                                   CompressedChunk& chunk);
+
+    // Safe to call from the thread pool.
+    AFF4Status DecompressChunk(const char* cbuffer, size_t length,
+                               std::string& buffer) const;
+
+    void CacheChunk(unsigned int chunk_id, const std::string& buffer);
+
     // The below are used to implement variable sized write support
     // through the Write() interfaces. This is not recommmended - it
     // is more efficient to write the image using the WriteStream()
     // interface.
 
-    // Accept small writes into this buffer - when we have a complete
-    // chunk we can sent it to the bevy writer.
-    std::string buffer;
+    // Writes are copied straight into this chunk buffer. When it is
+    // full it is handed to the bevy writer as is.
+    PooledBuffer pending_chunk;
+    size_t pending_length = 0;
 
     // Collect chunks here for the current bevy.
     std::unique_ptr<_BevyWriter, _BevyWriterDeleter> bevy_writer;
 
+    // Chunk sized buffers, recycled between bevies.
+    std::shared_ptr<BufferPool> chunk_buffers;
+    std::shared_ptr<BufferPool> ChunkBuffers();
+
     // The current bevy we write into.
     unsigned int bevy_number = 0;
 
@@ -144,6 +179,10 @@ class AFF4Image: public AFF4Stream {
                                              * Bevy. */
     unsigned int chunk_cache_size = 1024; /** The max number of cached chunks */
 
+    // Back the chunk buffers with huge pages. Set before the first
+    // read or write.
+    bool huge_pages = false;
+
     bool CanSwitchVolume() override;
     AFF4Status SwitchVolume(AFF4Volume *volume) override;
 
@@ -191,6 +230,10 @@ class AFF4Image: public AFF4Stream {
 
     AFF4Status ReadBuffer(char* data, size_t* length) override;
 
+    // Reads every chunk the requests need once, a bevy at a time, and
+    // decompresses them on the thread pool.
+    AFF4Status ReadV(std::vector<AFF4ReadRequest>& requests) override;
+
     AFF4Status Flush() override;
 
     using AFF4Stream::Write;
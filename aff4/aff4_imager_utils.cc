@@ -5,6 +5,7 @@
 
 #include "aff4/libaff4.h"
 #include "aff4/aff4_imager_utils.h"
+#include "aff4/aff4_http.h"
 #include "aff4/rdf.h"
 #include <iostream>
 #include <string>
@@ -37,6 +38,13 @@ AFF4Status ExtractStream(
     DefaultProgress progress(&resolver);
     progress.length = in_stream->Size();
 
+    // Maps know which regions are actually backed by data so we only
+    // need to write those and leave the rest of the file sparse.
+    AFF4Map *map = dynamic_cast<AFF4Map *>(in_stream.get());
+    if (map) {
+        return map->CopyToSparseStream(*out_stream, &progress);
+    }
+
     return out_stream->WriteStream(in_stream.get(), &progress);
 }
 
@@ -47,6 +55,8 @@ bool VolumeManager::Report(aff4_off_t readptr) {
     if (!MaybeSwitchVolumes())
         return false;
 
+    output = imager->output_stream;
+
     return DefaultProgress::Report(readptr);
 }
 
@@ -125,6 +135,10 @@ AFF4Status BasicImager::ParseArgs() {
         resolver.pool.reset(new ThreadPool(threads));
     }
 
+    if (Get("incremental_metadata")->isSet()) {
+        resolver.track_changes = true;
+    }
+
     // Check for incompatible commands.
     if (Get("export")->isSet() && Get("input")->isSet()) {
         resolver.logger->critical(
@@ -166,6 +180,10 @@ AFF4Status BasicImager::ProcessArgs() {
         result = handle_view();
     }
 
+    if (result == CONTINUE && Get("stats")->isSet()) {
+        result = handle_stats();
+    }
+
     if (result == CONTINUE && Get("export")->isSet()) {
         result = handle_export();
     }
@@ -225,6 +243,23 @@ AFF4Status BasicImager::handle_aff4_volumes() {
         "aff4_volumes")->getValue();
 
     for (std::string glob : volumes) {
+        // Volumes on a web server or object store are read in place.
+        if (HTTPStream::IsHTTPURL(glob)) {
+            AFF4Flusher<AFF4Stream> backing_stream;
+            RETURN_IF_ERROR(HTTPStream::NewHTTPStream(
+                                &resolver, glob, backing_stream));
+
+            RETURN_IF_ERROR(backing_stream->SetAccessPattern(
+                                AFF4_ACCESS_SEQUENTIAL));
+
+            AFF4Flusher<ZipFile> volume;
+            RETURN_IF_ERROR(ZipFile::OpenZipFile(
+                                &resolver, std::move(backing_stream), volume));
+
+            volume_objs.AddVolume(AFF4Flusher<AFF4Volume>(volume.release()));
+            continue;
+        }
+
         for (const auto &volume_to_load:  GlobFilename(glob)) {
             // Currently we support AFF4Directory and ZipFile. If the
             // directory does not already exist, and the argument ends
@@ -242,6 +277,10 @@ AFF4Status BasicImager::handle_aff4_volumes() {
                                     &resolver, volume_to_load,
                                     "read", backing_stream));
 
+                // Exporting and verifying read images from start to end.
+                RETURN_IF_ERROR(backing_stream->SetAccessPattern(
+                                    AFF4_ACCESS_SEQUENTIAL));
+
                 AFF4Flusher<ZipFile> volume;
                 RETURN_IF_ERROR(ZipFile::OpenZipFile(
                                     &resolver,
@@ -267,6 +306,41 @@ AFF4Status BasicImager::handle_list() {
 }
 
 
+AFF4Status BasicImager::handle_stats() {
+    URN map_type(AFF4_MAP_TYPE);
+    for (const auto& subject: resolver.Query(
+             URN(AFF4_TYPE), &map_type)) {
+        AFF4Flusher<AFF4Map> map;
+        RETURN_IF_ERROR(AFF4Map::OpenAFF4Map(
+                            &resolver, subject, &volume_objs, map));
+
+        AFF4MapStats stats = map->GetStats();
+
+        std::cout << subject.SerializeToString() << "\n";
+        std::cout << "  Size: " << map->Size()
+                  << "  Ranges: " << stats.range_count
+                  << "  Mapped: " << stats.mapped_bytes
+                  << "  Holes: " << stats.hole_bytes << "\n";
+
+        for (size_t i = 0; i < stats.target_bytes.size(); i++) {
+            std::cout << "  Target " << map->targets[i]->urn.SerializeToString()
+                      << ": " << stats.target_bytes[i] << " bytes\n";
+        }
+
+        std::cout << "  Range lengths:\n";
+        for (size_t i = 0; i < stats.length_histogram.size(); i++) {
+            if (stats.length_histogram[i] > 0) {
+                std::cout << "    " << (1ULL << i) << " - "
+                          << (1ULL << i) * 2 - 1 << ": "
+                          << stats.length_histogram[i] << "\n";
+            }
+        }
+    }
+
+    return STATUS_OK;
+}
+
+
 AFF4Status BasicImager::handle_view() {
     resolver.Dump(GetArg<TCLAP::SwitchArg>("verbose")->getValue());
 
@@ -292,9 +366,32 @@ AFF4Status BasicImager::parse_input() {
     return CONTINUE;
 }
 
+// Adds a batch of statements to the resolver when it goes out of scope,
+// so they are kept even when the caller returns early.
+class ApplyBatchOnExit {
+  public:
+    ApplyBatchOnExit(DataStore& resolver, StatementBatch& batch)
+        : resolver(resolver), batch(batch) {}
+
+    ~ApplyBatchOnExit() {
+        resolver.SetBatch(batch);
+    }
+
+  private:
+    DataStore& resolver;
+    StatementBatch& batch;
+};
+
 AFF4Status BasicImager::process_input() {
+    // Per-file metadata is added to the resolver in one batch once the
+    // file is done - including when writing it fails or is aborted, so
+    // partial images keep their original filename.
+    StatementBatch metadata;
+    metadata.reserve(2);
+
     for (std::string glob : inputs) {
         for (std::string input : GlobFilename(glob)) {
+            ApplyBatchOnExit apply_metadata(resolver, metadata);
 
             // Check if the volume needs to be split.
             VolumeManager(&resolver, this).MaybeSwitchVolumes();
@@ -307,8 +404,11 @@ AFF4Status BasicImager::process_input() {
 
             resolver.logger->debug("Will add file {}", input);
             RETURN_IF_ERROR(NewFileBackedObject(
-                                &resolver, input, "read",
+                                &resolver, input,
+                                Get("direct_io")->isSet() ? "direct" : "read",
                                 input_stream));
+            RETURN_IF_ERROR(input_stream->SetAccessPattern(
+                                AFF4_ACCESS_SEQUENTIAL));
             resolver.logger->info("Adding {} as {}", input, input_stream->urn);
 
             URN image_urn;
@@ -327,8 +427,8 @@ AFF4Status BasicImager::process_input() {
                 image_urn.Set(volume->urn.Append(input_stream->urn.Path()));
 
                 // Store the original filename.
-                resolver.Set(image_urn, AFF4_STREAM_ORIGINAL_FILENAME,
-                             new XSDString(input));
+                metadata.Add(image_urn, AFF4_STREAM_ORIGINAL_FILENAME,
+                             resolver.MakeValue<XSDString>(input));
             }
 
             // For very small streams, it is more efficient to just store them without
@@ -353,7 +453,8 @@ AFF4Status BasicImager::process_input() {
 
                 // Make this stream as an Image (Should we have
                 // another type for a LogicalImage?
-                resolver.Set(segment->urn, AFF4_TYPE, new URN(AFF4_IMAGE_TYPE),
+                metadata.Add(segment->urn, AFF4_TYPE,
+                             resolver.MakeValue<URN>(AFF4_IMAGE_TYPE),
                              /* replace = */ false);
 
                 // We need to explicitly check the abort status here.
@@ -370,6 +471,7 @@ AFF4Status BasicImager::process_input() {
 
                 // Set the output compression according to the user's wishes.
                 image_stream->compression = compression;
+                image_stream->huge_pages = Get("huge_pages")->isSet();
 
                 // Copy the input stream to the output stream.
                 VolumeManager progress(&resolver, this);
@@ -379,7 +481,8 @@ AFF4Status BasicImager::process_input() {
 
                 // Make this stream as an Image (Should we have
                 // another type for a LogicalImage?
-                resolver.Set(image_urn, AFF4_TYPE, new URN(AFF4_IMAGE_TYPE),
+                metadata.Add(image_urn, AFF4_TYPE,
+                             resolver.MakeValue<URN>(AFF4_IMAGE_TYPE),
                              /* replace = */ false);
             }
         }
@@ -459,6 +562,7 @@ AFF4Status BasicImager::GetNextPart() {
 
     // Free the old volume.
     current_volume.reset(nullptr);
+    output_stream = nullptr;
 
     return STATUS_OK;
 }
@@ -516,11 +620,38 @@ AFF4Status BasicImager::GetCurrentVolume(AFF4Volume **volume) {
 
         resolver.logger->warn("Output file {} will be truncated.", volume_path);
 
+        AFF4Flusher<FileBackedObject> output_file;
         RETURN_IF_ERROR(NewFileBackedObject(
                             &resolver, volume_path, truncate ? "truncate" : "append",
-                            output_volume_backing_stream));
+                            output_file));
+
+        if (Get("preallocate")->isSet()) {
+            output_file->preallocate = true;
+
+            // Split volumes can be reserved up front. Otherwise the
+            // compressed size is unknown, so space is reserved in
+            // increments as the volume grows.
+            if (max_output_volume_file_size > 0) {
+                output_file->reserve(
+                    output_file->Size() + max_output_volume_file_size);
+            }
+        }
+
+        output_volume_backing_stream = std::move(output_file);
     }
 
+    const size_t write_queue = GetArg<TCLAP::SizeArg>(
+        "write_queue")->getValue();
+    if (write_queue > 0) {
+        AFF4Flusher<AFF4Stream> queued_writer;
+        RETURN_IF_ERROR(AFF4QueuedWriter::NewAFF4QueuedWriter(
+                            &resolver, std::move(output_volume_backing_stream),
+                            write_queue, queued_writer));
+        output_volume_backing_stream = std::move(queued_writer);
+    }
+
+    output_stream = output_volume_backing_stream.get();
+
     RETURN_IF_ERROR(ZipFile::NewZipFile(
                         &resolver,
                         std::move(output_volume_backing_stream),
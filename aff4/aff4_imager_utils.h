@@ -60,6 +60,9 @@ class BasicImager {
     // Maximum size of output volume.
     size_t max_output_volume_file_size = 0;
 
+    // The stream the current output volume is written to. Not owned.
+    AFF4Stream* output_stream = nullptr;
+
     // Type of compression we should use.
     AFF4_IMAGE_COMPRESSION_ENUM compression = AFF4_IMAGE_COMPRESSION_ENUM_ZLIB;
 
@@ -97,6 +100,7 @@ class BasicImager {
     virtual AFF4Status handle_aff4_volumes();
     virtual AFF4Status handle_view();
     virtual AFF4Status handle_list();
+    virtual AFF4Status handle_stats();
     virtual AFF4Status parse_input();
     virtual AFF4Status process_input();
     virtual AFF4Status handle_export();
@@ -176,6 +180,9 @@ class BasicImager {
     virtual AFF4Status RegisterArgs() {
         AddArg(new TCLAP::SwitchArg("V", "view", "View AFF4 metadata", false));
         AddArg(new TCLAP::SwitchArg("l", "list", "List all image streams in the volume.", false));
+        AddArg(new TCLAP::SwitchArg(
+                   "", "stats", "Show layout statistics for all map streams "
+                   "in the volume.", false));
         AddArg(new TCLAP::MultiSwitchArg(
                    "d", "debug", "Display debugging logging (repeat for more info)",
                    false));
@@ -230,6 +237,35 @@ class BasicImager {
                    "to stdout.", false, "",
                    "/path/to/file"));
 
+        AddArg(new TCLAP::SwitchArg(
+                   "", "incremental_metadata", "When appending to an existing "
+                   "volume, write only the changed metadata as an additional "
+                   "information.turtle.<n> member instead of rewriting "
+                   "information.turtle. Other AFF4 readers may not understand "
+                   "these members.", false));
+
+        AddArg(new TCLAP::SwitchArg(
+                   "", "direct_io", "Read input files and devices with direct "
+                   "I/O, bypassing the operating system's page cache. Use this "
+                   "when imaging devices on a live system.", false));
+
+        AddArg(new TCLAP::SwitchArg(
+                   "", "preallocate", "Reserve disk space for the output "
+                   "volume ahead of writing it. This keeps large volumes "
+                   "unfragmented. Only supported on some filesystems.", false));
+
+        AddArg(new TCLAP::SwitchArg(
+                   "", "huge_pages", "Back the imager's chunk buffers with "
+                   "2 MiB huge pages where available. Can speed up imaging "
+                   "of fast devices.", false));
+
+        AddArg(new TCLAP::SizeArg(
+                   "", "write_queue", "Write the output volume from a separate "
+                   "thread, queueing up to this much data in memory so "
+                   "compression continues while the output device is busy. "
+                   "By default the volume is written synchronously.",
+                   false, 0, "Size (E.g. 64Mb)"));
+
         AddArg(new TCLAP::SizeArg(
                    "s", "split", "Split output volumes at this size.", false, 0,
                    "Size (E.g. 100Mb)"));
@@ -247,7 +283,10 @@ class BasicImager {
                    "These AFF4 Volumes will be loaded and their metadata will "
                    "be parsed before the program runs.\n"
                    "Note that this is necessary before you can extract streams with the "
-                   "--export flag.",
+                   "--export flag.\n"
+                   "Volumes may also be given as http:// URLs, for example "
+                   "of objects in an S3 compatible store. These are read in "
+                   "place.",
                    false, "/path/to/aff4/volume"));
 
         return STATUS_OK;
@@ -36,6 +36,14 @@ specific language governing permissions and limitations under the License.
 namespace aff4 {
 
 
+// How a stream expects to be read. See AFF4Stream::SetAccessPattern().
+typedef enum {
+    AFF4_ACCESS_NORMAL,
+    AFF4_ACCESS_SEQUENTIAL,
+    AFF4_ACCESS_RANDOM,
+} AFF4AccessPattern;
+
+
 struct AFF4StreamProperties {
     // Set if the stream is non seekable (e.g. a pipe).
     bool seekable = true;
@@ -45,6 +53,37 @@ struct AFF4StreamProperties {
 
     // Can we write to this file.
     bool writable = false;
+
+    // The expected access pattern.
+    AFF4AccessPattern access_pattern = AFF4_ACCESS_NORMAL;
+};
+
+
+// The outcome of an asynchronous request made with AFF4Stream::SubmitRead()
+// or AFF4Stream::SubmitWrite().
+struct AFF4Completion {
+    // The tag given when the request was submitted.
+    uint64_t tag = 0;
+    AFF4Status status = STATUS_OK;
+
+    // Number of bytes transferred.
+    size_t length = 0;
+};
+
+
+// One read of a batch passed to AFF4Stream::ReadV().
+struct AFF4ReadRequest {
+    AFF4ReadRequest() = default;
+    AFF4ReadRequest(aff4_off_t offset, char* data, size_t length):
+        offset(offset), data(data), length(length) {}
+
+    aff4_off_t offset = 0;
+    char* data = nullptr;
+    size_t length = 0;
+
+    // Set by ReadV(). The result is short at the end of the stream.
+    size_t result_length = 0;
+    AFF4Status status = STATUS_OK;
 };
 
 
@@ -77,6 +116,10 @@ class ProgressContext {
     // Total length read so far
     aff4_off_t total_read = 0;
 
+    // The stream the operation writes to. When set, reports include how
+    // much output is queued for writing. Not owned.
+    AFF4Stream* output = nullptr;
+
     // This will be called periodically to report the progress. Note that readptr
     // is specified relative to the start of the range operation (WriteStream and
     // CopyToStream)
@@ -170,6 +213,12 @@ class AFF4Stream: public AFF4Object {
     // likely to be.
     virtual void reserve(size_t size);
 
+    // Releases any space reserved past the end of the stream.
+    virtual AFF4Status TrimToSize();
+
+    // The number of bytes accepted by Write() but not yet written out.
+    virtual size_t QueuedBytes() const;
+
 
     // Requests that this stream change its backing volume if
     // possible. CanSwitchVolume() returns true if it is possible to
@@ -179,6 +228,50 @@ class AFF4Stream: public AFF4Object {
     virtual bool CanSwitchVolume();
     virtual AFF4Status SwitchVolume(AFF4Volume *volume);
 
+    /**
+     * Asynchronous positional I/O. Requests are identified by a caller
+     * chosen tag and may complete in any order. The buffers must remain
+     * valid until the request completes. The stream's read pointer is
+     * not affected.
+     *
+     * Streams without native support carry out the request before
+     * returning and hold the result for WaitForCompletion().
+     */
+    virtual AFF4Status SubmitRead(aff4_off_t offset, char* data,
+                                  size_t length, uint64_t tag);
+
+    virtual AFF4Status SubmitWrite(aff4_off_t offset, const char* data,
+                                   size_t length, uint64_t tag);
+
+    /**
+     * Waits for a submitted request to complete.
+     *
+     * @return NOT_FOUND if no requests are outstanding.
+     */
+    virtual AFF4Status WaitForCompletion(AFF4Completion& completion);
+
+    /**
+     * Reads a batch of ranges. Each request records its own status and
+     * how much was read. Streams which can do better than a Seek() and
+     * ReadBuffer() per request (e.g. by decompressing each chunk only
+     * once) override this. The stream's read pointer is not affected.
+     *
+     * @return the first error of any request.
+     */
+    virtual AFF4Status ReadV(std::vector<AFF4ReadRequest>& requests);
+
+    /**
+     * Access hints. These do not change what the stream returns, but
+     * streams backed by files pass them on to the operating system so
+     * it can size its readahead and keep the page cache useful.
+     *
+     * SetAccessPattern() records the pattern in properties.
+     * DropCachedData() tells the stream the range will not be read
+     * again soon. A length of 0 means up to the end of the stream.
+     */
+    virtual AFF4Status SetAccessPattern(AFF4AccessPattern pattern);
+    virtual AFF4Status DropCachedData(aff4_off_t offset, aff4_off_t length);
+
     /**
      * Streams can be truncated. This means the older stream data will be removed
      * and the object is returned to its initial state.
@@ -189,6 +282,11 @@ class AFF4Stream: public AFF4Object {
     virtual AFF4Status Truncate() {
         return NOT_IMPLEMENTED;
     }
+
+  protected:
+    // Requests which completed but were not yet collected by
+    // WaitForCompletion().
+    std::vector<AFF4Completion> completions;
 };
 
 class StringIO: public AFF4Stream {
@@ -0,0 +1,221 @@
+/*
+Copyright 2014 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use
+this file except in compliance with the License.  You may obtain a copy of the
+License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License.
+*/
+
+#include "aff4/aff4_io_uring.h"
+
+#ifdef AFF4_HAS_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <vector>
+
+namespace aff4 {
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg,
+                             unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Kernels before 5.6 set up a ring but complete IORING_OP_READ and
+// IORING_OP_WRITE with -EINVAL. They can not be probed either.
+static bool SupportsReadWrite(int ring_fd) {
+    const unsigned max_ops = 256;
+    std::vector<char> buffer(sizeof(struct io_uring_probe) +
+                             max_ops * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe* probe =
+        reinterpret_cast<struct io_uring_probe*>(buffer.data());
+
+    if (io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, max_ops) < 0) {
+        return false;
+    }
+
+    for (unsigned op: {IORING_OP_READ, IORING_OP_WRITE}) {
+        if (op > probe->last_op ||
+            !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+IoUring::~IoUring() {
+    if (sqes) {
+        munmap(sqes, sqes_size);
+    }
+
+    if (cq_ring && cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+    }
+
+    if (sq_ring) {
+        munmap(sq_ring, sq_ring_size);
+    }
+
+    if (ring_fd >= 0) {
+        close(ring_fd);
+    }
+}
+
+AFF4Status IoUring::Setup(unsigned requested_entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring_fd = io_uring_setup(requested_entries, &params);
+    if (ring_fd < 0 || !SupportsReadWrite(ring_fd)) {
+        return NOT_IMPLEMENTED;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels map both rings at once.
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_ring_size > sq_ring_size) {
+        sq_ring_size = cq_ring_size;
+    }
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        return IO_ERROR;
+    }
+
+    if (single_mmap) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = nullptr;
+            return IO_ERROR;
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes_map == MAP_FAILED) {
+        return IO_ERROR;
+    }
+    sqes = static_cast<struct io_uring_sqe*>(sqes_map);
+
+    char* sq = static_cast<char*>(sq_ring);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    char* cq = static_cast<char*>(cq_ring);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    entries = params.sq_entries;
+
+    return STATUS_OK;
+}
+
+AFF4Status IoUring::SubmitRead(int fd, aff4_off_t offset, char* data,
+                               size_t length, uint64_t tag) {
+    return Submit(IORING_OP_READ, fd, offset, data, length, tag);
+}
+
+AFF4Status IoUring::SubmitWrite(int fd, aff4_off_t offset, const char* data,
+                                size_t length, uint64_t tag) {
+    return Submit(IORING_OP_WRITE, fd, offset, data, length, tag);
+}
+
+AFF4Status IoUring::Submit(int opcode, int fd, aff4_off_t offset,
+                           const void* data, size_t length, uint64_t tag) {
+    if (pending >= entries) {
+        return MEMORY_ERROR;
+    }
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = length;
+    sqe->user_data = tag;
+
+    sq_array[index] = index;
+
+    // The kernel must see the entry before the new tail.
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (io_uring_enter(ring_fd, 1, 0, 0) < 0) {
+        if (errno != EINTR) {
+            // The kernel only consumes entries inside io_uring_enter(),
+            // and a failed call consumed none, so take the entry back.
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+            return IO_ERROR;
+        }
+    }
+
+    pending++;
+
+    return STATUS_OK;
+}
+
+AFF4Status IoUring::Wait(uint64_t* tag, int* result) {
+    if (pending == 0) {
+        return NOT_FOUND;
+    }
+
+    while (1) {
+        unsigned head = *cq_head;
+        if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+            *tag = cqe->user_data;
+            *result = cqe->res;
+
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            pending--;
+
+            return STATUS_OK;
+        }
+
+        if (io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR) {
+            return IO_ERROR;
+        }
+    }
+}
+
+} // namespace aff4
+
+#endif  // AFF4_HAS_IO_URING
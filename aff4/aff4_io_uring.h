@@ -0,0 +1,104 @@
+/*
+Copyright 2014 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use
+this file except in compliance with the License.  You may obtain a copy of the
+License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License.
+*/
+
+#ifndef  SRC_AFF4_IO_URING_H_
+#define  SRC_AFF4_IO_URING_H_
+
+#include "aff4/config.h"
+
+#ifdef AFF4_HAS_IO_URING
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aff4/aff4_base.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace aff4 {
+
+/**
+ * A minimal io_uring instance for positional reads and writes on file
+ * descriptors. This talks to the kernel directly so it does not need
+ * liburing. Requires Linux 5.6 or later.
+ *
+ * Not thread safe.
+ */
+class IoUring {
+  public:
+    IoUring() = default;
+    ~IoUring();
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Sets up a ring with room for the given number of requests in
+    // flight. Fails if the kernel does not support io_uring reads and
+    // writes.
+    AFF4Status Setup(unsigned entries);
+
+    // Queues a request and submits it to the kernel. At most capacity()
+    // requests may be in flight.
+    AFF4Status SubmitRead(int fd, aff4_off_t offset, char* data,
+                          size_t length, uint64_t tag);
+    AFF4Status SubmitWrite(int fd, aff4_off_t offset, const char* data,
+                           size_t length, uint64_t tag);
+
+    // Waits for the next completion. result is the number of bytes
+    // transferred, or a negative errno.
+    AFF4Status Wait(uint64_t* tag, int* result);
+
+    unsigned capacity() const {
+        return entries;
+    }
+
+    unsigned in_flight() const {
+        return pending;
+    }
+
+  private:
+    AFF4Status Submit(int opcode, int fd, aff4_off_t offset, const void* data,
+                      size_t length, uint64_t tag);
+
+    int ring_fd = -1;
+    unsigned entries = 0;
+    unsigned pending = 0;
+
+    // The shared rings.
+    void* sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void* cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+};
+
+} // namespace aff4
+
+#endif  // AFF4_HAS_IO_URING
+
+#endif  // SRC_AFF4_IO_URING_H_
@@ -17,6 +17,7 @@ specific language governing permissions and limitations under the License.
 #include "aff4/aff4_image.h"
 #include "aff4/libaff4.h"
 #include "aff4/volume_group.h"
+#include "aff4/aff4_symstream.h"
 
 #include <memory>
 
@@ -62,6 +63,7 @@ AFF4Status AFF4Map::NewAFF4Map(
     }
 
     new_object->last_target = data_stream;
+    new_object->target_idx_map[data_stream] = 0;
     new_object->targets.push_back(data_stream);
 
     resolver->Set(object_urn, AFF4_TYPE, new URN(AFF4_MAP_TYPE),
@@ -98,15 +100,16 @@ AFF4Status AFF4Map::OpenAFF4Map(
         if(*line.rbegin() == '\r'){
             line.erase(line.length()-1, 1);
         }
-        AFF4Flusher<AFF4Stream> target;
-        RETURN_IF_ERROR(volumes->GetStream(URN(line), target));
+        // Targets are shared with other maps in the volume group.
+        std::shared_ptr<AFF4Stream> target;
+        RETURN_IF_ERROR(volumes->GetSharedStream(URN(line), target));
 
         resolver->logger->debug("MAP: Opened {} {} for target {}",
                                 target->urn, line,  map_obj->targets.size());
 
         map_obj->target_idx_map[target.get()] = map_obj->targets.size();
         map_obj->targets.push_back(target.get());
-        map_obj->GiveTarget(std::move(target));
+        map_obj->shared_targets.push_back(target);
     }
 
     // Calculate number of ranges
@@ -121,7 +124,7 @@ AFF4Status AFF4Map::OpenAFF4Map(
 
     for (size_t i = 0; i < n; i++) {
         auto & range = buffer[i];
-        map_obj->map[range.map_end()] = range;
+        map_obj->InsertRange(range);
     }
 
     // If the map has a STREAM_SIZE property we set the size based on that,
@@ -246,6 +249,79 @@ AFF4Status AFF4Map::ReadBuffer(char* data, size_t* length) {
     return STATUS_OK;
 }
 
+AFF4Status AFF4Map::ReadV(std::vector<AFF4ReadRequest>& requests) {
+    // Requests to each target, and where they came from in the map.
+    std::map<uint32_t, std::vector<AFF4ReadRequest>> target_requests;
+    std::map<uint32_t, std::vector<aff4_off_t>> target_map_offsets;
+
+    for (auto& request : requests) {
+        request.status = STATUS_OK;
+        request.result_length = std::min(
+            (aff4_off_t)request.length,
+            std::max((aff4_off_t)0, Size() - request.offset));
+
+        // Unmapped regions read as zeros.
+        std::memset(request.data, 0, request.result_length);
+
+        aff4_off_t offset = request.offset;
+        const aff4_off_t end = request.offset + request.result_length;
+
+        while (offset < end) {
+            auto map_it = map.upper_bound(offset);
+            if (map_it == map.end()) {
+                break;
+            }
+
+            const Range& range = map_it->second;
+            if (range.map_offset >= (uint64_t)end) {
+                break;
+            }
+
+            if (range.map_offset > (uint64_t)offset) {
+                offset = range.map_offset;
+            }
+
+            const aff4_off_t length = std::min(
+                end, (aff4_off_t)range.map_end()) - offset;
+
+            target_requests[range.target_id].emplace_back(
+                range.target_offset + (offset - range.map_offset),
+                request.data + (offset - request.offset), length);
+            target_map_offsets[range.target_id].push_back(offset);
+
+            offset += length;
+        }
+    }
+
+    for (auto& it : target_requests) {
+        AFF4Stream* target_stream = targets[it.first];
+        std::vector<AFF4ReadRequest>& sub_requests = it.second;
+
+        resolver->logger->debug("MAP: Reading {} ranges from {}",
+                                sub_requests.size(), target_stream->urn);
+
+        target_stream->ReadV(sub_requests);
+
+        for (size_t i = 0; i < sub_requests.size(); i++) {
+            AFF4ReadRequest& sub_request = sub_requests[i];
+            if (sub_request.status == STATUS_OK &&
+                    sub_request.result_length == sub_request.length) {
+                continue;
+            }
+
+            // Let ReadBuffer() re-read the unreadable region a page at a
+            // time.
+            const aff4_off_t saved_readptr = readptr;
+            Seek(target_map_offsets[it.first][i], SEEK_SET);
+            size_t length = sub_request.length;
+            ReadBuffer(sub_request.data, &length);
+            Seek(saved_readptr, SEEK_SET);
+        }
+    }
+
+    return STATUS_OK;
+}
+
 aff4_off_t AFF4Map::Size() const {
     return size;
 }
@@ -470,11 +546,11 @@ AFF4Status AFF4Map::AddRange(aff4_off_t map_offset, aff4_off_t target_offset,
     {
         to_add = _MergeRanges(to_add);
         for (Range it : to_remove) {
-            map.erase(it.map_end());
+            EraseRange(it.map_end());
         }
 
         for (Range it : to_add) {
-            map[it.map_end()] = it;
+            InsertRange(it);
         }
     }
 
@@ -489,6 +565,13 @@ AFF4Status AFF4Map::AddRange(aff4_off_t map_offset, aff4_off_t target_offset,
 }
 
 AFF4Status AFF4Map::Flush() {
+    if (IsDirty() && dedup_blocks_checked > 0) {
+        resolver->logger->info(
+            "Map {}: {} of {} blocks deduplicated ({}%)", urn,
+            dedup_blocks_found, dedup_blocks_checked,
+            dedup_blocks_found * 100 / dedup_blocks_checked);
+    }
+
     if (IsDirty() && current_volume) {
         {
             // Get the volume we are stored on.
@@ -540,18 +623,223 @@ std::vector<Range> AFF4Map::GetRanges() const {
 }
 
 
+void AFF4Map::UpdateStats(const Range& range, bool add) {
+    uint64_t delta = add ? 1 : -1;
+
+    int bucket = 0;
+    while (bucket < 63 && (range.length >> (bucket + 1)) > 0) {
+        bucket++;
+    }
+
+    if (stats.target_bytes.size() <= range.target_id) {
+        stats.target_bytes.resize(range.target_id + 1);
+    }
+
+    stats.range_count += delta;
+    stats.length_histogram[bucket] += delta;
+    if (add) {
+        stats.mapped_bytes += range.length;
+        stats.target_bytes[range.target_id] += range.length;
+    } else {
+        stats.mapped_bytes -= range.length;
+        stats.target_bytes[range.target_id] -= range.length;
+    }
+}
+
+void AFF4Map::InsertRange(const Range& range) {
+    EraseRange(range.map_end());
+
+    map[range.map_end()] = range;
+    UpdateStats(range, true);
+}
+
+void AFF4Map::EraseRange(aff4_off_t map_end) {
+    auto it = map.find(map_end);
+    if (it != map.end()) {
+        UpdateStats(it->second, false);
+        map.erase(it);
+    }
+}
+
+AFF4MapStats AFF4Map::GetStats() const {
+    AFF4MapStats result = stats;
+
+    if (Size() > (aff4_off_t)result.mapped_bytes) {
+        result.hole_bytes = Size() - result.mapped_bytes;
+    }
+
+    return result;
+}
+
+
 void AFF4Map::Clear() {
     map.clear();
+    stats = AFF4MapStats();
     target_idx_map.clear();
     targets.clear();
 }
 
+// Returns true if the block consists of a single repeated byte, which is
+// stored in symbol. The block is compared a word at a time which the
+// compiler is able to vectorize.
+static bool _IsConstantBlock(const char* data, size_t length, uint8_t* symbol) {
+    if (length == 0) {
+        return false;
+    }
+
+    *symbol = static_cast<uint8_t>(data[0]);
+    uint64_t pattern = 0x0101010101010101ULL * *symbol;
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        if (word != pattern) {
+            return false;
+        }
+    }
+
+    for (; i < length; i++) {
+        if (static_cast<uint8_t>(data[i]) != *symbol) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+AFF4Stream* AFF4Map::GetSymbolicTarget(uint8_t symbol) {
+    auto it = symbolic_targets.find(symbol);
+    if (it != symbolic_targets.end()) {
+        return it->second;
+    }
+
+    URN target_urn;
+    if (symbol == 0) {
+        target_urn = URN(AFF4_IMAGESTREAM_ZERO);
+    } else if (symbol == 0xff) {
+        target_urn = URN(AFF4_IMAGESTREAM_FF);
+    } else {
+        target_urn = URN(aff4_sprintf(
+            "%s%02X", AFF4_IMAGESTREAM_SYMBOLIC_PREFIX, symbol));
+    }
+
+    // Reuse the target if the map already refers to it (e.g. it was
+    // opened from an existing volume).
+    AFF4Stream* result = nullptr;
+    for (auto target : targets) {
+        if (target->urn == target_urn) {
+            result = target;
+            break;
+        }
+    }
+
+    if (result == nullptr) {
+        AFF4Flusher<AFF4Stream> target = make_flusher<AFF4SymbolicStream>(
+            resolver, target_urn, symbol);
+        result = target.get();
+        GiveTarget(std::move(target));
+    }
+
+    symbolic_targets[symbol] = result;
+
+    return result;
+}
+
 AFF4Status AFF4Map::Write(const char* data, size_t length) {
-    AddRange(readptr, last_target->Size(), length, last_target);
+    // AddRange() changes last_target but data is always appended to
+    // the data stream.
+    AFF4Stream* data_target = last_target;
+
+    // Without elision or dedup the whole buffer is a single data block.
+    bool check_blocks = ((elide_constant_blocks || dedup_blocks) &&
+                         write_block_size > 0);
+    size_t block_size = check_blocks ? write_block_size : length;
+
+    // Digests refer to offsets in a particular data stream.
+    if (dedup_target != data_target) {
+        dedup_index.clear();
+        dedup_target = data_target;
+    }
 
-    // Append the data on the end of the stream.
-    last_target->Seek(0, SEEK_END);
-    RETURN_IF_ERROR(last_target->Write(data, length));
+    // Data blocks are collected and appended to the data stream in one
+    // go. pending is the length of data waiting to be written.
+    size_t pending = 0;
+    aff4_off_t pending_map_offset = readptr;
+    aff4_off_t data_size = data_target->Size();
+
+    for (size_t offset = 0; offset < length; offset += block_size) {
+        size_t block_length = std::min(block_size, length - offset);
+        const char* block = data + offset;
+        aff4_off_t map_offset = readptr + offset;
+
+        AFF4Stream* block_target = data_target;
+        aff4_off_t target_offset = 0;
+        bool is_data = true;
+
+        if (check_blocks && block_length == block_size) {
+            uint8_t symbol = 0;
+            if (elide_constant_blocks &&
+                    _IsConstantBlock(block, block_length, &symbol)) {
+                // Symbolic streams have the same content at every offset, so
+                // map them at the map offset to allow neighbouring ranges to
+                // merge.
+                block_target = GetSymbolicTarget(symbol);
+                target_offset = map_offset;
+                is_data = false;
+
+            } else if (dedup_blocks) {
+                // Blocks are matched by digest alone, so the hash must be
+                // collision resistant - otherwise crafted evidence could be
+                // imaged as different data.
+                std::string digest = SHA256Digest(block, block_length);
+                dedup_blocks_checked++;
+
+                auto it = dedup_index.find(digest);
+                if (it != dedup_index.end()) {
+                    target_offset = it->second;
+                    dedup_blocks_found++;
+                    is_data = false;
+
+                } else {
+                    if (dedup_index.size() >= dedup_index_size) {
+                        dedup_index.clear();
+                    }
+
+                    // The block will be appended after the pending data.
+                    dedup_index[digest] = data_size + pending;
+                }
+            }
+        }
+
+        if (is_data) {
+            pending += block_length;
+            continue;
+        }
+
+        // Flush pending data before mapping this block elsewhere.
+        if (pending > 0) {
+            AddRange(pending_map_offset, data_size, pending, data_target);
+            data_target->Seek(0, SEEK_END);
+            RETURN_IF_ERROR(data_target->Write(
+                                data + (pending_map_offset - readptr), pending));
+            data_size += pending;
+            pending = 0;
+        }
+
+        AddRange(map_offset, target_offset, block_length, block_target);
+        last_target = data_target;
+        pending_map_offset = map_offset + block_length;
+    }
+
+    if (pending > 0) {
+        AddRange(pending_map_offset, data_size, pending, data_target);
+
+        // Append the data on the end of the stream.
+        data_target->Seek(0, SEEK_END);
+        RETURN_IF_ERROR(data_target->Write(
+                            data + (pending_map_offset - readptr), pending));
+    }
 
     readptr += length;
 
@@ -562,12 +850,42 @@ AFF4Status AFF4Map::Write(const char* data, size_t length) {
 
 // This is the default WriteStream() which operates on linear streams. We just
 // copy the source into our data stream and then add a single range to the map
-// to encapsulate it.
+// to encapsulate it. When eliding constant blocks or deduplicating, the source
+// is instead passed through Write() so each block can be checked.
 AFF4Status AFF4Map::WriteStream(AFF4Stream* source, ProgressContext* progress) {
-    RETURN_IF_ERROR(last_target->WriteStream(source, progress));
+    if (!elide_constant_blocks && !dedup_blocks) {
+        RETURN_IF_ERROR(last_target->WriteStream(source, progress));
+
+        // Add a single range to cover the bulk of the image.
+        AddRange(0, 0, last_target->Size(), last_target);
+
+        return STATUS_OK;
+    }
+
+    DefaultProgress default_progress(resolver);
+    if (!progress) {
+        progress = &default_progress;
+    }
+
+    // The source is read from its current position, so non-seekable
+    // sources work too.
+    RETURN_IF_ERROR(Seek(0, SEEK_SET));
 
-    // Add a single range to cover the bulk of the image.
-    AddRange(0, 0, last_target->Size(), last_target);
+    std::string buffer(BUFF_SIZE, 0);
+    while (1) {
+        size_t length = buffer.size();
+        RETURN_IF_ERROR(source->ReadBuffer(&buffer[0], &length));
+        if (length == 0) {
+            break;
+        }
+
+        RETURN_IF_ERROR(Write(buffer.data(), length));
+
+        // Report the data read from the source.
+        if (!progress->Report(source->Tell())) {
+            return ABORTED;
+        }
+    }
 
     return STATUS_OK;
 }
@@ -601,6 +919,65 @@ AFF4Status AFF4Map::CopyStreamFromMap(
     return STATUS_OK;
 }
 
+// Ranges pointing at these targets read back as zeros, so they need not be
+// written to a sparse output.
+static bool _IsZeroTarget(const AFF4Stream* target) {
+    return (target->urn == AFF4_IMAGESTREAM_ZERO ||
+            target->urn == AFF4_LEGACY_IMAGESTREAM_ZERO ||
+            target->urn == aff4_sprintf(
+                "%s%02X", AFF4_IMAGESTREAM_SYMBOLIC_PREFIX, 0));
+}
+
+// Copy the logical content of the map into the output stream, but only write
+// the mapped, non-zero ranges. Unmapped regions and ranges targeting the zero
+// stream are seeked over so they become holes in the output file and the copy
+// time is proportional to the mapped data rather than the map's size.
+AFF4Status AFF4Map::CopyToSparseStream(
+    AFF4Stream& output, ProgressContext* progress) {
+    DefaultProgress default_progress(resolver);
+    if (!progress) {
+        progress = &default_progress;
+    }
+
+    // We can not leave holes in a stream we can not seek, so fall back
+    // to copying every byte.
+    if (!output.properties.seekable) {
+        return output.WriteStream(this, progress);
+    }
+
+    aff4_off_t start = output.Tell();
+    aff4_off_t total_size = Size();
+
+    for (auto &range: GetRanges()) {
+        if (range.map_offset >= (uint64_t)total_size) {
+            break;
+        }
+
+        AFF4Stream *target_stream = targets[range.target_id];
+        if (_IsZeroTarget(target_stream)) {
+            continue;
+        }
+
+        aff4_off_t length = std::min(
+            (aff4_off_t)range.length,
+            (aff4_off_t)(total_size - range.map_offset));
+
+        RETURN_IF_ERROR(output.Seek(start + range.map_offset, SEEK_SET));
+        RETURN_IF_ERROR(target_stream->Seek(range.target_offset, SEEK_SET));
+        RETURN_IF_ERROR(target_stream->CopyToStream(
+                            output, length, progress));
+    }
+
+    // If the map ends in a hole, extend the output to its full size by
+    // writing the last byte.
+    if (output.Size() < start + total_size) {
+        RETURN_IF_ERROR(output.Seek(start + total_size - 1, SEEK_SET));
+        RETURN_IF_ERROR(output.Write("\0", 1));
+    }
+
+    return STATUS_OK;
+}
+
 bool AFF4Map::CanSwitchVolume() {
     for (auto x: targets) {
         if (!x->CanSwitchVolume()) {
@@ -22,6 +22,7 @@ specific language governing permissions and limitations under the License.
 #include "aff4/volume_group.h"
 
 #include <map>
+#include <unordered_map>
 
 
 namespace aff4 {
@@ -55,6 +56,24 @@ class Range: public BinaryRange {
 };
 
 
+// Summary of a map's layout.
+struct AFF4MapStats {
+    uint64_t range_count = 0;
+
+    // Bytes covered by ranges and bytes of the stream not covered by
+    // any range.
+    uint64_t mapped_bytes = 0;
+    uint64_t hole_bytes = 0;
+
+    // Number of ranges by length: bucket i counts ranges where
+    // 2^i <= length < 2^(i+1).
+    std::vector<uint64_t> length_histogram = std::vector<uint64_t>(64);
+
+    // Mapped bytes for each target, indexed by target id.
+    std::vector<uint64_t> target_bytes;
+};
+
+
 class AFF4Map: public AFF4Stream {
   protected:
     // The target of the next Write() operation.
@@ -62,6 +81,25 @@ class AFF4Map: public AFF4Stream {
 
     aff4_off_t size = 0; // Logical size of the map stream
 
+    // Symbolic streams used for constant blocks, keyed by their byte.
+    std::map<uint8_t, AFF4Stream*> symbolic_targets;
+
+    AFF4Stream* GetSymbolicTarget(uint8_t symbol);
+
+    // Maps block digests to the offset of the block in
+    // dedup_target. Cleared when it reaches dedup_index_size entries.
+    std::unordered_map<std::string, aff4_off_t> dedup_index;
+    AFF4Stream* dedup_target = nullptr;
+
+    // Layout statistics, updated as ranges are inserted and erased.
+    AFF4MapStats stats;
+
+    // All changes to the map should go through these to keep stats
+    // current.
+    void InsertRange(const Range& range);
+    void EraseRange(aff4_off_t map_end);
+    void UpdateStats(const Range& range, bool add);
+
   public:
     // The target list. Non-owning references.
     std::vector<AFF4Stream*> targets;
@@ -71,6 +109,9 @@ class AFF4Map: public AFF4Stream {
     // until we get destroyed.
     std::vector<AFF4Flusher<AFF4Stream>> our_targets;
 
+    // Targets shared with other users of the volume group.
+    std::vector<std::shared_ptr<AFF4Stream>> shared_targets;
+
     std::map<aff4_off_t, Range> map;
 
     // We write our data to this volume.
@@ -83,6 +124,27 @@ class AFF4Map: public AFF4Stream {
     // an unreadable region.
     size_t max_reread_size = 4096;
 
+    // Write() examines its data in blocks of write_block_size bytes.
+    size_t write_block_size = 4096;
+
+    // When set, blocks consisting of a single repeated byte are mapped
+    // to the corresponding symbolic stream instead of being stored in
+    // the data stream. Off by default so the data stream keeps an exact
+    // copy of everything written.
+    bool elide_constant_blocks = false;
+
+    // When set, blocks identical to a block already written to the data
+    // stream are mapped to the earlier copy instead of being stored
+    // again. Blocks are compared by their SHA-256 digest.
+    bool dedup_blocks = false;
+
+    // The maximum number of digests remembered for deduplication.
+    size_t dedup_index_size = 1024 * 1024;
+
+    // Deduplication statistics.
+    uint64_t dedup_blocks_checked = 0;
+    uint64_t dedup_blocks_found = 0;
+
     bool CanSwitchVolume() override;
     AFF4Status SwitchVolume(AFF4Volume *volume) override;
 
@@ -118,6 +180,11 @@ class AFF4Map: public AFF4Stream {
     void GiveTarget(AFF4Flusher<AFF4Stream> &&target);
 
     AFF4Status ReadBuffer(char* data, size_t* length) override;
+
+    // Splits the requests along the map's ranges and issues a single
+    // ReadV() to each target.
+    AFF4Status ReadV(std::vector<AFF4ReadRequest>& requests) override;
+
     AFF4Status Write(const char* data, size_t length) override;
 
     AFF4Status WriteStream(
@@ -126,6 +193,12 @@ class AFF4Map: public AFF4Stream {
 
     AFF4Status Flush() override;
 
+    // Copies the logical content of the map into output. Unmapped
+    // regions and ranges backed by the zero stream are skipped over
+    // rather than written, leaving holes in a sparse output file.
+    AFF4Status CopyToSparseStream(
+        AFF4Stream& output, ProgressContext* progress = nullptr);
+
     AFF4Status AddRange(aff4_off_t map_offset, aff4_off_t target_offset,
                         aff4_off_t length,
                         AFF4Stream* target /* Not owned */);
@@ -134,6 +207,10 @@ class AFF4Map: public AFF4Stream {
 
     std::vector<Range> GetRanges() const;
 
+    // Returns the layout statistics. These are maintained as ranges
+    // are added so this is cheap.
+    AFF4MapStats GetStats() const;
+
     void Clear();
 
     aff4_off_t Size() const override;
@@ -56,4 +56,13 @@ namespace aff4 {
         }
         return STATUS_OK;
     }
+
+    bool AFF4SymbolicStream::CanSwitchVolume() {
+        return true;
+    }
+
+    AFF4Status AFF4SymbolicStream::SwitchVolume(AFF4Volume *volume) {
+        UNUSED(volume);
+        return STATUS_OK;
+    }
 } // namespace aff4
@@ -26,6 +26,11 @@ class AFF4SymbolicStream: public AFF4Stream {
 
     AFF4Status ReadBuffer(char* data, size_t* length) override;
 
+    // Symbolic streams are not stored in any volume so they never
+    // prevent a volume switch.
+    bool CanSwitchVolume() override;
+    AFF4Status SwitchVolume(AFF4Volume *volume) override;
+
  protected:
     uint8_t symbol;
     std::string pattern;
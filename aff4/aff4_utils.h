@@ -21,6 +21,8 @@ specific language governing permissions and limitations under the License.
 #include <vector>
 #include <string>
 #include <sstream>
+#include <memory>
+#include <mutex>
 
 #include "spdlog/spdlog.h"
 
@@ -36,6 +38,9 @@ std::vector<std::string> split(const std::string& s, char delim);
 
 std::shared_ptr<spdlog::logger> get_logger();
 
+// Returns the raw 32 byte SHA-256 digest of the data.
+std::string SHA256Digest(const char* data, size_t length);
+
 #define RETURN_IF_ERROR(expr)                   \
     do {                                        \
         AFF4Status res = (expr);                \
@@ -48,6 +53,130 @@ std::shared_ptr<spdlog::logger> get_logger();
 // A portable version of fnmatch.
 int fnmatch(const char *pattern, const char *string);
 
+// A heap buffer whose start is aligned to a power of two, as required
+// for direct I/O.
+class AlignedBuffer {
+  public:
+    AlignedBuffer() = default;
+    AlignedBuffer(size_t size, size_t alignment);
+    ~AlignedBuffer();
+
+    AlignedBuffer(AlignedBuffer&& other) noexcept;
+    AlignedBuffer& operator=(AlignedBuffer&& other) noexcept;
+
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    char* data() const {
+        return buffer;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+  private:
+    char* buffer = nullptr;
+    size_t length = 0;
+};
+
+class BufferPool;
+
+// A buffer borrowed from a BufferPool. The buffer goes back to the pool
+// when the handle is destroyed.
+class PooledBuffer {
+  public:
+    PooledBuffer() = default;
+    ~PooledBuffer();
+
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    char* data() const {
+        return buffer;
+    }
+
+    size_t size() const;
+
+    explicit operator bool() const {
+        return buffer != nullptr;
+    }
+
+  private:
+    friend class BufferPool;
+
+    std::shared_ptr<BufferPool> pool;
+    char* buffer = nullptr;
+
+    // Set when the buffer was mapped from huge pages.
+    bool mapped = false;
+};
+
+// A pool of equally sized buffers which are recycled rather than freed,
+// so a long running acquisition does not keep going back to the
+// allocator. Buffers are aligned for direct I/O. With huge_pages set,
+// buffers are backed by 2 MiB pages where the system allows it, which
+// cuts TLB misses when streaming through large buffers. Buffers smaller
+// than a huge page are carved out of shared 2 MiB slabs rather than
+// each taking a whole huge page. Slabs are only freed with the pool.
+//
+// The pool is thread safe. Handles keep the pool alive.
+class BufferPool: public std::enable_shared_from_this<BufferPool> {
+  public:
+    // Up to max_free released buffers are kept for reuse.
+    static std::shared_ptr<BufferPool> NewBufferPool(
+        size_t buffer_size, size_t max_free, bool huge_pages = false);
+
+    ~BufferPool();
+
+    // Returns a free buffer, allocating a new one if there are none.
+    // The handle is empty if we are out of memory.
+    PooledBuffer Acquire();
+
+    size_t buffer_size() const {
+        return buffer_size_;
+    }
+
+    // The number of buffers allocated over the pool's lifetime.
+    size_t allocations() const;
+
+    // The memory currently held by the pool and its handles.
+    size_t allocated_bytes() const;
+
+  private:
+    friend class PooledBuffer;
+
+    BufferPool(size_t buffer_size, size_t max_free, bool huge_pages);
+
+    void Release(char* buffer, bool mapped);
+    char* Allocate(size_t size, bool* mapped);
+    void Free(char* buffer, size_t size, bool mapped);
+
+    // Carves a new slab into free buffers. Called with the mutex held.
+    bool AddSlab();
+
+    // The size actually allocated for each buffer.
+    size_t allocation_size() const;
+
+    size_t buffer_size_;
+    size_t max_free;
+    bool huge_pages;
+
+    // Set when buffers are carved out of slabs, every slab_stride
+    // bytes.
+    bool use_slabs = false;
+    size_t slab_stride = 0;
+
+    mutable std::mutex mutex;
+    std::vector<std::pair<char*, bool>> free_buffers;
+    std::vector<std::pair<char*, bool>> slabs;
+    size_t allocations_ = 0;
+    size_t allocated_bytes_ = 0;
+};
+
 inline bool hasEnding(std::string const &fullString, std::string const &ending) {
     if (fullString.length() >= ending.length()) {
         return (0 == fullString.compare(
@@ -22,6 +22,8 @@
 #include <spdlog/spdlog.h>
 #include <iostream>
 #include <mutex>
+#include <atomic>
+#include <algorithm>
 #include "aff4/aff4_symstream.h"
 
 namespace aff4 {
@@ -177,72 +179,352 @@ public:
     }
 };
 
-static std::unique_ptr<RDFValue> RDFValueFromRaptorTerm(DataStore* resolver, raptor_term* term) {
+/**
+ * Writes the subset of Turtle produced by AFF4: statements grouped by
+ * subject and predicate, with IRIs abbreviated through the known
+ * namespaces. Output is buffered and written to the stream in large
+ * pieces rather than accumulated in memory.
+ *
+ * Statements must be added grouped by subject.
+ */
+class TurtleWriter {
+  public:
+    TurtleWriter(AFF4Stream& output,
+                 const std::vector<std::pair<std::string, std::string>>& namespaces):
+        output(output), namespaces(namespaces) {
+        for (const auto& it : namespaces) {
+            buffer += "@prefix " + it.first + ": <";
+            WriteEscapedIRI(it.second);
+            buffer += "> .\n";
+        }
+    }
+
+    AFF4Status AddStatement(const URN& subject, const URN& predicate,
+                            const RDFValue* value) {
+        if (has_subject && subject.value == last_subject) {
+            if (predicate.value == last_predicate) {
+                buffer += " ,\n        ";
+            } else {
+                buffer += " ;\n    ";
+                WritePredicate(predicate);
+            }
+        } else {
+            if (has_subject) {
+                buffer += " .\n";
+            }
+
+            buffer += "\n";
+            WriteIRI(subject.value);
+            buffer += "\n    ";
+            WritePredicate(predicate);
+
+            last_subject = subject.value;
+            has_subject = true;
+        }
+
+        last_predicate = predicate.value;
+        WriteObject(value);
+
+        if (buffer.size() > BUFFER_SIZE) {
+            return FlushBuffer();
+        }
+
+        return STATUS_OK;
+    }
+
+    AFF4Status Finalize() {
+        if (has_subject) {
+            buffer += " .\n";
+        }
+
+        return FlushBuffer();
+    }
+
+  private:
+    // Output is written to the stream in pieces of about this size.
+    static const size_t BUFFER_SIZE = 1024 * 1024;
+
+    AFF4Stream& output;
+    const std::vector<std::pair<std::string, std::string>>& namespaces;
+    std::string buffer;
+
+    std::string last_subject;
+    std::string last_predicate;
+    bool has_subject = false;
+
+    AFF4Status FlushBuffer() {
+        AFF4Status res = output.Write(buffer.data(), buffer.size());
+        buffer.clear();
+
+        return res;
+    }
+
+    void WritePredicate(const URN& predicate) {
+        if (predicate == AFF4_TYPE) {
+            buffer += "a ";
+        } else {
+            WriteIRI(predicate.value);
+            buffer += " ";
+        }
+    }
+
+    void WriteObject(const RDFValue* value) {
+        const URN* urn = dynamic_cast<const URN*>(value);
+        if (urn) {
+            WriteIRI(urn->value);
+            return;
+        }
+
+        WriteEscapedLiteral(value->SerializeToString());
+
+        const char* datatype = value->GetDatatype();
+        if (datatype) {
+            buffer += "^^";
+            WriteIRI(datatype);
+        }
+    }
+
+    // Writes the IRI as a prefixed name if it falls in a known
+    // namespace and the remainder is a simple local name.
+    void WriteIRI(const std::string& iri) {
+        for (const auto& it : namespaces) {
+            const std::string& ns = it.second;
+            if (iri.size() > ns.size() &&
+                iri.compare(0, ns.size(), ns) == 0 &&
+                IsSimpleLocalName(iri, ns.size())) {
+                buffer += it.first;
+                buffer += ':';
+                buffer.append(iri, ns.size(), std::string::npos);
+                return;
+            }
+        }
+
+        buffer += '<';
+        WriteEscapedIRI(iri);
+        buffer += '>';
+    }
+
+    // A conservative subset of the Turtle PN_LOCAL production: a
+    // letter or underscore followed by letters, digits, '_' or '-'.
+    static bool IsSimpleLocalName(const std::string& iri, size_t start) {
+        for (size_t i = start; i < iri.size(); i++) {
+            unsigned char c = static_cast<unsigned char>(iri[i]);
+            bool valid = i == start ?
+                isalpha(c) || c == '_' :
+                isalnum(c) || c == '_' || c == '-';
+            if (!valid) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void WriteEscapedIRI(const std::string& iri) {
+        for (char c : iri) {
+            unsigned char u = static_cast<unsigned char>(c);
+            if (u <= 0x20 || c == '<' || c == '>' || c == '"' || c == '{' ||
+                c == '}' || c == '|' || c == '^' || c == '`' || c == '\\') {
+                WriteUnicodeEscape(u);
+            } else {
+                buffer += c;
+            }
+        }
+    }
+
+    void WriteEscapedLiteral(const std::string& literal) {
+        buffer += '"';
+        for (char c : literal) {
+            switch (c) {
+                case '"': buffer += "\\\""; break;
+                case '\\': buffer += "\\\\"; break;
+                case '\n': buffer += "\\n"; break;
+                case '\r': buffer += "\\r"; break;
+                case '\t': buffer += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        WriteUnicodeEscape(c);
+                    } else {
+                        buffer += c;
+                    }
+            }
+        }
+        buffer += '"';
+    }
+
+    void WriteUnicodeEscape(unsigned char c) {
+        buffer += "\\u00";
+        buffer += lut[c >> 4];
+        buffer += lut[c & 0xf];
+    }
+};
+
+// Builds values for the common XSD types directly, without a registry
+// lookup. Returns nullptr for other types.
+static std::shared_ptr<RDFValue> RDFValueFromKnownDatatype(
+    DataStore* resolver, const char* datatype, const char* value,
+    size_t length) {
+    std::shared_ptr<RDFValue> result;
+
+    if (strcmp(datatype, XSDIntegerType) == 0 ||
+        strcmp(datatype, XSDIntegerTypeLong) == 0 ||
+        strcmp(datatype, XSDIntegerTypeInt) == 0) {
+        result = resolver->MakeValue<XSDInteger>();
+    } else if (strcmp(datatype, XSDStringType) == 0) {
+        result = resolver->MakeValue<XSDString>();
+    } else if (strcmp(datatype, XSDBooleanType) == 0) {
+        result = resolver->MakeValue<XSDBoolean>();
+    } else {
+        return nullptr;
+    }
+
+    if (result->UnSerializeFromString(value, length) != STATUS_OK) {
+        return nullptr;
+    }
+
+    return result;
+}
+
+static std::shared_ptr<RDFValue> RDFValueFromRaptorTerm(DataStore* resolver, raptor_term* term) {
     if (term->type == RAPTOR_TERM_TYPE_URI) {
-        char* uri = reinterpret_cast<char*>(raptor_uri_to_string(term->value.uri));
-        std::unique_ptr<RDFValue> result(new URN(uri));
-        raptor_free_memory(uri);
-        return result;
+        size_t length;
+        char* uri = reinterpret_cast<char*>(
+            raptor_uri_as_counted_string(term->value.uri, &length));
+        return resolver->MakeValue<URN>(std::string(uri, length));
     }
 
     if (term->type == RAPTOR_TERM_TYPE_LITERAL) {
+        const char* value_data = reinterpret_cast<char*>(
+            term->value.literal.string);
+        size_t value_length = term->value.literal.string_len;
+
         // Does it have a special data type?
         if (term->value.literal.datatype) {
-            char* uri = reinterpret_cast<char*>(raptor_uri_to_string(term->value.literal.datatype));
+            char* uri = reinterpret_cast<char*>(
+                raptor_uri_as_string(term->value.literal.datatype));
+
+            std::shared_ptr<RDFValue> known = RDFValueFromKnownDatatype(
+                resolver, uri, value_data, value_length);
+            if (known) {
+                return known;
+            }
 
-            std::unique_ptr<RDFValue> result =
-                RDFValueRegistry.CreateInstance(uri, resolver);
+            std::unique_ptr<RDFValue> result = RDFValueRegistry.CreateInstance(
+                uri, resolver);
             // If we do not know how to handle this type we skip it.
             if (!result) {
-                raptor_free_memory(uri);
                 return nullptr;
             }
 
-            raptor_free_memory(uri);
-
-            std::string value_string(
-                reinterpret_cast<char*>(term->value.literal.string),
-                term->value.literal.string_len);
-
-            if (result->UnSerializeFromString(value_string) != STATUS_OK) {
+            if (result->UnSerializeFromString(
+                    value_data, value_length) != STATUS_OK) {
                 return nullptr;
             }
 
-            return result;
+            return std::shared_ptr<RDFValue>(std::move(result));
 
             // No special type - this is just a string.
         } else {
-            std::string value_string(
-                reinterpret_cast<char*>(term->value.literal.string),
-                term->value.literal.string_len);
-
-            return std::unique_ptr<RDFValue>(new XSDString(value_string));
+            return resolver->MakeValue<XSDString>(
+                std::string(value_data, value_length));
         }
     }
     return nullptr;
 }
 
+// Adds parsed statements to a MemoryDataStore. Statements are queued
+// and added in batches so the store's lock is not taken per statement.
+class TurtleLoader {
+  public:
+    static const size_t BATCH_SIZE = 4096;
+
+    TurtleLoader(MemoryDataStore* store, bool merge):
+        store(store), merge(merge) {
+        pending.reserve(BATCH_SIZE);
+    }
+
+    ~TurtleLoader() {
+        Flush();
+    }
+
+    void Add(std::string subject, std::string predicate,
+             std::shared_ptr<RDFValue> value) {
+        pending.push_back({std::move(subject), std::move(predicate),
+                           std::move(value)});
+
+        if (pending.size() >= BATCH_SIZE) {
+            Flush();
+        }
+    }
+
+    void Flush() {
+        if (pending.empty()) {
+            return;
+        }
+
+        {
+            std::lock_guard<ReadMostlyLock> guard(*store->lock);
+
+            for (auto& statement: pending) {
+                MemoryDataStore::Atom subject = store->atoms.Intern(
+                    statement.subject);
+                MemoryDataStore::Atom predicate = store->atoms.Intern(
+                    statement.predicate);
+
+                // When merging, the first value seen for a pair replaces
+                // the existing ones and later values are added to it.
+                bool replace = false;
+                if (merge) {
+                    replace = seen.insert(
+                        MemoryDataStore::PairKey(subject, predicate)).second;
+                }
+
+                store->SetLocked(subject, predicate,
+                                 std::move(statement.value), replace);
+            }
+        }
+
+        pending.clear();
+    }
+
+    MemoryDataStore* store;
+
+  private:
+    struct Pending {
+        std::string subject;
+        std::string predicate;
+        std::shared_ptr<RDFValue> value;
+    };
+
+    bool merge;
+    std::vector<Pending> pending;
+    std::unordered_set<uint64_t> seen;
+};
+
 static void statement_handler(void* user_data, raptor_statement* statement) {
-    DataStore* resolver = reinterpret_cast<DataStore*>(user_data);
+    TurtleLoader* loader = reinterpret_cast<TurtleLoader*>(user_data);
 
     if (statement->subject->type == RAPTOR_TERM_TYPE_URI &&
         statement->predicate->type == RAPTOR_TERM_TYPE_URI) {
-        char* subject = reinterpret_cast<char*>(
-            raptor_uri_to_string(statement->subject->value.uri));
-
-        char* predicate = reinterpret_cast<char*>(
-            raptor_uri_to_string(statement->predicate->value.uri));
-
-        std::unique_ptr<RDFValue> object(
-            RDFValueFromRaptorTerm(resolver, statement->object));
+        std::shared_ptr<RDFValue> object(
+            RDFValueFromRaptorTerm(loader->store, statement->object));
 
         if (object.get()) {
-            resolver->Set(URN(subject), URN(predicate), std::move(object),
-                          /* replace = */ false);
+            // These point into the parser's own copies of the URIs so
+            // nothing needs to be freed.
+            size_t subject_length, predicate_length;
+            char* subject = reinterpret_cast<char*>(
+                raptor_uri_as_counted_string(
+                    statement->subject->value.uri, &subject_length));
+
+            char* predicate = reinterpret_cast<char*>(
+                raptor_uri_as_counted_string(
+                    statement->predicate->value.uri, &predicate_length));
+
+            loader->Add(std::string(subject, subject_length),
+                        std::string(predicate, predicate_length),
+                        std::move(object));
         }
-
-        raptor_free_memory(subject);
-        raptor_free_memory(predicate);
     }
 }
 
@@ -250,22 +532,23 @@ class RaptorParser {
 protected:
     raptor_world* world;
     raptor_parser* parser;
-    DataStore* resolver;
+    TurtleLoader* loader;
+    bool finished;
 
-    explicit RaptorParser(DataStore* resolver) :
-        world(nullptr), parser(nullptr), resolver(resolver) {
+    explicit RaptorParser(TurtleLoader* loader) :
+        world(nullptr), parser(nullptr), loader(loader), finished(false) {
     }
 
 public:
-    static std::unique_ptr<RaptorParser> NewRaptorParser(DataStore* resolver) {
-        std::unique_ptr<RaptorParser> result(new RaptorParser(resolver));
+    static std::unique_ptr<RaptorParser> NewRaptorParser(TurtleLoader* loader) {
+        std::unique_ptr<RaptorParser> result(new RaptorParser(loader));
 
         result->world = raptor_world_pool.get();
 
         result->parser = raptor_new_parser(result->world, "turtle");
 
         raptor_parser_set_statement_handler(
-            result->parser, resolver, statement_handler);
+            result->parser, loader, statement_handler);
 
         // Dont talk to the internet
         raptor_parser_set_option(
@@ -285,10 +568,21 @@ public:
         return result;
     }
 
-    AFF4Status Parse(std::string buffer) {
+    // Parses the next piece of the document. Statements may span
+    // pieces.
+    AFF4Status Parse(const char* buffer, size_t length) {
         if (raptor_parser_parse_chunk(
-                parser, (const unsigned char*) buffer.c_str(),
-                buffer.size(), 1)) {
+                parser, (const unsigned char*) buffer, length, 0)) {
+            return PARSING_ERROR;
+        }
+
+        return STATUS_OK;
+    }
+
+    // Signals the end of the document and parses anything left over.
+    AFF4Status Finish() {
+        finished = true;
+        if (raptor_parser_parse_chunk(parser, nullptr, 0, 1)) {
             return PARSING_ERROR;
         }
 
@@ -297,7 +591,9 @@ public:
 
     ~RaptorParser() {
         // Flush the parser.
-        raptor_parser_parse_chunk(parser, nullptr, 0, 1);
+        if (!finished) {
+            raptor_parser_parse_chunk(parser, nullptr, 0, 1);
+        }
 
         if (parser != nullptr) {
             raptor_free_parser(parser);
@@ -309,67 +605,174 @@ public:
     }
 };
 
-AFF4Status MemoryDataStore::DumpToTurtle(AFF4Stream& output_stream, URN base, bool verbose) {
-    std::unique_ptr<RaptorSerializer> serializer(
-        RaptorSerializer::NewRaptorSerializer(base, namespaces));
-    if (!serializer) {
-        return MEMORY_ERROR;
+void MemoryDataStore::CollectStatements(
+    Atom subject, const AtomAttributes::value_type& pair, bool verbose,
+    std::vector<Statement>& statements) {
+    URN predicate = atoms.String(pair.first);
+
+    // Volatile predicates are suppressed.
+    if (!verbose) {
+        if (0 == predicate.value.compare(
+                0,
+                strlen(AFF4_VOLATILE_NAMESPACE),
+                AFF4_VOLATILE_NAMESPACE)) {
+            return;
+        }
     }
 
-    for (const auto& it : store) {
-        URN subject = it.first;
+    // Load all attributes.
+    URN subject_urn = atoms.String(subject);
+    for (const auto& a: pair.second) {
+        statements.push_back({subject_urn, predicate, a});
+    }
+}
 
-        for (const auto& attr_it : it.second) {
-            URN predicate = attr_it.first;
+AFF4Status MemoryDataStore::WriteTurtle(
+    AFF4Stream& output_stream, URN base,
+    const std::vector<Statement>& statements) {
+    if (use_raptor_serializer) {
+        std::unique_ptr<RaptorSerializer> serializer(
+            RaptorSerializer::NewRaptorSerializer(base, namespaces));
+        if (!serializer) {
+            return MEMORY_ERROR;
+        }
 
-            // Volatile predicates are suppressed.
-            if (!verbose) {
-                if (0 == predicate.value.compare(
-                        0,
-                        strlen(AFF4_VOLATILE_NAMESPACE),
-                        AFF4_VOLATILE_NAMESPACE)) {
-                    continue;
-                }
+        for (const auto& statement: statements) {
+            const RDFValue* value = statement.value.get();
+
+            // Skip this URN if it is in the suppressed_rdftypes set.
+            if (ShouldSuppress(statement.subject, statement.predicate,
+                               value->SerializeToString()))
+                continue;
+
+            serializer->AddStatement(statement.subject, statement.predicate, value);
+        }
+
+        output_stream.Write(serializer->Finalize());
+
+        return STATUS_OK;
+    }
+
+    TurtleWriter writer(output_stream, namespaces);
+    for (const auto& statement: statements) {
+        const RDFValue* value = statement.value.get();
+
+        // Skip this URN if it is in the suppressed_rdftypes set.
+        if (ShouldSuppress(statement.subject, statement.predicate,
+                           value->SerializeToString()))
+            continue;
+
+        AFF4Status res = writer.AddStatement(
+            statement.subject, statement.predicate, value);
+        if (res != STATUS_OK) {
+            return res;
+        }
+    }
+
+    return writer.Finalize();
+}
+
+AFF4Status MemoryDataStore::DumpToTurtle(AFF4Stream& output_stream, URN base, bool verbose) {
+    // Take a snapshot of the statements so ShouldSuppress() can query
+    // the store without the lock held.
+    std::vector<Statement> statements;
+
+    {
+        SharedLockGuard guard(*lock);
+
+        for (const auto& it : store) {
+            for (const auto& attr_it : it.second) {
+                CollectStatements(it.first, attr_it, verbose, statements);
             }
+        }
+    }
+
+    return WriteTurtle(output_stream, base, statements);
+}
+
+AFF4Status MemoryDataStore::DumpChangesToTurtle(
+    AFF4Stream& output_stream, URN base, uint64_t since, bool verbose) {
+    std::vector<Statement> statements;
 
-            // Load all attributes.
-            for (const auto& a: attr_it.second) {
-                const RDFValue* value = a.get();
+    {
+        SharedLockGuard guard(*lock);
 
-                // Skip this URN if it is in the suppressed_rdftypes set.
-                if (ShouldSuppress(
-                        subject, predicate, value->SerializeToString()))
-                    continue;
+        if (deletion_generation > since) {
+            return NOT_IMPLEMENTED;
+        }
+
+        // Sorting the pair keys groups the statements by subject.
+        std::vector<uint64_t> changed;
+        for (const auto& it : changes) {
+            if (it.second > since) {
+                changed.push_back(it.first);
+            }
+        }
+        std::sort(changed.begin(), changed.end());
+
+        for (uint64_t key : changed) {
+            auto subject_it = store.find(key >> 32);
+            if (subject_it == store.end()) {
+                continue;
+            }
 
-                serializer->AddStatement(subject, predicate, value);
+            auto pair_it = subject_it->second.find(key & 0xffffffff);
+            if (pair_it == subject_it->second.end()) {
+                continue;
             }
+
+            CollectStatements(subject_it->first, *pair_it, verbose, statements);
         }
     }
 
-    output_stream.Write(serializer->Finalize());
+    return WriteTurtle(output_stream, base, statements);
+}
 
-    return STATUS_OK;
+uint64_t MemoryDataStore::Generation() {
+    SharedLockGuard guard(*lock);
+
+    return generation;
 }
 
+// LoadFromTurtle() reads its input in pieces of this size.
+static const size_t TURTLE_LOAD_CHUNK_SIZE = 1024 * 1024;
+
 AFF4Status MemoryDataStore::LoadFromTurtle(AFF4Stream& stream) {
-    std::unique_ptr<RaptorParser> parser(RaptorParser::NewRaptorParser(this));
+    return ParseTurtle(stream, /* merge = */ false);
+}
+
+AFF4Status MemoryDataStore::MergeFromTurtle(AFF4Stream& stream) {
+    return ParseTurtle(stream, /* merge = */ true);
+}
+
+AFF4Status MemoryDataStore::ParseTurtle(AFF4Stream& stream, bool merge) {
+    TurtleLoader loader(this, merge);
+    std::unique_ptr<RaptorParser> parser(RaptorParser::NewRaptorParser(&loader));
     if (!parser) {
         return MEMORY_ERROR;
     }
 
+    // Feed the parser in bounded pieces so large turtle files are
+    // never held in memory as a whole.
+    std::string buffer(TURTLE_LOAD_CHUNK_SIZE, 0);
     while (1) {
-        std::string buffer = stream.Read(stream.Size());
-        if (buffer.size() == 0) {
+        size_t length = buffer.size();
+        AFF4Status res = stream.ReadBuffer(&buffer[0], &length);
+        if (res != STATUS_OK) {
+            return res;
+        }
+
+        if (length == 0) {
             break;
         }
 
-        AFF4Status res = parser->Parse(buffer);
+        res = parser->Parse(buffer.data(), length);
         if (res != STATUS_OK) {
             return res;
         }
     }
 
-    return STATUS_OK;
+    return parser->Finish();
 }
 
 void MemoryDataStore::Set(const URN& urn, const URN& attribute, RDFValue* value,
@@ -381,64 +784,246 @@ void MemoryDataStore::Set(const URN& urn, const URN& attribute, RDFValue* value,
 
 void MemoryDataStore::Set(const URN& urn, const URN& attribute,
                           std::shared_ptr<RDFValue> value, bool replace) {
+    std::lock_guard<ReadMostlyLock> guard(*lock);
+
+    SetTrackedLocked(urn.value, attribute.value, std::move(value), replace);
+}
+
+void MemoryDataStore::SetBatch(StatementBatch& batch) {
+    {
+        std::lock_guard<ReadMostlyLock> guard(*lock);
+
+        for (auto& statement: batch) {
+            SetTrackedLocked(statement.subject.value, statement.predicate.value,
+                             std::move(statement.value), statement.replace);
+        }
+    }
+
+    batch.clear();
+}
+
+void MemoryDataStore::SetTrackedLocked(
+    const std::string& subject_name, const std::string& predicate_name,
+    std::shared_ptr<RDFValue> value, bool replace) {
+    Atom subject = atoms.Intern(subject_name);
+    Atom predicate = atoms.Intern(predicate_name);
+
+    SetLocked(subject, predicate, std::move(value), replace);
+
+    if (track_changes) {
+        changes[PairKey(subject, predicate)] = ++generation;
+    }
+}
+
+void MemoryDataStore::SetLocked(Atom subject, Atom predicate,
+                                std::shared_ptr<RDFValue> value, bool replace) {
     // Automatically create needed keys.
-    std::vector<std::shared_ptr<RDFValue>> values = store[urn.SerializeToString()][
-        attribute.SerializeToString()];
+    auto subject_it = store.find(subject);
+    if (subject_it == store.end()) {
+        subject_it = store.emplace(subject, AtomAttributes()).first;
+        subject_order.insert(&atoms.String(subject));
+    }
 
-    if (replace) values.clear();
+    std::vector<std::shared_ptr<RDFValue>>& values =
+        subject_it->second[predicate];
 
-    values.push_back(std::move(value));
+    if (replace) {
+        UnindexValues(subject, predicate, values);
+        values.clear();
+    }
 
-    store[urn.SerializeToString()][attribute.SerializeToString()] = values;
+    IndexValue(subject, predicate, *value);
+    values.push_back(std::move(value));
 }
 
-AFF4Status MemoryDataStore::Get(const URN& urn, const URN& attribute,
-                                RDFValue& value) {
-    auto urn_it = store.find(urn.SerializeToString());
+MemoryDataStore::AtomAttributes* MemoryDataStore::FindSubject(const URN& urn) {
+    Atom subject;
+    if (!atoms.Lookup(urn.value, subject)) {
+        return nullptr;
+    }
 
+    auto urn_it = store.find(subject);
     if (urn_it == store.end()) {
+        return nullptr;
+    }
+
+    return &urn_it->second;
+}
+
+std::vector<std::shared_ptr<RDFValue>>* MemoryDataStore::FindValues(
+    AtomAttributes& attributes, const URN& attribute) {
+    Atom predicate;
+    if (!atoms.Lookup(attribute.value, predicate)) {
+        return nullptr;
+    }
+
+    auto attribute_itr = attributes.find(predicate);
+    if (attribute_itr == attributes.end()) {
+        return nullptr;
+    }
+
+    return &attribute_itr->second;
+}
+
+void MemoryDataStore::IndexValue(Atom subject, Atom predicate,
+                                 const RDFValue& value) {
+    auto predicate_it = index.find(predicate);
+    if (predicate_it == index.end()) {
+        return;
+    }
+
+    predicate_it->second[value.SerializeToString()].insert(subject);
+}
+
+void MemoryDataStore::UnindexValues(
+    Atom subject, Atom predicate,
+    const std::vector<std::shared_ptr<RDFValue>>& values) {
+    auto predicate_it = index.find(predicate);
+    if (predicate_it == index.end()) {
+        return;
+    }
+
+    for (const auto& value: values) {
+        auto value_it = predicate_it->second.find(value->SerializeToString());
+        if (value_it == predicate_it->second.end()) {
+            continue;
+        }
+
+        value_it->second.erase(subject);
+        if (value_it->second.empty()) {
+            predicate_it->second.erase(value_it);
+        }
+    }
+}
+
+MemoryDataStore::ValueIndex& MemoryDataStore::BuildIndex(Atom predicate) {
+    auto predicate_it = index.find(predicate);
+    if (predicate_it != index.end()) {
+        return predicate_it->second;
+    }
+
+    ValueIndex& values = index[predicate];
+    for (const auto& subject_it: store) {
+        auto attribute_it = subject_it.second.find(predicate);
+        if (attribute_it == subject_it.second.end()) {
+            continue;
+        }
+
+        for (const auto& value: attribute_it->second) {
+            values[value->SerializeToString()].insert(subject_it.first);
+        }
+    }
+
+    return values;
+}
+
+AFF4Status MemoryDataStore::FindLastOfType(
+    const URN& urn, const URN& attribute, const std::type_info& type,
+    const RDFValue*& result) {
+    AtomAttributes* attributes = FindSubject(urn);
+    if (attributes == nullptr) {
         return NOT_FOUND;
     }
 
-    auto attribute_itr = urn_it->second.find(attribute.SerializeToString());
-    if (attribute_itr == urn_it->second.end()) {
+    std::vector<std::shared_ptr<RDFValue>>* values = FindValues(
+        *attributes, attribute);
+    if (values == nullptr) {
         // Since the majority of AFF4 objects in practice are zip segments,
         // as an optimization we don't store type attributes for these
         // objects.  Instead, objects without type attriutes are assumed to
         // be zip segments.
         if (attribute == AFF4_TYPE) {
-            value.UnSerializeFromString(AFF4_ZIP_SEGMENT_TYPE);
-            return STATUS_OK;
+            return CONTINUE;
         }
 
         return NOT_FOUND;
     }
 
-    std::vector<std::shared_ptr<RDFValue>> values = (attribute_itr->second);
-    AFF4Status res = NOT_FOUND;
-    for (const auto &fetched_value: values) {
-        // Only collect compatible types.
-        const RDFValue& fetched_value_ref = *fetched_value;
-        if (typeid(value) == typeid(fetched_value_ref)) {
-            res = value.UnSerializeFromString(
-                fetched_value->SerializeToString());
+    // Only collect compatible types. The last one set wins.
+    for (auto it = values->rbegin(); it != values->rend(); it++) {
+        const RDFValue& fetched_value_ref = **it;
+        if (type == typeid(fetched_value_ref)) {
+            result = &fetched_value_ref;
+            return STATUS_OK;
         }
     }
 
-    return res;
+    return NOT_FOUND;
+}
+
+AFF4Status MemoryDataStore::Get(const URN& urn, const URN& attribute,
+                                RDFValue& value) {
+    SharedLockGuard guard(*lock);
+
+    const RDFValue* fetched_value = nullptr;
+    AFF4Status res = FindLastOfType(urn, attribute, typeid(value),
+                                    fetched_value);
+    if (res == CONTINUE) {
+        value.UnSerializeFromString(AFF4_ZIP_SEGMENT_TYPE);
+        return STATUS_OK;
+    }
+
+    if (res != STATUS_OK) {
+        return res;
+    }
+
+    return value.UnSerializeFromString(fetched_value->SerializeToString());
+}
+
+AFF4Status MemoryDataStore::Get(const URN& urn, const URN& attribute,
+                                XSDInteger& value) {
+    SharedLockGuard guard(*lock);
+
+    const RDFValue* fetched_value = nullptr;
+    AFF4Status res = FindLastOfType(urn, attribute, typeid(XSDInteger),
+                                    fetched_value);
+    if (res == CONTINUE) {
+        static_cast<RDFValue&>(value).UnSerializeFromString(
+            AFF4_ZIP_SEGMENT_TYPE);
+        return STATUS_OK;
+    }
+
+    if (res != STATUS_OK) {
+        return res;
+    }
+
+    value.value = static_cast<const XSDInteger*>(fetched_value)->value;
+    return STATUS_OK;
+}
+
+AFF4Status MemoryDataStore::Get(const URN& urn, const URN& attribute,
+                                URN& value) {
+    SharedLockGuard guard(*lock);
+
+    const RDFValue* fetched_value = nullptr;
+    AFF4Status res = FindLastOfType(urn, attribute, typeid(URN),
+                                    fetched_value);
+    if (res == CONTINUE) {
+        value.value = AFF4_ZIP_SEGMENT_TYPE;
+        return STATUS_OK;
+    }
+
+    if (res != STATUS_OK) {
+        return res;
+    }
+
+    value.value = static_cast<const URN*>(fetched_value)->value;
+    return STATUS_OK;
 }
 
 AFF4Status MemoryDataStore::Get(const URN& urn,
                                 const URN& attribute,
                                 std::vector<std::shared_ptr<RDFValue>>& values) {
-    auto urn_it = store.find(urn.SerializeToString());
+    SharedLockGuard guard(*lock);
 
-    if (urn_it == store.end()) {
+    AtomAttributes* attributes = FindSubject(urn);
+    if (attributes == nullptr) {
         return NOT_FOUND;
     }
 
-    auto attribute_itr = urn_it->second.find(attribute.SerializeToString());
-    if (attribute_itr == urn_it->second.end()) {
+    std::vector<std::shared_ptr<RDFValue>>* ivalues = FindValues(
+        *attributes, attribute);
+    if (ivalues == nullptr) {
         // Since the majority of AFF4 objects in practice are zip segments,
         // as an optimization we don't store type attributes for these
         // objects.  Instead, objects without type attriutes are assumed to
@@ -450,67 +1035,54 @@ AFF4Status MemoryDataStore::Get(const URN& urn,
         return NOT_FOUND;
     }
 
-    std::vector<std::shared_ptr<RDFValue>> ivalues = (attribute_itr->second);
-    if (ivalues.empty()) {
+    if (ivalues->empty()) {
         return NOT_FOUND;
     }
+
     // Load up our keys.
-    for(std::vector<std::shared_ptr<RDFValue>>::iterator it = ivalues.begin(); it != ivalues.end(); it++){
-        std::shared_ptr<RDFValue> v = *it;
-        values.push_back(v);
-    }
+    values.insert(values.end(), ivalues->begin(), ivalues->end());
+
     return STATUS_OK;
 }
 
 bool MemoryDataStore::HasURN(const URN& urn) {
-    auto urn_it = store.find(urn.SerializeToString());
+    SharedLockGuard guard(*lock);
 
-    if (urn_it == store.end()) {
-        return false;
-    }
-    return true;
+    return FindSubject(urn) != nullptr;
 }
 
 bool MemoryDataStore::HasURNWithAttribute(const URN& urn, const URN& attribute) {
-    auto urn_it = store.find(urn.SerializeToString());
+    SharedLockGuard guard(*lock);
 
-    if (urn_it == store.end()) {
+    AtomAttributes* attributes = FindSubject(urn);
+    if (attributes == nullptr) {
         return false;
     }
 
-    auto attribute_itr = urn_it->second.find(attribute.SerializeToString());
-    if (attribute_itr == urn_it->second.end()) {
-        return false;
-    }
+    std::vector<std::shared_ptr<RDFValue>>* values = FindValues(
+        *attributes, attribute);
 
-    std::vector<std::shared_ptr<RDFValue>> values = (attribute_itr->second);
-    if (values.empty()) {
-        return false;
-    }
-    return true;
+    return values != nullptr && !values->empty();
 }
 
 bool MemoryDataStore::HasURNWithAttributeAndValue(
     const URN& urn, const URN& attribute, const RDFValue& value) {
-    auto urn_it = store.find(urn.SerializeToString());
-    std::string serialized_value = value.SerializeToString();
-
-    if (urn_it == store.end()) {
-        return false;
-    }
+    SharedLockGuard guard(*lock);
 
-    auto attribute_itr = urn_it->second.find(attribute.SerializeToString());
-    if (attribute_itr == urn_it->second.end()) {
+    AtomAttributes* attributes = FindSubject(urn);
+    if (attributes == nullptr) {
         return false;
     }
 
-    std::vector<std::shared_ptr<RDFValue>> values = (attribute_itr->second);
-    if (values.empty()) {
+    std::vector<std::shared_ptr<RDFValue>>* values = FindValues(
+        *attributes, attribute);
+    if (values == nullptr) {
         return false;
     }
 
     // iterator over all values looking for a RDFValue that matches the attribute requested.
-    for (const auto& v: values) {
+    std::string serialized_value = value.SerializeToString();
+    for (const auto& v: *values) {
         if (serialized_value == v->SerializeToString()) {
             return true;
         }
@@ -521,73 +1093,273 @@ bool MemoryDataStore::HasURNWithAttributeAndValue(
 
 std::unordered_set<URN> MemoryDataStore::Query(
     const URN& attribute, const RDFValue* value) {
-    std::unordered_set<URN> results;
-    std::string serialized_value;
-    std::string serialized_attribute = attribute.SerializeToString();
+    {
+        SharedLockGuard guard(*lock);
 
-    if (value) {
-        serialized_value = value->SerializeToString();
+        Atom predicate;
+        if (!atoms.Lookup(attribute.value, predicate)) {
+            return std::unordered_set<URN>();
+        }
+
+        auto predicate_it = index.find(predicate);
+        if (predicate_it != index.end()) {
+            return QueryIndex(predicate_it->second, value);
+        }
     }
 
-    for (const auto &it: store) {
-        URN subject = it.first;
-        AFF4_Attributes attr = it.second;
+    // The first query for this predicate indexes it.
+    std::lock_guard<ReadMostlyLock> guard(*lock);
 
-        for (const auto &it: attr) {
-            URN stored_attribute = it.first;
-            if (stored_attribute.SerializeToString() != serialized_attribute)
-                continue;
+    Atom predicate;
+    if (!atoms.Lookup(attribute.value, predicate)) {
+        return std::unordered_set<URN>();
+    }
 
-            const auto& value_array = it.second;
+    return QueryIndex(BuildIndex(predicate), value);
+}
 
-            for (const auto &stored_value: value_array) {
-                if (value == nullptr ||
-                    serialized_value == stored_value->SerializeToString()) {
-                    results.insert(subject);
-                }
+std::unordered_set<URN> MemoryDataStore::QueryIndex(
+    const ValueIndex& values, const RDFValue* value) {
+    std::unordered_set<URN> results;
+
+    if (value) {
+        auto value_it = values.find(value->SerializeToString());
+        if (value_it != values.end()) {
+            for (const auto& subject: value_it->second) {
+                results.insert(URN(atoms.String(subject)));
             }
         }
+
+        return results;
+    }
+
+    for (const auto& value_it: values) {
+        for (const auto& subject: value_it.second) {
+            results.insert(URN(atoms.String(subject)));
+        }
     }
 
     return results;
 }
 
 AFF4_Attributes MemoryDataStore::GetAttributes(const URN& urn) {
+    SharedLockGuard guard(*lock);
+
     AFF4_Attributes attr;
-    if(!HasURN(urn)){
+    AtomAttributes* attributes = FindSubject(urn);
+    if (attributes == nullptr) {
         return attr;
     }
-    auto urn_it = store.find(urn.SerializeToString());
-    attr = urn_it->second;
+
+    for (const auto& it: *attributes) {
+        attr[atoms.String(it.first)] = it.second;
+    }
+
     return attr;
 }
 
 AFF4Status MemoryDataStore::DeleteSubject(const URN& urn) {
-    store.erase(urn.SerializeToString());
+    std::lock_guard<ReadMostlyLock> guard(*lock);
+
+    Atom subject;
+    if (!atoms.Lookup(urn.value, subject)) {
+        return STATUS_OK;
+    }
+
+    auto urn_it = store.find(subject);
+    if (urn_it == store.end()) {
+        return STATUS_OK;
+    }
+
+    for (const auto& attr_it: urn_it->second) {
+        UnindexValues(subject, attr_it.first, attr_it.second);
+    }
+
+    store.erase(urn_it);
+    subject_order.erase(&atoms.String(subject));
+
+    if (track_changes) {
+        deletion_generation = ++generation;
+    }
 
     return STATUS_OK;
 }
 
 std::vector<URN> MemoryDataStore::SelectSubjectsByPrefix(const URN& prefix) {
+    SharedLockGuard guard(*lock);
+
     std::vector<URN> result;
 
-    for (const auto& it : store) {
-        URN subject(it.first);
-        if (subject.RelativePath(prefix) != subject.SerializeToString()) {
-            result.push_back(subject);
+    // Subjects starting with the prefix sort together, beginning at the
+    // prefix itself.
+    const std::string& prefix_string = prefix.value;
+    for (auto it = subject_order.lower_bound(&prefix_string);
+         it != subject_order.end(); ++it) {
+        const std::string& subject = **it;
+        if (subject.compare(0, prefix_string.size(), prefix_string) != 0) {
+            break;
         }
+
+        result.push_back(URN(subject));
     }
 
     return result;
 }
 
 AFF4Status MemoryDataStore::Clear() {
+    std::lock_guard<ReadMostlyLock> guard(*lock);
+
     store.clear();
+    index.clear();
+    subject_order.clear();
+    changes.clear();
+    deletion_generation = ++generation;
+    atoms.Clear();
+
+    // The old arena is released once the last value allocated from it
+    // is gone.
+    ReplaceArena();
     return STATUS_OK;
 }
 
 MemoryDataStore::~MemoryDataStore() {}
 
+size_t ReadMostlyLock::ThreadSlot() {
+    static std::atomic<size_t> next_slot(0);
+    static thread_local size_t slot = next_slot++ % SLOTS;
+
+    return slot;
+}
+
+void ReadMostlyLock::lock_shared() {
+    slots[ThreadSlot()].mutex.lock();
+}
+
+void ReadMostlyLock::unlock_shared() {
+    slots[ThreadSlot()].mutex.unlock();
+}
+
+void ReadMostlyLock::lock() {
+    // Always lock in the same order so concurrent writers do not
+    // deadlock.
+    for (size_t i = 0; i < SLOTS; i++) {
+        slots[i].mutex.lock();
+    }
+}
+
+void ReadMostlyLock::unlock() {
+    for (size_t i = SLOTS; i > 0; i--) {
+        slots[i - 1].mutex.unlock();
+    }
+}
+
+AtomTable::Atom AtomTable::Intern(const std::string& value) {
+    auto it = atoms.find(value);
+    if (it != atoms.end()) {
+        return it->second;
+    }
+
+    Atom atom = strings.size();
+    it = atoms.emplace(value, atom).first;
+    strings.push_back(&it->first);
+
+    return atom;
+}
+
+bool AtomTable::Lookup(const std::string& value, Atom& atom) const {
+    auto it = atoms.find(value);
+    if (it == atoms.end()) {
+        return false;
+    }
+
+    atom = it->second;
+    return true;
+}
+
+void AtomTable::Clear() {
+    atoms.clear();
+    strings.clear();
+}
+
+void DataStore::ReplaceArena() {
+    std::unique_ptr<ValueArena, ValueArena::Releaser> old_arena(
+        new ValueArena());
+
+    // The old arena is released outside the lock.
+    std::lock_guard<std::mutex> guard(*arena_lock);
+    arena.swap(old_arena);
+}
+
+void* ValueArena::Allocate(size_t size) {
+    std::lock_guard<std::mutex> guard(lock);
+    live_blocks++;
+
+    if (size > MAX_BLOCK_SIZE) {
+        return ::operator new(size);
+    }
+
+    size_t size_class = (size + ALIGNMENT - 1) / ALIGNMENT;
+    size = size_class * ALIGNMENT;
+
+    // Reuse a freed block of the same size if we have one.
+    void* block = free_blocks[size_class];
+    if (block) {
+        free_blocks[size_class] = *static_cast<void**>(block);
+        return block;
+    }
+
+    if (chunk_used + size > CHUNK_SIZE) {
+        chunks.emplace_back(new char[CHUNK_SIZE]);
+        chunk_used = 0;
+    }
+
+    block = chunks.back().get() + chunk_used;
+    chunk_used += size;
+
+    return block;
+}
+
+void ValueArena::Deallocate(void* block, size_t size) {
+    bool unused;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (size > MAX_BLOCK_SIZE) {
+            ::operator delete(block);
+        } else {
+            size_t size_class = (size + ALIGNMENT - 1) / ALIGNMENT;
+            *static_cast<void**>(block) = free_blocks[size_class];
+            free_blocks[size_class] = block;
+        }
+
+        live_blocks--;
+        unused = released && live_blocks == 0;
+    }
+
+    if (unused) {
+        delete this;
+    }
+}
+
+void ValueArena::Release() {
+    bool unused;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        released = true;
+        unused = live_blocks == 0;
+    }
+
+    if (unused) {
+        delete this;
+    }
+}
+
+size_t ValueArena::ChunkBytes() {
+    std::lock_guard<std::mutex> guard(lock);
+
+    return chunks.size() * CHUNK_SIZE;
+}
+
 void DataStore::Dump(bool verbose) {
     StringIO output;
 
@@ -24,12 +24,15 @@ specific language governing permissions and limitations under the License.
 
 #include <unordered_map>
 #include <unordered_set>
+#include <set>
 #include <vector>
 #include <string>
 #include <memory>
 #include <fstream>
 #include "aff4/aff4_utils.h"
 #include <string.h>
+#include <typeinfo>
+#include <mutex>
 
 #include "aff4/rdf.h"
 
@@ -89,6 +92,144 @@ struct DataStoreOptions {
 };
 
 
+/**
+ * Memory for RDFValues created by a data store. Blocks are carved out of
+ * large chunks and recycled by size, so the many small values of a large
+ * volume do not each need their own heap allocation. The store holds the
+ * only reference to the arena; once it calls Release() the chunks are
+ * freed together when the last value allocated from the arena is gone.
+ */
+class ValueArena {
+  public:
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    // Blocks are rounded up to this size.
+    static const size_t ALIGNMENT = 16;
+
+    // Larger blocks go straight to the heap.
+    static const size_t MAX_BLOCK_SIZE = 1024;
+
+    ValueArena() = default;
+    ValueArena(const ValueArena&) = delete;
+    ValueArena& operator=(const ValueArena&) = delete;
+
+    void* Allocate(size_t size);
+    void Deallocate(void* block, size_t size);
+
+    // Total size of the chunks held by the arena.
+    size_t ChunkBytes();
+
+    // Drops the owner's reference. The arena deletes itself once no
+    // blocks remain allocated.
+    void Release();
+
+    struct Releaser {
+        void operator()(ValueArena* arena) const {
+            arena->Release();
+        }
+    };
+
+  private:
+    ~ValueArena() = default;
+
+    std::mutex lock;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t chunk_used = CHUNK_SIZE;
+
+    // Blocks handed out and not yet deallocated.
+    size_t live_blocks = 0;
+    bool released = false;
+
+    // Singly linked lists of free blocks, one per size class.
+    std::vector<void*> free_blocks =
+        std::vector<void*>(MAX_BLOCK_SIZE / ALIGNMENT + 1);
+};
+
+
+// A standard allocator drawing from a ValueArena. The arena stays alive
+// while it has blocks allocated, so values do not hold a reference to it.
+template<typename T>
+class ArenaAllocator {
+  public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(ValueArena* arena): arena(arena) {}
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other): arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena->Allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* block, size_t n) {
+        arena->Deallocate(block, n * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U>& other) const {
+        return arena == other.arena;
+    }
+
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const {
+        return arena != other.arena;
+    }
+
+    ValueArena* arena;
+};
+
+
+/**
+ * A batch of statements to be added to a DataStore with one SetBatch()
+ * call. Producers of many statements should reserve() room for them up
+ * front and reuse the batch.
+ */
+class StatementBatch {
+  public:
+    struct Statement {
+        URN subject;
+        URN predicate;
+        std::shared_ptr<RDFValue> value;
+        bool replace;
+    };
+
+    void reserve(size_t count) {
+        statements.reserve(count);
+    }
+
+    // Values should be created with DataStore::MakeValue().
+    void Add(const URN& subject, const URN& predicate,
+             std::shared_ptr<RDFValue> value, bool replace = true) {
+        statements.push_back({subject, predicate, std::move(value), replace});
+    }
+
+    size_t size() const {
+        return statements.size();
+    }
+
+    bool empty() const {
+        return statements.empty();
+    }
+
+    // Keeps the reserved capacity.
+    void clear() {
+        statements.clear();
+    }
+
+    std::vector<Statement>::iterator begin() {
+        return statements.begin();
+    }
+
+    std::vector<Statement>::iterator end() {
+        return statements.end();
+    }
+
+  private:
+    std::vector<Statement> statements;
+};
+
+
 /** The abstract data store.
 
     Data stores know how to serialize RDF statements of the type:
@@ -117,9 +258,35 @@ class DataStore {
     /// You can add new namespaces here for turtle serialization.
     std::vector<std::pair<std::string, std::string>> namespaces;
 
+    /// Serialize turtle through raptor instead of the built in writer.
+    bool use_raptor_serializer = false;
+
+    /// When set, the store remembers which subject/predicate pairs are
+    /// changed so they can be written out incrementally with
+    /// DumpChangesToTurtle(). Statements loaded from turtle are not
+    /// counted as changes.
+    bool track_changes = false;
+
     // A global thread pool for general use.
     std::unique_ptr<ThreadPool> pool;
 
+    // The arena values made with MakeValue() are currently allocated
+    // from. Only valid until the store is next cleared.
+    ValueArena* Arena() const {
+        std::lock_guard<std::mutex> guard(*arena_lock);
+        return arena.get();
+    }
+
+    // Creates a value for storing in this data store. The value and its
+    // reference count share one block from the arena. Safe to call
+    // while another thread clears the store.
+    template<typename T, typename ...Args>
+    std::shared_ptr<T> MakeValue(Args && ...args) {
+        std::lock_guard<std::mutex> guard(*arena_lock);
+        return std::allocate_shared<T>(
+            ArenaAllocator<T>(arena.get()), std::forward<Args>(args)...);
+    }
+
     virtual void Set(const URN& urn, const URN& attribute,
                      RDFValue* value, bool replace = true) = 0;
 
@@ -129,6 +296,19 @@ class DataStore {
     virtual AFF4Status Get(const URN& urn, const URN& attribute,
                 std::vector<std::shared_ptr<RDFValue>>& values) = 0;
 
+    // Typed accessors for the most common value types. Stores may
+    // override these to copy the value directly instead of going
+    // through its string serialization.
+    virtual AFF4Status Get(const URN& urn, const URN& attribute,
+                           XSDInteger& value) {
+        return Get(urn, attribute, static_cast<RDFValue&>(value));
+    }
+
+    virtual AFF4Status Get(const URN& urn, const URN& attribute,
+                           URN& value) {
+        return Get(urn, attribute, static_cast<RDFValue&>(value));
+    }
+
     /**
      * Does the given URN have the given attribute set to the given value.
      */
@@ -148,8 +328,23 @@ class DataStore {
                      std::shared_ptr<RDFValue> value,
                      bool replace = true) = 0;
 
+    /**
+     * Set all the statements in the batch, in order, as if by Set(). The
+     * batch is emptied so it can be reused.
+     */
+    virtual void SetBatch(StatementBatch& batch) {
+        for (auto& statement: batch) {
+            Set(statement.subject, statement.predicate,
+                std::move(statement.value), statement.replace);
+        }
+        batch.clear();
+    }
+
     virtual AFF4Status DeleteSubject(const URN& urn) = 0;
 
+    /**
+     * Returns all subjects whose URN starts with prefix, in sorted order.
+     */
     virtual std::vector<URN> SelectSubjectsByPrefix(const URN& prefix) = 0;
 
     /**
@@ -185,6 +380,30 @@ class DataStore {
 
     virtual AFF4Status LoadFromTurtle(AFF4Stream& output) = 0;
 
+    /**
+     * Returns the change generation. It increases with every tracked
+     * change and can be passed to DumpChangesToTurtle() later.
+     */
+    virtual uint64_t Generation() = 0;
+
+    /**
+     * Dump the current values of all subject/predicate pairs changed
+     * after the given generation. Requires track_changes.
+     *
+     * Returns NOT_IMPLEMENTED if statements were deleted after the
+     * generation, in which case a full dump is needed.
+     */
+    virtual AFF4Status DumpChangesToTurtle(AFF4Stream& output, URN base,
+                                           uint64_t since,
+                                           bool verbose = false) = 0;
+
+    /**
+     * Load turtle written by DumpChangesToTurtle(). The values loaded
+     * for a subject/predicate pair replace all existing values of that
+     * pair.
+     */
+    virtual AFF4Status MergeFromTurtle(AFF4Stream& input) = 0;
+
     /**
      * Clear all data.
      *
@@ -213,17 +432,213 @@ class DataStore {
     virtual bool ShouldSuppress(const URN& subject, const URN& predicate,
                                 const std::string& value);
 
+    // Stores replace the arena when they are cleared. Values already
+    // made keep the old arena alive.
+    void ReplaceArena();
+
+  private:
+    // Guards arena, since MakeValue() does not take the store's lock.
+    // Held in a unique_ptr so the store remains movable.
+    std::unique_ptr<std::mutex> arena_lock{new std::mutex()};
+    std::unique_ptr<ValueArena, ValueArena::Releaser> arena{new ValueArena()};
+};
+
+
+/** Interns strings as compact integer atoms.
+
+    Each distinct string is stored once. Atoms remain valid until the
+    table is cleared.
+*/
+class AtomTable {
+  public:
+    typedef uint32_t Atom;
+
+    // Returns the atom for value, allocating a new one if needed.
+    Atom Intern(const std::string& value);
+
+    // Finds the atom for value without allocating one. Returns false
+    // if value was never interned.
+    bool Lookup(const std::string& value, Atom& atom) const;
+
+    const std::string& String(Atom atom) const {
+        return *strings[atom];
+    }
+
+    size_t size() const {
+        return strings.size();
+    }
+
+    void Clear();
+
+  private:
+    std::unordered_map<std::string, Atom> atoms;
+
+    // Points at the keys of atoms, which are stable.
+    std::vector<const std::string*> strings;
+};
+
+
+/** A reader-writer lock optimised for many concurrent readers.
+
+    Readers lock one of several slots, chosen per thread, so readers
+    on different threads rarely touch the same mutex. Writers lock
+    every slot and are therefore serialised against all readers and
+    each other. The lock is not recursive.
+*/
+class ReadMostlyLock {
+  public:
+    void lock_shared();
+    void unlock_shared();
+
+    void lock();
+    void unlock();
+
+  private:
+    static const size_t SLOTS = 16;
+
+    // Padded so each mutex sits on its own cache line.
+    struct Slot {
+        std::mutex mutex;
+        char padding[64];
+    };
+
+    Slot slots[SLOTS];
+
+    // The slot used by the calling thread.
+    static size_t ThreadSlot();
+};
+
+// Scoped shared ownership of a ReadMostlyLock.
+class SharedLockGuard {
+  public:
+    explicit SharedLockGuard(ReadMostlyLock& lock): lock(lock) {
+        lock.lock_shared();
+    }
+
+    ~SharedLockGuard() {
+        lock.unlock_shared();
+    }
+
+    SharedLockGuard(const SharedLockGuard&) = delete;
+    SharedLockGuard& operator=(const SharedLockGuard&) = delete;
+
+  private:
+    ReadMostlyLock& lock;
 };
 
 
 /** A purely in memory data store.
 
     This data store can be initialized and persisted into a Yaml file.
+
+    All methods may be called concurrently from multiple threads.
+    Readers proceed in parallel while writers are serialised.
 */
 class MemoryDataStore: public DataStore {
   private:
-    // Store a collection of AFF4_Attributes at each URN.
-    std::unordered_map<std::string, AFF4_Attributes> store;
+    typedef AtomTable::Atom Atom;
+
+    // Protects all the members below. Held in a unique_ptr so the
+    // store remains movable.
+    std::unique_ptr<ReadMostlyLock> lock{new ReadMostlyLock()};
+
+    // Subject and predicate URNs are interned so they are stored only
+    // once no matter how many triples refer to them.
+    AtomTable atoms;
+
+    // The attributes of a subject, keyed by predicate atom.
+    typedef std::unordered_map<
+        Atom, std::vector<std::shared_ptr<RDFValue>>> AtomAttributes;
+
+    // Store a collection of attributes at each subject atom.
+    std::unordered_map<Atom, AtomAttributes> store;
+
+    // Maps serialized values to the subjects carrying them.
+    typedef std::unordered_map<
+        std::string, std::unordered_set<Atom>> ValueIndex;
+
+    // Inverted index of store used by Query(), keyed by predicate
+    // atom. A predicate is only indexed once it has been queried, so
+    // Set() does not serialize values nobody looks up. Kept current by
+    // Set(), DeleteSubject() and Clear() from then on.
+    std::unordered_map<Atom, ValueIndex> index;
+
+    struct SubjectOrder {
+        bool operator()(const std::string* a, const std::string* b) const {
+            return *a < *b;
+        }
+    };
+
+    // The subjects of store in sorted order, for prefix selection. Points
+    // at the strings in atoms.
+    std::set<const std::string*, SubjectOrder> subject_order;
+
+    // Returns the attributes of urn, or nullptr if it is unknown.
+    AtomAttributes* FindSubject(const URN& urn);
+
+    // Returns the values of attribute in attributes, or nullptr if
+    // there are none.
+    std::vector<std::shared_ptr<RDFValue>>* FindValues(
+        AtomAttributes& attributes, const URN& attribute);
+
+    // Finds the last value of attribute on urn whose type is exactly
+    // type. Returns CONTINUE if urn is known but has no AFF4_TYPE,
+    // which callers treat as an implied zip segment.
+    AFF4Status FindLastOfType(const URN& urn, const URN& attribute,
+                              const std::type_info& type,
+                              const RDFValue*& result);
+
+    // The generation at which each subject/predicate pair last
+    // changed, keyed by PairKey(). Only maintained with track_changes.
+    uint64_t generation = 0;
+    std::unordered_map<uint64_t, uint64_t> changes;
+
+    // Deletions can not be expressed as a delta. This is the generation
+    // of the last one.
+    uint64_t deletion_generation = 0;
+
+    static uint64_t PairKey(Atom subject, Atom predicate) {
+        return (static_cast<uint64_t>(subject) << 32) | predicate;
+    }
+
+    // Sets the value with the lock held.
+    void SetLocked(Atom subject, Atom predicate,
+                   std::shared_ptr<RDFValue> value, bool replace);
+
+    // Interns the names, sets the value and records the change. The
+    // lock must be held.
+    void SetTrackedLocked(const std::string& subject,
+                          const std::string& predicate,
+                          std::shared_ptr<RDFValue> value, bool replace);
+
+    friend class TurtleLoader;
+
+    struct Statement {
+        URN subject;
+        URN predicate;
+        std::shared_ptr<RDFValue> value;
+    };
+
+    // Appends all values of the pair to statements, skipping volatile
+    // predicates unless verbose is set.
+    void CollectStatements(Atom subject, const AtomAttributes::value_type& pair,
+                           bool verbose, std::vector<Statement>& statements);
+
+    AFF4Status WriteTurtle(AFF4Stream& output, URN base,
+                           const std::vector<Statement>& statements);
+
+    AFF4Status ParseTurtle(AFF4Stream& input, bool merge);
+
+    void IndexValue(Atom subject, Atom predicate, const RDFValue& value);
+    void UnindexValues(Atom subject, Atom predicate,
+                       const std::vector<std::shared_ptr<RDFValue>>& values);
+
+    // Indexes all current values of predicate. Requires the exclusive
+    // lock.
+    ValueIndex& BuildIndex(Atom predicate);
+
+    std::unordered_set<URN> QueryIndex(const ValueIndex& values,
+                                       const RDFValue* value);
 
   public:
     MemoryDataStore() = default;
@@ -251,9 +666,16 @@ class MemoryDataStore: public DataStore {
     virtual void Set(const URN& urn, const URN& attribute,
                      std::shared_ptr<RDFValue> value, bool replace = true) override;
 
+    // Takes the lock once for the whole batch.
+    void SetBatch(StatementBatch& batch) override;
+
     AFF4Status Get(const URN& urn, const URN& attribute, RDFValue& value) override;
     AFF4Status Get(const URN& urn, const URN& attribute,
                    std::vector<std::shared_ptr<RDFValue>>& value) override;
+    AFF4Status Get(const URN& urn, const URN& attribute,
+                   XSDInteger& value) override;
+    AFF4Status Get(const URN& urn, const URN& attribute,
+                   URN& value) override;
 
     bool HasURN(const URN& urn) override;
     bool HasURNWithAttribute(const URN& urn, const URN& attribute) override;
@@ -279,6 +701,14 @@ class MemoryDataStore: public DataStore {
 
     AFF4Status LoadFromTurtle(AFF4Stream& output) override;
 
+    uint64_t Generation() override;
+
+    AFF4Status DumpChangesToTurtle(AFF4Stream& output, URN base,
+                                   uint64_t since,
+                                   bool verbose = false) override;
+
+    AFF4Status MergeFromTurtle(AFF4Stream& input) override;
+
     AFF4Status Clear() override;
 };
 
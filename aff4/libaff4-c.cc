@@ -112,6 +112,9 @@ struct AFF4_Handle {
             return false;
         }
 
+        // Callers read images at arbitrary offsets.
+        file->SetAccessPattern(aff4::AFF4_ACCESS_RANDOM);
+
         aff4::AFF4Flusher<aff4::AFF4Volume> zip;
         if (aff4::STATUS_OK != aff4::ZipFile::OpenZipFile(
                 &resolver, aff4::AFF4Flusher<aff4::AFF4Stream>(file.release()), zip)) {
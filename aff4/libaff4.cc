@@ -15,8 +15,10 @@ specific language governing permissions and limitations under the License.
 
 #ifdef _WIN32
 #include "shlwapi.h"
+#include <malloc.h>
 #else
 #include <fnmatch.h>
+#include <sys/mman.h>
 #endif
 
 #include "aff4/config.h"
@@ -34,6 +36,7 @@ specific language governing permissions and limitations under the License.
 #include <cstring>
 #include <iostream>
 #include <iomanip>
+#include <utility>
 
 namespace aff4 {
 
@@ -183,6 +186,96 @@ void AFF4Stream::reserve(size_t size) {
     UNUSED(size);
 }
 
+AFF4Status AFF4Stream::TrimToSize() {
+    return STATUS_OK;
+}
+
+size_t AFF4Stream::QueuedBytes() const {
+    return 0;
+}
+
+AFF4Status AFF4Stream::SubmitRead(aff4_off_t offset, char* data,
+                                  size_t length, uint64_t tag) {
+    aff4_off_t saved_readptr = readptr;
+
+    AFF4Completion completion;
+    completion.tag = tag;
+    completion.status = Seek(offset, SEEK_SET);
+    if (completion.status == STATUS_OK) {
+        completion.length = length;
+        completion.status = ReadBuffer(data, &completion.length);
+    }
+
+    readptr = saved_readptr;
+    completions.push_back(completion);
+
+    return STATUS_OK;
+}
+
+AFF4Status AFF4Stream::SubmitWrite(aff4_off_t offset, const char* data,
+                                   size_t length, uint64_t tag) {
+    aff4_off_t saved_readptr = readptr;
+
+    AFF4Completion completion;
+    completion.tag = tag;
+    completion.status = Seek(offset, SEEK_SET);
+    if (completion.status == STATUS_OK) {
+        completion.status = Write(data, length);
+    }
+    if (completion.status == STATUS_OK) {
+        completion.length = length;
+    }
+
+    readptr = saved_readptr;
+    completions.push_back(completion);
+
+    return STATUS_OK;
+}
+
+AFF4Status AFF4Stream::ReadV(std::vector<AFF4ReadRequest>& requests) {
+    aff4_off_t saved_readptr = readptr;
+    AFF4Status result = STATUS_OK;
+
+    for (auto& request : requests) {
+        request.result_length = 0;
+        request.status = Seek(request.offset, SEEK_SET);
+        if (request.status == STATUS_OK) {
+            request.result_length = request.length;
+            request.status = ReadBuffer(request.data, &request.result_length);
+        }
+
+        if (result == STATUS_OK) {
+            result = request.status;
+        }
+    }
+
+    readptr = saved_readptr;
+
+    return result;
+}
+
+AFF4Status AFF4Stream::WaitForCompletion(AFF4Completion& completion) {
+    if (completions.empty()) {
+        return NOT_FOUND;
+    }
+
+    completion = completions.back();
+    completions.pop_back();
+
+    return STATUS_OK;
+}
+
+AFF4Status AFF4Stream::SetAccessPattern(AFF4AccessPattern pattern) {
+    properties.access_pattern = pattern;
+    return STATUS_OK;
+}
+
+AFF4Status AFF4Stream::DropCachedData(aff4_off_t offset, aff4_off_t length) {
+    UNUSED(offset);
+    UNUSED(length);
+    return STATUS_OK;
+}
+
 
 bool DefaultProgress::Report(aff4_off_t readptr) {
     std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
@@ -196,15 +289,21 @@ bool DefaultProgress::Report(aff4_off_t readptr) {
         double rate = (double)(readptr - last_offset) / (1024.0*1024.0)
                      / delta.count();
 
+        std::string queued;
+        if (output && output->QueuedBytes() > 0) {
+            queued = aff4_sprintf(", %zu MiB queued",
+                                  output->QueuedBytes()/1024/1024);
+        }
+
         if (length > 0) {
             resolver->logger->info(
-                " Reading {:x} {} MiB / {} ({:.0f} MiB/s)",
+                " Reading {:x} {} MiB / {} ({:.0f} MiB/s{})",
                 readptr, total_read/1024/1024,
-                length/1024/1024, rate);
+                length/1024/1024, rate, queued);
         } else {
             resolver->logger->info(
-                " Reading {:x} {} MiB ({:.0f} MiB/s)", readptr,
-                total_read/1024/1024, rate);
+                " Reading {:x} {} MiB ({:.0f} MiB/s{})", readptr,
+                total_read/1024/1024, rate, queued);
         }
         last_time = now;
         last_offset = readptr;
@@ -334,6 +433,11 @@ int AFF4Stream::sprintf(std::string fmt, ...) {
 AFF4Status StringIO::Write(const char* data, size_t length) {
     MarkDirty();
 
+    // Writing past the end leaves a zero filled gap.
+    if (readptr > (aff4_off_t)buffer.size()) {
+        buffer.resize(readptr);
+    }
+
     buffer.replace(readptr, length, data, length);
     readptr += length;
 
@@ -349,6 +453,11 @@ std::string StringIO::Read(size_t length) {
 }
 
 AFF4Status StringIO::ReadBuffer(char* data, size_t* length) {
+    if (readptr >= (aff4_off_t)buffer.size()) {
+        *length = 0;
+        return STATUS_OK;
+    }
+
     *length = std::min((aff4_off_t)*length, (aff4_off_t)(buffer.size() - readptr));
     std::memcpy(data, buffer.data() + readptr, *length);
     readptr += *length;
@@ -630,6 +739,93 @@ std::vector<std::string> split(const std::string& s, char delim) {
     return elems;
 }
 
+static const uint32_t _sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t _rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+// Runs the SHA-256 compression function over one 64 byte block.
+static void _SHA256Block(uint32_t state[8], const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t(block[i * 4]) << 24) |
+            (uint32_t(block[i * 4 + 1]) << 16) |
+            (uint32_t(block[i * 4 + 2]) << 8) |
+            uint32_t(block[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = _rotr32(w[i - 15], 7) ^ _rotr32(w[i - 15], 18) ^
+            (w[i - 15] >> 3);
+        uint32_t s1 = _rotr32(w[i - 2], 17) ^ _rotr32(w[i - 2], 19) ^
+            (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (_rotr32(e, 6) ^ _rotr32(e, 11) ^ _rotr32(e, 25)) +
+            ((e & f) ^ (~e & g)) + _sha256_k[i] + w[i];
+        uint32_t t2 = (_rotr32(a, 2) ^ _rotr32(a, 13) ^ _rotr32(a, 22)) +
+            ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+std::string SHA256Digest(const char* data, size_t length) {
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    const uint8_t* input = reinterpret_cast<const uint8_t*>(data);
+    size_t full_blocks = length / 64;
+    for (size_t i = 0; i < full_blocks; i++) {
+        _SHA256Block(state, input + i * 64);
+    }
+
+    // Pad the tail with a 1 bit and the message length in bits.
+    uint8_t tail[128] = {};
+    size_t remaining = length % 64;
+    std::memcpy(tail, input + full_blocks * 64, remaining);
+    tail[remaining] = 0x80;
+
+    size_t tail_length = remaining < 56 ? 64 : 128;
+    uint64_t bits = uint64_t(length) * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_length - 1 - i] = uint8_t(bits >> (i * 8));
+    }
+    for (size_t i = 0; i < tail_length; i += 64) {
+        _SHA256Block(state, tail + i);
+    }
+
+    std::string result(32, 0);
+    for (int i = 0; i < 8; i++) {
+        result[i * 4] = char(state[i] >> 24);
+        result[i * 4 + 1] = char(state[i] >> 16);
+        result[i * 4 + 2] = char(state[i] >> 8);
+        result[i * 4 + 3] = char(state[i]);
+    }
+    return result;
+}
+
 std::shared_ptr<spdlog::logger> get_logger() {
     auto logger = spdlog::get(aff4::LOGGER);
 
@@ -644,6 +840,240 @@ std::shared_ptr<spdlog::logger> get_logger() {
 }
 
 
+AlignedBuffer::AlignedBuffer(size_t size, size_t alignment) {
+#ifdef _WIN32
+    buffer = static_cast<char*>(_aligned_malloc(size, alignment));
+#else
+    void* result = nullptr;
+    if (posix_memalign(&result, alignment, size) == 0) {
+        buffer = static_cast<char*>(result);
+    }
+#endif
+
+    if (buffer) {
+        length = size;
+    }
+}
+
+AlignedBuffer::~AlignedBuffer() {
+#ifdef _WIN32
+    _aligned_free(buffer);
+#else
+    free(buffer);
+#endif
+}
+
+AlignedBuffer::AlignedBuffer(AlignedBuffer&& other) noexcept
+    : buffer(other.buffer), length(other.length) {
+    other.buffer = nullptr;
+    other.length = 0;
+}
+
+AlignedBuffer& AlignedBuffer::operator=(AlignedBuffer&& other) noexcept {
+    std::swap(buffer, other.buffer);
+    std::swap(length, other.length);
+    return *this;
+}
+
+
+// Huge pages on x86-64 and most arm64 systems.
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Regular buffers are page aligned so direct I/O can read into them.
+static const size_t BUFFER_POOL_ALIGNMENT = 4096;
+
+std::shared_ptr<BufferPool> BufferPool::NewBufferPool(
+    size_t buffer_size, size_t max_free, bool huge_pages) {
+    return std::shared_ptr<BufferPool>(
+        new BufferPool(buffer_size, max_free, huge_pages));
+}
+
+BufferPool::BufferPool(size_t buffer_size, size_t max_free, bool huge_pages)
+    : buffer_size_(buffer_size), max_free(max_free), huge_pages(huge_pages) {
+    // Give each buffer its own huge pages only if it needs at least half
+    // a huge page, otherwise small buffers would use many times their
+    // size.
+    slab_stride = std::max((size_t)1, (
+        buffer_size + BUFFER_POOL_ALIGNMENT - 1) / BUFFER_POOL_ALIGNMENT) *
+        BUFFER_POOL_ALIGNMENT;
+    use_slabs = huge_pages && slab_stride <= HUGE_PAGE_SIZE / 2;
+}
+
+BufferPool::~BufferPool() {
+    if (use_slabs) {
+        for (auto& slab : slabs) {
+            Free(slab.first, HUGE_PAGE_SIZE, slab.second);
+        }
+        return;
+    }
+
+    for (auto& buffer : free_buffers) {
+        Free(buffer.first, allocation_size(), buffer.second);
+    }
+}
+
+size_t BufferPool::allocation_size() const {
+    if (huge_pages) {
+        return (buffer_size_ + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+            HUGE_PAGE_SIZE;
+    }
+    return buffer_size_;
+}
+
+size_t BufferPool::allocations() const {
+    std::unique_lock<std::mutex> lock(mutex);
+    return allocations_;
+}
+
+size_t BufferPool::allocated_bytes() const {
+    std::unique_lock<std::mutex> lock(mutex);
+    return allocated_bytes_;
+}
+
+bool BufferPool::AddSlab() {
+    bool mapped;
+    char* slab = Allocate(HUGE_PAGE_SIZE, &mapped);
+    if (!slab) {
+        return false;
+    }
+
+    slabs.emplace_back(slab, mapped);
+    allocated_bytes_ += HUGE_PAGE_SIZE;
+
+    // Hand out the start of the slab first.
+    const size_t count = HUGE_PAGE_SIZE / slab_stride;
+    for (size_t i = count; i > 0; i--) {
+        free_buffers.emplace_back(slab + (i - 1) * slab_stride, false);
+    }
+    allocations_ += count;
+
+    return true;
+}
+
+PooledBuffer BufferPool::Acquire() {
+    PooledBuffer result;
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (free_buffers.empty() && use_slabs && !AddSlab()) {
+            return result;
+        }
+
+        if (!free_buffers.empty()) {
+            result.buffer = free_buffers.back().first;
+            result.mapped = free_buffers.back().second;
+            free_buffers.pop_back();
+        }
+    }
+
+    if (!result.buffer) {
+        result.buffer = Allocate(allocation_size(), &result.mapped);
+        if (!result.buffer) {
+            return result;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        allocations_++;
+        allocated_bytes_ += allocation_size();
+    }
+
+    result.pool = shared_from_this();
+    return result;
+}
+
+void BufferPool::Release(char* buffer, bool mapped) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        // Buffers carved from slabs can not be freed on their own.
+        if (use_slabs || free_buffers.size() < max_free) {
+            free_buffers.emplace_back(buffer, mapped);
+            return;
+        }
+
+        allocated_bytes_ -= allocation_size();
+    }
+
+    Free(buffer, allocation_size(), mapped);
+}
+
+char* BufferPool::Allocate(size_t size, bool* mapped) {
+    size = std::max((size_t)1, size);
+    *mapped = false;
+
+#ifdef MAP_HUGETLB
+    // Explicit huge pages need to be reserved by the administrator
+    // (vm.nr_hugepages). If there are none we fall back to transparent
+    // huge pages below.
+    if (huge_pages) {
+        void* result = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (result != MAP_FAILED) {
+            *mapped = true;
+            return static_cast<char*>(result);
+        }
+    }
+#endif
+
+    const size_t alignment = (
+        huge_pages ? HUGE_PAGE_SIZE : BUFFER_POOL_ALIGNMENT);
+
+#ifdef _WIN32
+    return static_cast<char*>(_aligned_malloc(size, alignment));
+#else
+    void* result = nullptr;
+    if (posix_memalign(&result, alignment, size) != 0) {
+        return nullptr;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (huge_pages) {
+        madvise(result, size, MADV_HUGEPAGE);
+    }
+#endif
+
+    return static_cast<char*>(result);
+#endif
+}
+
+void BufferPool::Free(char* buffer, size_t size, bool mapped) {
+#ifdef _WIN32
+    UNUSED(size);
+    UNUSED(mapped);
+    _aligned_free(buffer);
+#else
+    if (mapped) {
+        munmap(buffer, std::max((size_t)1, size));
+    } else {
+        free(buffer);
+    }
+#endif
+}
+
+PooledBuffer::~PooledBuffer() {
+    if (buffer) {
+        pool->Release(buffer, mapped);
+    }
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+    : pool(std::move(other.pool)), buffer(other.buffer),
+      mapped(other.mapped) {
+    other.buffer = nullptr;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    std::swap(pool, other.pool);
+    std::swap(buffer, other.buffer);
+    std::swap(mapped, other.mapped);
+    return *this;
+}
+
+size_t PooledBuffer::size() const {
+    return buffer ? pool->buffer_size() : 0;
+}
+
+
 #ifndef FNM_EXTMATCH
 #define FNM_EXTMATCH 0
 #endif
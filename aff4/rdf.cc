@@ -118,6 +118,10 @@ raptor_term* XSDString::GetRaptorTerm(raptor_world* world) const {
     return result;
 }
 
+const char* XSDString::GetDatatype() const {
+    return XSDStringType;
+}
+
 raptor_term* MD5Hash::GetRaptorTerm(raptor_world* world) const {
     std::string value_string(SerializeToString());
     raptor_uri* uri = raptor_new_uri(
@@ -135,6 +139,10 @@ raptor_term* MD5Hash::GetRaptorTerm(raptor_world* world) const {
     return result;
 }
 
+const char* MD5Hash::GetDatatype() const {
+    return AFF4_HASH_MD5;
+}
+
 raptor_term* SHA1Hash::GetRaptorTerm(raptor_world* world) const {
     std::string value_string(SerializeToString());
     raptor_uri* uri = raptor_new_uri(
@@ -152,6 +160,10 @@ raptor_term* SHA1Hash::GetRaptorTerm(raptor_world* world) const {
     return result;
 }
 
+const char* SHA1Hash::GetDatatype() const {
+    return AFF4_HASH_SHA1;
+}
+
 raptor_term* SHA256Hash::GetRaptorTerm(raptor_world* world) const {
     std::string value_string(SerializeToString());
     raptor_uri* uri = raptor_new_uri(
@@ -169,6 +181,10 @@ raptor_term* SHA256Hash::GetRaptorTerm(raptor_world* world) const {
     return result;
 }
 
+const char* SHA256Hash::GetDatatype() const {
+    return AFF4_HASH_SHA256;
+}
+
 raptor_term* SHA512Hash::GetRaptorTerm(raptor_world* world) const {
     std::string value_string(SerializeToString());
     raptor_uri* uri = raptor_new_uri(
@@ -186,6 +202,10 @@ raptor_term* SHA512Hash::GetRaptorTerm(raptor_world* world) const {
     return result;
 }
 
+const char* SHA512Hash::GetDatatype() const {
+    return AFF4_HASH_SHA512;
+}
+
 raptor_term* Blake2BHash::GetRaptorTerm(raptor_world* world) const {
     std::string value_string(SerializeToString());
     raptor_uri* uri = raptor_new_uri(
@@ -203,6 +223,10 @@ raptor_term* Blake2BHash::GetRaptorTerm(raptor_world* world) const {
     return result;
 }
 
+const char* Blake2BHash::GetDatatype() const {
+    return AFF4_HASH_BLAKE2B;
+}
+
 
 
 std::string URN::Scheme() const {
@@ -273,6 +297,10 @@ raptor_term* URN::GetRaptorTerm(raptor_world* world) const {
                value_string.size());
 }
 
+const char* URN::GetDatatype() const {
+    return nullptr;
+}
+
 URN URN::Append(const std::string& component) const {
     int i = value.size()-1;
     while (i > 0 && (value[i] == '/' || value[i] == '\\')) {
@@ -544,6 +572,10 @@ raptor_term* XSDInteger::GetRaptorTerm(raptor_world* world) const {
     return result;
 }
 
+const char* XSDInteger::GetDatatype() const {
+    return XSDIntegerType;
+}
+
 
 std::string XSDBoolean::SerializeToString() const {
     return value ? "true": "false";
@@ -580,6 +612,10 @@ raptor_term* XSDBoolean::GetRaptorTerm(raptor_world* world) const {
     return result;
 }
 
+const char* XSDBoolean::GetDatatype() const {
+    return XSDBooleanType;
+}
+
 
 // A Global Registry for RDFValue. This factory will provide the correct
 // RDFValue instance based on the turtle type URN. For example xsd:integer ->
@@ -62,6 +62,12 @@ class RDFValue {
         return nullptr;
     }
 
+    // The datatype URI this value is written with as a typed literal,
+    // or nullptr for a plain literal. Must agree with GetRaptorTerm().
+    virtual const char* GetDatatype() const {
+        return nullptr;
+    }
+
     // RDFValues must provide methods for serializing and unserializing.
     virtual std::string SerializeToString() const {
         return "";
@@ -159,6 +165,7 @@ class XSDString: public RDFBytes {
     std::string SerializeToString() const;
     AFF4Status UnSerializeFromString(const char* data, int length);
     raptor_term* GetRaptorTerm(raptor_world* world) const;
+    const char* GetDatatype() const;
 };
 
 // Hash types
@@ -167,30 +174,35 @@ class MD5Hash : public XSDString {
   public:
     using XSDString::XSDString;
     raptor_term* GetRaptorTerm(raptor_world* world) const;
+    const char* GetDatatype() const;
 };
 
 class SHA1Hash : public XSDString {
   public:
     using XSDString::XSDString;
     raptor_term* GetRaptorTerm(raptor_world* world) const;
+    const char* GetDatatype() const;
 };
 
 class SHA256Hash : public XSDString {
   public:
     using XSDString::XSDString;
     raptor_term* GetRaptorTerm(raptor_world* world) const;
+    const char* GetDatatype() const;
 };
 
 class SHA512Hash : public XSDString {
   public:
     using XSDString::XSDString;
     raptor_term* GetRaptorTerm(raptor_world* world) const;
+    const char* GetDatatype() const;
 };
 
 class Blake2BHash : public XSDString {
   public:
     using XSDString::XSDString;
     raptor_term* GetRaptorTerm(raptor_world* world) const;
+    const char* GetDatatype() const;
 };
 
 
@@ -216,6 +228,7 @@ class XSDInteger: public RDFValue {
     AFF4Status UnSerializeFromString(const char* data, int length);
 
     raptor_term* GetRaptorTerm(raptor_world* world) const;
+    const char* GetDatatype() const;
 };
 
 
@@ -240,6 +253,7 @@ class XSDBoolean: public RDFValue {
     AFF4Status UnSerializeFromString(const char* data, int length);
 
     raptor_term* GetRaptorTerm(raptor_world* world) const;
+    const char* GetDatatype() const;
 };
 
 /**
@@ -295,6 +309,9 @@ class URN: public XSDString {
 
     raptor_term* GetRaptorTerm(raptor_world* world) const;
 
+    // URNs are written as IRIs, not as typed literals.
+    const char* GetDatatype() const;
+
     // Returns the URN's Scheme, Path and Domain parts. NOTE: This is
     // not a complete URI parser! It only supports AFF4 and FILE urls.
     std::string Scheme() const;
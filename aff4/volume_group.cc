@@ -119,5 +119,42 @@ AFF4Status VolumeGroup::GetStream(URN stream_urn, AFF4Flusher<AFF4Stream> &resul
     return NOT_FOUND;
 }
 
+AFF4Status VolumeGroup::GetSharedStream(const URN &stream_urn,
+                                        std::shared_ptr<AFF4Stream> &result) {
+    result.reset();
+
+    auto it = shared_streams.find(stream_urn);
+    if (it != shared_streams.end()) {
+        result = it->second.lock();
+    }
+
+    if (!result) {
+        AFF4Flusher<AFF4Stream> stream;
+        RETURN_IF_ERROR(GetStream(stream_urn, stream));
+        result = std::move(stream);
+
+        // Forget about streams which have since been destroyed.
+        for (auto i = shared_streams.begin(); i != shared_streams.end();) {
+            if (i->second.expired()) {
+                i = shared_streams.erase(i);
+            } else {
+                i++;
+            }
+        }
+
+        shared_streams[stream_urn] = result;
+    }
+
+    // Move the stream to the front of the recently used list and drop
+    // our reference to the least recently used ones.
+    recent_streams.remove(result);
+    recent_streams.push_front(result);
+    while (recent_streams.size() > max_recent_streams) {
+        recent_streams.pop_back();
+    }
+
+    return STATUS_OK;
+}
+
 
 } // namespace aff4
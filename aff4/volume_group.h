@@ -1,6 +1,8 @@
 #ifndef     AFF4_VOLUME_GROUP_H_
 #define     AFF4_VOLUME_GROUP_H_
 
+#include <list>
+#include <memory>
 #include <unordered_map>
 #include "aff4/aff4_io.h"
 #include "aff4/data_store.h"
@@ -14,6 +16,15 @@ namespace aff4 {
      std::unordered_map<URN, AFF4Flusher<AFF4Volume>> volume_objs;
      DataStore *resolver;
 
+     // Streams handed out by GetSharedStream(). These are weak so a
+     // stream lives only as long as someone holds it.
+     std::unordered_map<URN, std::weak_ptr<AFF4Stream>> shared_streams;
+
+     // The most recently used shared streams, most recent first. We
+     // hold these open so they can be reused even when nobody else
+     // holds them.
+     std::list<std::shared_ptr<AFF4Stream>> recent_streams;
+
  public:
      VolumeGroup(DataStore *resolver) : resolver(resolver) {}
      virtual ~VolumeGroup() {}
@@ -21,6 +32,17 @@ namespace aff4 {
      void AddVolume(AFF4Flusher<AFF4Volume> &&volume);
 
      AFF4Status GetStream(URN segment_urn, AFF4Flusher<AFF4Stream> &result);
+
+     // Like GetStream() but the stream is shared by all callers asking
+     // for the same URN, so e.g. several maps using the same data stream
+     // share a single AFF4Image and its chunk cache.
+     AFF4Status GetSharedStream(const URN &stream_urn,
+                                std::shared_ptr<AFF4Stream> &result);
+
+     // The number of recently used shared streams kept open when they
+     // are no longer in use. Each AFF4Image holds its own chunk cache
+     // so this bounds the memory used by idle streams.
+     size_t max_recent_streams = 8;
  };
 
 } // namespace aff4
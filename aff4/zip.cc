@@ -104,6 +104,19 @@ AFF4Status ZipFile::LoadTurtleMetadata() {
                         turtle_stream));
 
     RETURN_IF_ERROR(resolver->LoadFromTurtle(*turtle_stream));
+    has_metadata = true;
+
+    // Apply any metadata deltas in the order they were written.
+    for (metadata_deltas = 0;; metadata_deltas++) {
+        URN delta_urn = MetadataDeltaURN(metadata_deltas + 1);
+        if (members.count(member_name_for_urn(delta_urn, urn, true)) == 0) {
+            break;
+        }
+
+        AFF4Flusher<AFF4Stream> delta_stream;
+        RETURN_IF_ERROR(OpenMemberStream(delta_urn, delta_stream));
+        RETURN_IF_ERROR(resolver->MergeFromTurtle(*delta_stream));
+    }
 
     // Ensure the correct backing store URN overrides the one stored in the
     // turtle file since it is more current.
@@ -150,6 +163,7 @@ AFF4Status ZipFile::OpenZipFile(
     // Parse the ZIP file.
     RETURN_IF_ERROR(self->parse_cd());
     RETURN_IF_ERROR(self->LoadTurtleMetadata());
+    self->metadata_generation = resolver->Generation();
 
     result = std::move(self);
 
@@ -285,6 +299,12 @@ AFF4Status ZipFile::parse_cd() {
         resolver->logger->info("Global offset: {:x}", global_offset);
     }
 
+    // The member locations are added to the resolver in one batch.
+    StatementBatch locations;
+    if (directory_number_of_entries > 0) {
+        locations.reserve(directory_number_of_entries);
+    }
+
     // Now iterate over the directory and read all the ZipInfo structs.
     aff4_off_t entry_offset = directory_offset;
     for (int i = 0; i < directory_number_of_entries; i++) {
@@ -351,8 +371,8 @@ AFF4Status ZipFile::parse_cd() {
 
             // Store this information in the resolver. Ths allows segments to be
             // directly opened by URN.
-            URN member_urn = urn_from_member_name(zip_info->filename, urn);
-            resolver->Set(member_urn, AFF4_STORED, new URN(urn));
+            locations.Add(urn_from_member_name(zip_info->filename, urn),
+                          AFF4_STORED, resolver->MakeValue<URN>(urn));
 
             members[zip_info->filename] = std::move(zip_info);
         }
@@ -362,9 +382,26 @@ AFF4Status ZipFile::parse_cd() {
                          entry.extra_field_len + entry.file_comment_length);
     }
 
+    resolver->SetBatch(locations);
+
     return STATUS_OK;
 }
 
+AFF4Status ZipFile::DropMemberData(const ZipInfo& zip_info) {
+    if (dropped_length > 0) {
+        RETURN_IF_ERROR(backing_stream->DropCachedData(
+                            dropped_offset, dropped_length));
+    }
+
+    // The extra fields and data descriptor are a few bytes, well below
+    // the page granularity of the advice.
+    dropped_offset = global_offset + zip_info.local_header_offset;
+    dropped_length = (sizeof(ZipFileHeader) + zip_info.filename.size() +
+                      zip_info.compress_size);
+
+    return backing_stream->DropCachedData(dropped_offset, dropped_length);
+}
+
 AFF4Status ZipFile::Flush() {
     // If the zip file was changed, re-write the central directory.
     if (IsDirty()) {
@@ -379,19 +416,62 @@ AFF4Status ZipFile::Flush() {
         }
 
         // Update the resolver into the zip file.
-        {
-            AFF4Flusher<AFF4Stream> turtle_segment;
+        RETURN_IF_ERROR(WriteTurtleMetadata());
+
+        RETURN_IF_ERROR(write_zip64_CD(*backing_stream));
+
+        // The central directory is the end of the volume, release any
+        // space preallocated past it.
+        RETURN_IF_ERROR(backing_stream->TrimToSize());
+    }
+
+    return AFF4Volume::Flush();
+}
+
+URN ZipFile::MetadataDeltaURN(int number) {
+    return urn.Append(aff4_sprintf("%s.%d", AFF4_CONTAINER_INFO_TURTLE, number));
+}
+
+AFF4Status ZipFile::WriteTurtleMetadata() {
+    uint64_t generation = resolver->Generation();
+
+    if (resolver->track_changes && has_metadata &&
+        metadata_deltas < max_metadata_deltas) {
+        StringIO delta;
+        if (resolver->DumpChangesToTurtle(
+                delta, urn, metadata_generation) == STATUS_OK) {
+            AFF4Flusher<AFF4Stream> delta_segment;
             RETURN_IF_ERROR(
                 CreateMemberStream(
-                    urn.Append("information.turtle"), turtle_segment));
+                    MetadataDeltaURN(metadata_deltas + 1), delta_segment));
+
+            RETURN_IF_ERROR(delta_segment->Write(delta.buffer));
 
-            resolver->DumpToTurtle(*turtle_segment, urn);
+            metadata_deltas++;
+            metadata_generation = generation;
+            return STATUS_OK;
         }
+    }
 
-        RETURN_IF_ERROR(write_zip64_CD(*backing_stream));
+    // A full rewrite supersedes all the deltas.
+    for (; metadata_deltas > 0; metadata_deltas--) {
+        members.erase(member_name_for_urn(
+                          MetadataDeltaURN(metadata_deltas), urn, true));
     }
 
-    return AFF4Volume::Flush();
+    {
+        AFF4Flusher<AFF4Stream> turtle_segment;
+        RETURN_IF_ERROR(
+            CreateMemberStream(
+                urn.Append(AFF4_CONTAINER_INFO_TURTLE), turtle_segment));
+
+        RETURN_IF_ERROR(resolver->DumpToTurtle(*turtle_segment, urn));
+    }
+
+    has_metadata = true;
+    metadata_generation = generation;
+
+    return STATUS_OK;
 }
 
 /** This writes a zip64 end of central directory and a central
@@ -492,6 +572,10 @@ ZipFileSegment::ZipFileSegment(DataStore* resolver) :
     StringIO(resolver) {
 }
 
+ZipFileSegment::~ZipFileSegment() {
+    StopInflater();
+}
+
 AFF4Status ZipFileSegment::NewZipFileSegment(
     URN urn, ZipFile& owner,
     AFF4Flusher<ZipFileSegment> &result) {
@@ -553,20 +637,12 @@ AFF4Status ZipFileSegment::OpenZipFileSegment(
     backing_store->Seek(file_header.extra_field_len, SEEK_CUR);
 
     switch (file_header.compression_method) {
-        // If the file is deflated we have no choice but to read it all into memory.
+        // Deflated members are inflated in chunks as they are read.
         case ZIP_DEFLATE: {
-            unsigned int buffer_size = zip_info->file_size;
-            std::unique_ptr<char[]> decomp_buffer(new char[buffer_size]);
-
-            std::string c_buffer = backing_store->Read(zip_info->compress_size);
-
-            if (result->DecompressBuffer(
-                    decomp_buffer.get(), buffer_size, c_buffer) != buffer_size) {
-                result->resolver->logger->error("Unable to decompress file.");
-                return PARSING_ERROR;
-            }
-
-            result->buffer.assign(decomp_buffer.get(), buffer_size);
+            result->_compressed_start_offset = backing_store->Tell();
+            result->_compressed_length = zip_info->compress_size;
+            result->_inflated_length = zip_info->file_size;
+            RETURN_IF_ERROR(result->StartInflater());
         }
         break;
 
@@ -592,6 +668,10 @@ std::string ZipFileSegment::Read(size_t length) {
 }
 
 AFF4Status ZipFileSegment::ReadBuffer(char* data, size_t* length) {
+    if (_inflater) {
+        return ReadDeflated(data, length);
+    }
+
     if (_backing_store_start_offset < 0) {
         return StringIO::ReadBuffer(data, length);
     }
@@ -616,7 +696,116 @@ AFF4Status ZipFileSegment::ReadBuffer(char* data, size_t* length) {
     return result;
 }
 
+AFF4Status ZipFileSegment::StartInflater() {
+    StopInflater();
+
+    std::unique_ptr<z_stream> inflater(new z_stream());
+    if (inflateInit2(inflater.get(), -15) != Z_OK) {
+        resolver->logger->critical("Unable to initialise zlib");
+        return MEMORY_ERROR;
+    }
+
+    _inflater = std::move(inflater);
+    _compressed_read = 0;
+    _inflated_offset = 0;
+
+    return STATUS_OK;
+}
+
+void ZipFileSegment::StopInflater() {
+    if (_inflater) {
+        inflateEnd(_inflater.get());
+        _inflater.reset();
+    }
+}
+
+AFF4Status ZipFileSegment::Inflate(char* data, size_t length) {
+    z_stream* strm = _inflater.get();
+    size_t inflated = 0;
+
+    while (inflated < length) {
+        if (strm->avail_in == 0 && _compressed_read < _compressed_length) {
+            AFF4Stream* backing_store = owner->backing_stream.get();
+            size_t chunk = std::min(_compressed_length - _compressed_read,
+                                    (size_t)AFF4_BUFF_SIZE);
+            _compressed_buffer.resize(chunk);
+
+            RETURN_IF_ERROR(backing_store->Seek(
+                                _compressed_start_offset + _compressed_read,
+                                SEEK_SET));
+            RETURN_IF_ERROR(backing_store->ReadBuffer(
+                                &_compressed_buffer[0], &chunk));
+            if (chunk == 0) {
+                break;
+            }
+
+            _compressed_read += chunk;
+            strm->next_in = reinterpret_cast<Bytef*>(&_compressed_buffer[0]);
+            strm->avail_in = chunk;
+        }
+
+        uInt wanted = std::min(length - inflated, (size_t)UINT_MAX);
+        strm->next_out = reinterpret_cast<Bytef*>(data + inflated);
+        strm->avail_out = wanted;
+
+        int ret = inflate(strm, Z_NO_FLUSH);
+        size_t produced = wanted - strm->avail_out;
+        inflated += produced;
+
+        if (ret == Z_STREAM_END || (ret == Z_BUF_ERROR && produced == 0)) {
+            break;
+        }
+
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            resolver->logger->error("Unable to decompress member {}", urn);
+            return PARSING_ERROR;
+        }
+    }
+
+    _inflated_offset += inflated;
+
+    if (inflated != length) {
+        resolver->logger->error("Deflated member {} is truncated", urn);
+        return PARSING_ERROR;
+    }
+
+    return STATUS_OK;
+}
+
+AFF4Status ZipFileSegment::ReadDeflated(char* data, size_t* length) {
+    if ((size_t)readptr >= _inflated_length) {
+        *length = 0;
+        return STATUS_OK;
+    }
+
+    *length = std::min(*length, _inflated_length - (size_t)readptr);
+
+    if (readptr < _inflated_offset) {
+        RETURN_IF_ERROR(StartInflater());
+    }
+
+    // Inflate and discard everything before the read pointer.
+    if (_inflated_offset < readptr) {
+        std::string skipped(std::min((size_t)(readptr - _inflated_offset),
+                                     (size_t)AFF4_BUFF_SIZE), 0);
+        while (_inflated_offset < readptr) {
+            size_t skip = std::min((size_t)(readptr - _inflated_offset),
+                                   skipped.size());
+            RETURN_IF_ERROR(Inflate(&skipped[0], skip));
+        }
+    }
+
+    RETURN_IF_ERROR(Inflate(data, *length));
+    readptr += *length;
+
+    return STATUS_OK;
+}
+
 aff4_off_t ZipFileSegment::Size() const {
+    if (_inflater) {
+        return _inflated_length;
+    }
+
     if (_backing_store_start_offset < 0) {
         return StringIO::Size();
     }
@@ -626,12 +815,27 @@ aff4_off_t ZipFileSegment::Size() const {
 
 AFF4Status ZipFileSegment::Truncate() {
     // Ensure we stop mapping the backing file.
+    StopInflater();
     _backing_store_start_offset = -1;
 
     return StringIO::Truncate();
 }
 
 AFF4Status ZipFileSegment::Write(const char* data, size_t length) {
+    // Modifying a deflated member needs all of it in memory.
+    if (_inflater) {
+        aff4_off_t position = readptr;
+        std::string contents(_inflated_length, 0);
+        size_t contents_length = contents.size();
+
+        readptr = 0;
+        RETURN_IF_ERROR(ReadDeflated(&contents[0], &contents_length));
+
+        StopInflater();
+        buffer = std::move(contents);
+        readptr = position;
+    }
+
     return StringIO::Write(data, length);
 }
 
@@ -669,33 +873,6 @@ std::string ZipFileSegment::CompressBuffer(
     return std::string(c_buffer.get(), strm.total_out);
 }
 
-unsigned int ZipFileSegment::DecompressBuffer(
-    char* buffer, int length, const std::string& c_buffer) {
-    z_stream strm;
-
-    memset(&strm, 0, sizeof(strm));
-
-    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(c_buffer.data()));
-
-    strm.avail_in = c_buffer.size();
-    strm.next_out = reinterpret_cast<Bytef*>(buffer);
-    strm.avail_out = length;
-
-    if (inflateInit2(&strm, -15) != Z_OK) {
-        resolver->logger->critical("Unable to initialise zlib ({})", strm.msg);
-        return 0;
-    }
-
-    if (inflate(&strm, Z_FINISH) != Z_STREAM_END) {
-        inflateEnd(&strm);
-        return 0;
-    }
-
-    inflateEnd(&strm);
-
-    return length - strm.avail_out;
-}
-
 AFF4Status ZipFileSegment::Flush() {
     if (IsDirty()) {
         // Borrow a reference to the backing stream.
@@ -748,11 +925,34 @@ AFF4Status ZipFileSegment::Flush() {
                                 owner->urn, urn);
 
         owner->MarkDirty();
+
+        if (drop_after_flush) {
+            RETURN_IF_ERROR(owner->DropMemberData(*owner->members[member_name]));
+        }
     }
 
     return AFF4Stream::Flush();
 }
 
+AFF4Status ZipFileSegment::DropCachedData(aff4_off_t offset, aff4_off_t length) {
+    UNUSED(offset);
+    UNUSED(length);
+
+    // Not written yet.
+    if (IsDirty()) {
+        drop_after_flush = true;
+        return STATUS_OK;
+    }
+
+    const auto it = owner->members.find(
+        member_name_for_urn(urn, owner->urn, true));
+    if (it == owner->members.end()) {
+        return STATUS_OK;
+    }
+
+    return owner->DropMemberData(*it->second);
+}
+
 // Copy the stream into this new segment.
 AFF4Status ZipFileSegment::WriteStream(AFF4Stream* source, ProgressContext* progress) {
     return owner->StreamAddMember(urn, *source, compression_method, progress);
@@ -153,10 +153,25 @@ class ZipFileSegment: public StringIO {
     aff4_off_t _backing_store_start_offset = -1;
     size_t _backing_store_length = 0;
 
+    // If this is set, we are reading a deflated member. It is inflated
+    // in chunks as it is read rather than held in memory, so reading
+    // backwards restarts the inflater from the start of the member.
+    std::unique_ptr<z_stream> _inflater;
+    aff4_off_t _compressed_start_offset = 0;
+    size_t _compressed_length = 0;
+    size_t _compressed_read = 0;
+    std::string _compressed_buffer;
+
+    // The uncompressed size of the member and how much of it the
+    // inflater has produced.
+    size_t _inflated_length = 0;
+    aff4_off_t _inflated_offset = 0;
+
   public:
     ZipFile *owner = nullptr;   /* Not owned */
 
     explicit ZipFileSegment(DataStore* resolver);
+    ~ZipFileSegment();
 
     static AFF4Status NewZipFileSegment(
         URN urn, ZipFile& zipfile,
@@ -178,12 +193,23 @@ class ZipFileSegment: public StringIO {
     AFF4Status WriteStream(
         AFF4Stream* source, ProgressContext* progress = nullptr) override;
 
+    // Drops the whole member from the page cache once it has been
+    // written to the backing stream.
+    AFF4Status DropCachedData(aff4_off_t offset, aff4_off_t length) override;
+
     using AFF4Stream::Write;
 
  private:
+    bool drop_after_flush = false;
+
     std::string CompressBuffer(const std::string& buffer);
-    unsigned int DecompressBuffer(
-        char* buffer, int length, const std::string& c_buffer);
+
+    AFF4Status StartInflater();
+    void StopInflater();
+
+    // Inflates exactly length bytes from the current inflater position.
+    AFF4Status Inflate(char* data, size_t length);
+    AFF4Status ReadDeflated(char* data, size_t* length);
 };
 
 
@@ -286,6 +312,33 @@ class ZipFile: public AFF4Volume {
      */
     AFF4Status LoadTurtleMetadata();
 
+    // Writes the resolver into information.turtle, or only the changes
+    // since the last write into a delta member when possible.
+    AFF4Status WriteTurtleMetadata();
+
+    // The URN of the numbered information.turtle delta member.
+    URN MetadataDeltaURN(int number);
+
+    // The resolver generation last written to (or loaded from) this
+    // volume's metadata.
+    uint64_t metadata_generation = 0;
+
+    // Number of information.turtle.<n> delta members in the volume.
+    int metadata_deltas = 0;
+
+    // Set once information.turtle exists in the volume.
+    bool has_metadata = false;
+
+    // Tells the backing stream that the member will not be read again.
+    AFF4Status DropMemberData(const ZipInfo& zip_info);
+
+    // The range given to the previous DropMemberData() call. Pages just
+    // written are still dirty and stay cached, so the advice is
+    // repeated on the next call when they have usually been written
+    // back.
+    aff4_off_t dropped_offset = 0;
+    aff4_off_t dropped_length = 0;
+
   public:
     explicit ZipFile(DataStore* resolver);
 
@@ -342,6 +395,11 @@ class ZipFile: public AFF4Volume {
     // Segment URNs must be constructed from _urn_from_member_name(). Adding new
     // objects to this must use the member names using _member_name_for_urn(URN).
     std::unordered_map<std::string, std::unique_ptr<ZipInfo>> members;
+
+    // When the resolver tracks changes, metadata updates are appended as
+    // information.turtle.<n> members until there are this many, after
+    // which information.turtle is rewritten in full.
+    int max_metadata_deltas = 16;
 };
 
 } // namespace aff4
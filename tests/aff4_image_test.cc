@@ -196,4 +196,223 @@ TEST_F(AFF4ImageTest, TestAFF4ImageStream) {
 }
 
 
+TEST_F(AFF4ImageTest, ReadV) {
+  MemoryDataStore resolver;
+
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<AFF4Volume> zip;
+  EXPECT_OK(NewFileBackedObject(&resolver, filename, "read", file));
+  EXPECT_OK(ZipFile::OpenZipFile(&resolver, std::move(file), zip));
+
+  VolumeGroup volumes(&resolver);
+  volumes.AddVolume(std::move(zip));
+
+  AFF4Flusher<AFF4Image> image;
+  EXPECT_OK(AFF4Image::OpenAFF4Image(
+                &resolver, image_urn, &volumes, image));
+
+  std::string expected;
+  for (int i = 0; i < 100; i++) {
+    expected += aff4_sprintf("Hello world %02d!", i);
+  }
+
+  // Scattered, overlapping and out of order, with one running past the
+  // end of the stream.
+  const aff4_off_t offsets[] = {1200, 3, 0, 15, 700, 1490, 2000};
+  const size_t lengths[] = {100, 40, 10, 40, 1, 100, 10};
+
+  std::vector<std::string> buffers;
+  std::vector<AFF4ReadRequest> requests;
+  for (int i = 0; i < 7; i++) {
+    buffers.emplace_back(lengths[i], 'x');
+  }
+  for (int i = 0; i < 7; i++) {
+    requests.emplace_back(offsets[i], &buffers[i][0], lengths[i]);
+  }
+
+  image->Seek(5, SEEK_SET);
+  EXPECT_OK(image->ReadV(requests));
+
+  // ReadV() does not move the read pointer.
+  EXPECT_EQ(image->Tell(), 5);
+
+  for (int i = 0; i < 7; i++) {
+    std::string wanted = expected.substr(
+        std::min((size_t)offsets[i], expected.size()), lengths[i]);
+    EXPECT_OK(requests[i].status);
+    EXPECT_EQ(requests[i].result_length, wanted.size());
+    EXPECT_EQ(buffers[i].substr(0, requests[i].result_length), wanted);
+  }
+}
+
+
+// A source whose asynchronous reads return at most max_read bytes and
+// fail when they cover fail_offset.
+class ShortReadSource: public StringIO {
+ public:
+  explicit ShortReadSource(const std::string& data): StringIO(data) {}
+
+  AFF4Status SubmitRead(aff4_off_t offset, char* data, size_t length,
+                        uint64_t tag) override {
+    if (fail_offset >= offset && fail_offset < offset + (aff4_off_t)length) {
+      AFF4Completion completion;
+      completion.tag = tag;
+      completion.status = IO_ERROR;
+      completions.push_back(completion);
+      return STATUS_OK;
+    }
+
+    return StringIO::SubmitRead(
+        offset, data, std::min(length, max_read), tag);
+  }
+
+  size_t max_read = 300;
+  aff4_off_t fail_offset = -1;
+};
+
+
+TEST_F(AFF4ImageTest, ShortSourceReads) {
+  MemoryDataStore resolver;
+  std::string data;
+  for (int i = 0; i < 1000; i++) {
+    data += aff4_sprintf("Hello world %04d!", i);
+  }
+
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<ZipFile> zip;
+  EXPECT_OK(NewFileBackedObject(&resolver, filename, "truncate", file));
+  EXPECT_OK(ZipFile::NewZipFile(&resolver, std::move(file), zip));
+
+  // Short reads are completed rather than ending the image early.
+  URN image_urn = zip->urn.Append("short");
+  {
+    AFF4Flusher<AFF4Image> image;
+    EXPECT_OK(AFF4Image::NewAFF4Image(
+                  &resolver, image_urn, zip.get(), image));
+    image->chunk_size = 1000;
+    image->chunks_per_segment = 4;
+
+    ShortReadSource source(data);
+    EXPECT_OK(image->WriteStream(&source));
+    EXPECT_EQ(image->Size(), data.size());
+  }
+
+  // Read errors are reported.
+  {
+    AFF4Flusher<AFF4Image> image;
+    EXPECT_OK(AFF4Image::NewAFF4Image(
+                  &resolver, zip->urn.Append("failed"), zip.get(), image));
+    image->chunk_size = 1000;
+    image->chunks_per_segment = 4;
+
+    ShortReadSource source(data);
+    source.fail_offset = 9500;
+    EXPECT_EQ(image->WriteStream(&source), IO_ERROR);
+  }
+
+  VolumeGroup volumes(&resolver);
+  volumes.AddVolume(AFF4Flusher<AFF4Volume>(zip.release()));
+
+  AFF4Flusher<AFF4Image> image;
+  EXPECT_OK(AFF4Image::OpenAFF4Image(
+                &resolver, image_urn, &volumes, image));
+  EXPECT_EQ(image->Read(data.size()), data);
+}
+
+
+TEST_F(AFF4ImageTest, HugePageChunkBuffers) {
+  MemoryDataStore resolver;
+  std::string data;
+  for (int i = 0; i < 1000; i++) {
+    data += aff4_sprintf("Hello world %04d!", i);
+  }
+
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<ZipFile> zip;
+  EXPECT_OK(NewFileBackedObject(&resolver, filename, "truncate", file));
+  EXPECT_OK(ZipFile::NewZipFile(&resolver, std::move(file), zip));
+
+  // Write through both the Write() and WriteStream() paths, several
+  // bevies each.
+  URN written_urn = zip->urn.Append("written");
+  {
+    AFF4Flusher<AFF4Image> image;
+    EXPECT_OK(AFF4Image::NewAFF4Image(
+                  &resolver, written_urn, zip.get(), image));
+    image->chunk_size = 1000;
+    image->chunks_per_segment = 4;
+    image->huge_pages = true;
+    EXPECT_OK(image->Write(data.data(), data.size()));
+  }
+
+  URN streamed_urn = zip->urn.Append("streamed");
+  {
+    AFF4Flusher<AFF4Image> image;
+    EXPECT_OK(AFF4Image::NewAFF4Image(
+                  &resolver, streamed_urn, zip.get(), image));
+    image->chunk_size = 1000;
+    image->chunks_per_segment = 4;
+    image->huge_pages = true;
+
+    std::unique_ptr<AFF4Stream> source = StringIO::NewStringIO();
+    source->Write(data);
+    source->Seek(0, SEEK_SET);
+    EXPECT_OK(image->WriteStream(source.get()));
+  }
+
+  VolumeGroup volumes(&resolver);
+  volumes.AddVolume(AFF4Flusher<AFF4Volume>(zip.release()));
+
+  for (const URN& image_urn : {written_urn, streamed_urn}) {
+    AFF4Flusher<AFF4Image> image;
+    EXPECT_OK(AFF4Image::OpenAFF4Image(
+                  &resolver, image_urn, &volumes, image));
+    image->huge_pages = true;
+    EXPECT_EQ(image->Read(data.size()), data);
+  }
+}
+
+
+TEST_F(AFF4ImageTest, MixedWriteSizes) {
+  MemoryDataStore resolver;
+  std::string data;
+  for (int i = 0; i < 2000; i++) {
+    data += aff4_sprintf("Hello world %04d!", i);
+  }
+
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<ZipFile> zip;
+  EXPECT_OK(NewFileBackedObject(&resolver, filename, "truncate", file));
+  EXPECT_OK(ZipFile::NewZipFile(&resolver, std::move(file), zip));
+
+  URN image_urn = zip->urn.Append("mixed");
+  {
+    AFF4Flusher<AFF4Image> image;
+    EXPECT_OK(AFF4Image::NewAFF4Image(
+                  &resolver, image_urn, zip.get(), image));
+    image->chunk_size = 1000;
+    image->chunks_per_segment = 3;
+
+    // Small writes, writes straddling chunks, whole chunks and runs of
+    // several chunks, both on and off chunk boundaries.
+    const size_t sizes[] = {1, 999, 1000, 3000, 17, 2983, 10000, 1};
+    size_t offset = 0;
+    for (int i = 0; offset < data.size(); i++) {
+      const size_t length = std::min(sizes[i % 8], data.size() - offset);
+      EXPECT_OK(image->Write(data.data() + offset, length));
+      offset += length;
+    }
+  }
+
+  VolumeGroup volumes(&resolver);
+  volumes.AddVolume(AFF4Flusher<AFF4Volume>(zip.release()));
+
+  AFF4Flusher<AFF4Image> image;
+  EXPECT_OK(AFF4Image::OpenAFF4Image(
+                &resolver, image_urn, &volumes, image));
+  EXPECT_EQ(image->Size(), data.size());
+  EXPECT_EQ(image->Read(data.size()), data);
+}
+
+
 } // namespace aff4
@@ -1,7 +1,9 @@
 #include <gtest/gtest.h>
 #include "aff4/libaff4.h"
 #include <unistd.h>
+#include <sys/stat.h>
 #include <glog/logging.h>
+#include "aff4/aff4_symstream.h"
 #include "utils.h"
 
 namespace aff4 {
@@ -263,4 +265,389 @@ TEST_F(AFF4MapTest, CreateMapStream) {
   }
 }
 
+TEST_F(AFF4MapTest, CopyToSparseStream) {
+  MemoryDataStore resolver;
+  std::string output_filename = "/tmp/aff4_sparse_export.dd";
+  const aff4_off_t map_size = 64 * 1024 * 1024;
+
+  AFF4Flusher<AFF4Stream> source(new StringIO(&resolver));
+  source->Write("AAAABBBB");
+
+  AFF4Flusher<AFF4Stream> zero(new AFF4SymbolicStream(
+      &resolver, URN(AFF4_IMAGESTREAM_ZERO), 0));
+
+  AFF4Flusher<AFF4Map> map(new AFF4Map(&resolver));
+  map->AddRange(4, 0, 4, source.get());               // 0000AAAA
+  map->AddRange(8, 0, 1024 * 1024, zero.get());       // Explicit zeros.
+  map->AddRange(2 * 1024 * 1024, 4, 4, source.get()); // BBBB in the middle.
+  map->SetSize(map_size);                             // Trailing hole.
+
+  {
+      AFF4Flusher<FileBackedObject> output;
+      EXPECT_OK(NewFileBackedObject(
+                    &resolver, output_filename, "truncate", output));
+      EXPECT_OK(map->CopyToSparseStream(*output));
+      EXPECT_EQ(output->Size(), map_size);
+  }
+
+  AFF4Flusher<AFF4Stream> output;
+  EXPECT_OK(NewFileBackedObject(&resolver, output_filename, "read", output));
+  EXPECT_EQ(output->Size(), map_size);
+  EXPECT_EQ(output->Read(12), std::string("\0\0\0\0AAAA\0\0\0\0", 12));
+
+  output->Seek(2 * 1024 * 1024 - 2, SEEK_SET);
+  EXPECT_EQ(output->Read(8), std::string("\0\0BBBB\0\0", 8));
+
+  output->Seek(-1, SEEK_END);
+  EXPECT_EQ(output->Read(1), std::string("\0", 1));
+
+  // Only the mapped data should have been allocated on disk.
+  struct stat st;
+  EXPECT_EQ(stat(output_filename.c_str(), &st), 0);
+  EXPECT_LT(st.st_blocks * 512, map_size / 2);
+
+  unlink(output_filename.c_str());
+}
+
+TEST_F(AFF4MapTest, ReadV) {
+  MemoryDataStore resolver;
+
+  AFF4Flusher<AFF4Stream> source(new StringIO(&resolver));
+  source->Write("AAAABBBBCCCCDDDD");
+
+  AFF4Flusher<AFF4Stream> other(new StringIO(&resolver));
+  other->Write("XXXXYYYY");
+
+  AFF4Flusher<AFF4Map> map(new AFF4Map(&resolver));
+  map->AddRange(4, 0, 8, source.get());   // 0000AAAABBBB
+  map->AddRange(16, 4, 4, other.get());   // 0000AAAABBBB0000YYYY
+  map->AddRange(20, 12, 4, source.get()); // 0000AAAABBBB0000YYYYDDDD
+
+  std::string first(10, 'x');
+  std::string second(12, 'x');
+  std::string third(10, 'x');
+
+  std::vector<AFF4ReadRequest> requests;
+  requests.emplace_back(2, &first[0], first.size());
+  requests.emplace_back(10, &second[0], second.size());
+  requests.emplace_back(22, &third[0], third.size());
+
+  EXPECT_OK(map->ReadV(requests));
+
+  EXPECT_EQ(first, std::string("\0\0AAAABBBB", 10));
+  EXPECT_EQ(second, std::string("BB\0\0\0\0YYYYDD", 12));
+
+  // The last request runs past the end of the map.
+  EXPECT_EQ(requests[2].result_length, 2);
+  EXPECT_EQ(third.substr(0, 2), "DD");
+}
+
+TEST_F(AFF4MapTest, ElideConstantBlocks) {
+  MemoryDataStore resolver;
+  std::string elide_filename = "/tmp/aff4_elide_test.zip";
+  URN elide_image_urn;
+
+  // Four zero blocks, a data block, an 0xFF block, an 'A' block and a
+  // short zero tail which is too small to be elided.
+  std::string data(4 * 4096, 0);
+  for (int i = 0; i < 256; i++) {
+      data += "0123456789ABCDEF";
+  }
+  data += std::string(4096, '\xff');
+  data += std::string(4096, 'A');
+  data += std::string(100, 0);
+
+  {
+      AFF4Flusher<AFF4Stream> file;
+      AFF4Flusher<ZipFile> zip;
+      EXPECT_OK(NewFileBackedObject(
+                    &resolver, elide_filename, "truncate", file));
+      EXPECT_OK(ZipFile::NewZipFile(&resolver, std::move(file), zip));
+      elide_image_urn = zip->urn.Append(image_name);
+
+      AFF4Flusher<AFF4Map> map;
+      EXPECT_OK(AFF4Map::NewAFF4Map(
+                    &resolver, elide_image_urn, zip.get(), nullptr, map));
+      map->elide_constant_blocks = true;
+
+      EXPECT_OK(map->Write(data));
+
+      std::vector<Range> ranges = map->GetRanges();
+      EXPECT_EQ(ranges.size(), 5);
+      EXPECT_EQ(map->targets[ranges[0].target_id]->urn.SerializeToString(),
+                AFF4_IMAGESTREAM_ZERO);
+      EXPECT_EQ(ranges[0].length, 4 * 4096);
+
+      // Only the data block and the short tail were actually stored.
+      EXPECT_EQ(map->targets[ranges[1].target_id]->Size(), 4096 + 100);
+      EXPECT_EQ(map->targets[ranges[2].target_id]->urn.SerializeToString(),
+                AFF4_IMAGESTREAM_FF);
+      EXPECT_EQ(map->targets[ranges[3].target_id]->urn.SerializeToString(),
+                aff4_sprintf("%s%02X", AFF4_IMAGESTREAM_SYMBOLIC_PREFIX, 'A'));
+      EXPECT_EQ(ranges[4].length, 100);
+  }
+
+  // The symbolic targets must be resolvable when the map is reopened.
+  MemoryDataStore read_resolver;
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<AFF4Volume> zip;
+  EXPECT_OK(NewFileBackedObject(&read_resolver, elide_filename, "read", file));
+  EXPECT_OK(ZipFile::OpenZipFile(&read_resolver, std::move(file), zip));
+
+  VolumeGroup volumes(&read_resolver);
+  volumes.AddVolume(std::move(zip));
+
+  AFF4Flusher<AFF4Map> map;
+  EXPECT_OK(AFF4Map::OpenAFF4Map(
+                &read_resolver, elide_image_urn, &volumes, map));
+  EXPECT_EQ(map->Size(), data.size());
+  EXPECT_EQ(map->Read(data.size()), data);
+
+  unlink(elide_filename.c_str());
+}
+
+TEST_F(AFF4MapTest, WriteStreamFromCurrentPosition) {
+  MemoryDataStore resolver;
+
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<AFF4Volume> zip;
+  EXPECT_OK(NewFileBackedObject(&resolver, filename, "read", file));
+  EXPECT_OK(ZipFile::OpenZipFile(&resolver, std::move(file), zip));
+
+  AFF4Flusher<AFF4Stream> data_stream(new StringIO(&resolver));
+  AFF4Flusher<AFF4Map> map;
+  EXPECT_OK(AFF4Map::NewAFF4Map(
+                &resolver, image_urn, zip.get(), data_stream.get(), map));
+  map->elide_constant_blocks = true;
+
+  std::string data = std::string(100, 'x') + std::string(8192, 0) + "tail";
+  AFF4Flusher<AFF4Stream> source(new StringIO(&resolver));
+  source->Write(data);
+
+  // Elision reads the source from where the caller left it.
+  source->Seek(100, SEEK_SET);
+  EXPECT_OK(map->WriteStream(source.get()));
+
+  EXPECT_EQ(map->Size(), data.size() - 100);
+  map->Seek(0, SEEK_SET);
+  EXPECT_EQ(map->Read(map->Size()), data.substr(100));
+}
+
+// Records whether the map handed it the whole source stream.
+class WriteStreamRecorder: public StringIO {
+ public:
+  explicit WriteStreamRecorder(DataStore* resolver): StringIO(resolver) {}
+
+  AFF4Status WriteStream(AFF4Stream* source,
+                         ProgressContext* progress = nullptr) override {
+    write_stream_calls++;
+    return StringIO::WriteStream(source, progress);
+  }
+
+  int write_stream_calls = 0;
+};
+
+TEST_F(AFF4MapTest, DefaultKeepsConstantBlocks) {
+  MemoryDataStore resolver;
+
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<AFF4Volume> zip;
+  EXPECT_OK(NewFileBackedObject(&resolver, filename, "read", file));
+  EXPECT_OK(ZipFile::OpenZipFile(&resolver, std::move(file), zip));
+
+  std::string data(4 * 4096, 0);
+  data += std::string(4096, 'A');
+
+  // By default Write() stores constant blocks in the data stream.
+  {
+    AFF4Flusher<AFF4Stream> data_stream(new StringIO(&resolver));
+    AFF4Flusher<AFF4Map> map;
+    EXPECT_OK(AFF4Map::NewAFF4Map(
+                  &resolver, image_urn, zip.get(), data_stream.get(), map));
+
+    EXPECT_OK(map->Write(data));
+    EXPECT_EQ(data_stream->Size(), data.size());
+
+    std::vector<Range> ranges = map->GetRanges();
+    EXPECT_EQ(ranges.size(), 1);
+    EXPECT_EQ(map->targets[ranges[0].target_id], data_stream.get());
+  }
+
+  // WriteStream() hands the whole source to the data stream.
+  {
+    AFF4Flusher<WriteStreamRecorder> data_stream(
+        new WriteStreamRecorder(&resolver));
+    AFF4Flusher<AFF4Map> map;
+    EXPECT_OK(AFF4Map::NewAFF4Map(
+                  &resolver, image_urn_streamed, zip.get(), data_stream.get(),
+                  map));
+
+    AFF4Flusher<AFF4Stream> source(new StringIO(&resolver));
+    source->Write(data);
+    EXPECT_OK(map->WriteStream(source.get()));
+    EXPECT_EQ(data_stream->write_stream_calls, 1);
+
+    EXPECT_EQ(data_stream->Size(), data.size());
+    std::vector<Range> ranges = map->GetRanges();
+    EXPECT_EQ(ranges.size(), 1);
+    EXPECT_EQ(ranges[0].length, data.size());
+    EXPECT_EQ(map->targets[ranges[0].target_id], data_stream.get());
+  }
+}
+
+TEST_F(AFF4MapTest, DedupBlocks) {
+  MemoryDataStore resolver;
+
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<AFF4Volume> zip;
+  EXPECT_OK(NewFileBackedObject(&resolver, filename, "read", file));
+  EXPECT_OK(ZipFile::OpenZipFile(&resolver, std::move(file), zip));
+
+  AFF4Flusher<AFF4Stream> data_stream(new StringIO(&resolver));
+
+  AFF4Flusher<AFF4Map> map;
+  EXPECT_OK(AFF4Map::NewAFF4Map(
+                &resolver, image_urn, zip.get(), data_stream.get(), map));
+  map->dedup_blocks = true;
+  map->write_block_size = 16;
+
+  std::string a = "AAAABBBBCCCCDDDD";
+  std::string b = "0123456789ABCDEF";
+  std::string c = "Hello world 0001";
+  std::string data = a + b + a + c + b + b + "tail";
+
+  EXPECT_OK(map->Write(data));
+
+  // Only the unique blocks and the short tail are stored.
+  EXPECT_EQ(data_stream->Size(), 3 * 16 + 4);
+  EXPECT_EQ(map->dedup_blocks_checked, 6);
+  EXPECT_EQ(map->dedup_blocks_found, 3);
+
+  map->Seek(0, SEEK_SET);
+  EXPECT_EQ(map->Read(data.size()), data);
+
+  // The two trailing copies of b map to the same data.
+  std::vector<Range> ranges = map->GetRanges();
+  EXPECT_EQ(ranges.back().target_offset, 3 * 16);
+  EXPECT_EQ(ranges.back().length, 4);
+
+  // The stored blocks are a, b and c, whose digests key the index.
+  const char* expected[] = {
+    "669c164f44198b43b7175ac0dff496fe43393717428747ccb44c294fbeaca6e0",
+    "2125b2c332b1113aae9bfc5e9f7e3b4c91d828cb942c2df1eeb02502eccae9e9",
+    "da00ccc62531da14eacee358381cbeb8e78382b10fa7f304b3a8f5235503e0d6",
+  };
+  data_stream->Seek(0, SEEK_SET);
+  for (const char* hex : expected) {
+    std::string block = data_stream->Read(16);
+    std::string digest = SHA256Digest(block.data(), block.size());
+    std::string digest_hex;
+    for (char ch : digest) {
+      digest_hex += aff4_sprintf("%02x", ch & 0xff);
+    }
+    EXPECT_EQ(digest_hex, hex);
+  }
+}
+
+// Blocks which differ in a single bit must both be stored.
+TEST_F(AFF4MapTest, DedupSimilarBlocks) {
+  MemoryDataStore resolver;
+
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<AFF4Volume> zip;
+  EXPECT_OK(NewFileBackedObject(&resolver, filename, "read", file));
+  EXPECT_OK(ZipFile::OpenZipFile(&resolver, std::move(file), zip));
+
+  AFF4Flusher<AFF4Stream> data_stream(new StringIO(&resolver));
+
+  AFF4Flusher<AFF4Map> map;
+  EXPECT_OK(AFF4Map::NewAFF4Map(
+                &resolver, image_urn, zip.get(), data_stream.get(), map));
+  map->dedup_blocks = true;
+  map->write_block_size = 32;
+
+  std::string a = "AAAABBBBCCCCDDDD0123456789ABCDEF";
+  std::string b = a;
+  b[17] ^= 1;
+
+  std::string data = a + b + a;
+  EXPECT_OK(map->Write(data));
+
+  EXPECT_EQ(data_stream->Size(), 2 * 32);
+  EXPECT_EQ(map->dedup_blocks_found, 1);
+
+  map->Seek(0, SEEK_SET);
+  EXPECT_EQ(map->Read(data.size()), data);
+}
+
+TEST_F(AFF4MapTest, SharedTargets) {
+  MemoryDataStore resolver;
+
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<AFF4Volume> zip;
+  EXPECT_OK(NewFileBackedObject(&resolver, filename, "read", file));
+  EXPECT_OK(ZipFile::OpenZipFile(&resolver, std::move(file), zip));
+
+  VolumeGroup volumes(&resolver);
+  volumes.AddVolume(std::move(zip));
+
+  AFF4Flusher<AFF4Map> map;
+  EXPECT_OK(AFF4Map::OpenAFF4Map(
+                &resolver, image_urn, &volumes, map));
+
+  AFF4Flusher<AFF4Map> map2;
+  EXPECT_OK(AFF4Map::OpenAFF4Map(
+                &resolver, image_urn, &volumes, map2));
+
+  // Both maps use the same data stream object.
+  EXPECT_EQ(map->targets[0], map2->targets[0]);
+  for (auto target : map->targets) {
+      EXPECT_EQ(target, map->targets[0]);
+  }
+
+  map->Seek(50, SEEK_SET);
+  map2->Seek(0, SEEK_SET);
+  EXPECT_STREQ(map2->Read(2).c_str(), "00");
+  EXPECT_STREQ(map->Read(2).c_str(), "50");
+
+  // The stream stays cached after both maps are gone.
+  AFF4Stream *target = map->targets[0];
+  map.reset();
+  map2.reset();
+
+  std::shared_ptr<AFF4Stream> shared;
+  EXPECT_OK(volumes.GetSharedStream(image_urn.Append("data"), shared));
+  EXPECT_EQ(shared.get(), target);
+}
+
+TEST_F(AFF4MapTest, MapStats) {
+  MemoryDataStore resolver;
+
+  AFF4Flusher<AFF4Stream> a(new StringIO(&resolver));
+  AFF4Flusher<AFF4Stream> b(new StringIO(&resolver));
+
+  AFF4Flusher<AFF4Map> map(new AFF4Map(&resolver));
+  map->AddRange(0, 0, 100, a.get());
+  map->AddRange(200, 0, 100, b.get());
+
+  // Overwrite the middle of the first range - splits it into three.
+  map->AddRange(10, 500, 10, b.get());
+  map->SetSize(1000);
+
+  AFF4MapStats stats = map->GetStats();
+  EXPECT_EQ(stats.range_count, map->GetRanges().size());
+  EXPECT_EQ(stats.range_count, 4);
+  EXPECT_EQ(stats.mapped_bytes, 200);
+  EXPECT_EQ(stats.hole_bytes, 800);
+  EXPECT_EQ(stats.target_bytes[0], 90);
+  EXPECT_EQ(stats.target_bytes[1], 110);
+
+  // Range lengths are 10, 10, 80 and 100.
+  EXPECT_EQ(stats.length_histogram[3], 2);
+  EXPECT_EQ(stats.length_histogram[6], 2);
+
+  map->Clear();
+  EXPECT_EQ(map->GetStats().range_count, 0);
+}
+
 } // namespace aff4
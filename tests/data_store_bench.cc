@@ -0,0 +1,90 @@
+/*
+  Measures how MemoryDataStore read throughput scales with the number of
+  concurrent reader threads.
+
+  Build with "make data-store-bench" and run without arguments.
+*/
+
+#include "aff4/libaff4.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace aff4 {
+
+static const size_t SUBJECTS = 100000;
+static const size_t READS_PER_THREAD = 200000;
+
+static void PopulateStore(MemoryDataStore& store, std::vector<URN>& subjects) {
+    URN volume("aff4://ac49ff36-9a1d-4a5c-b4dc-7c6d0f5a2a11");
+
+    for (size_t i = 0; i < SUBJECTS; i++) {
+        URN subject = volume.Append("image/" + std::to_string(i));
+        store.Set(subject, URN(AFF4_TYPE), new URN(AFF4_IMAGE_TYPE));
+        store.Set(subject, URN(AFF4_STREAM_SIZE), new XSDInteger(i));
+        store.Set(subject, URN(AFF4_STORED), new URN(volume));
+        subjects.push_back(subject);
+    }
+}
+
+static void ReadStore(MemoryDataStore& store, const std::vector<URN>& subjects,
+                      unsigned int seed, uint64_t& found) {
+    std::minstd_rand random(seed);
+    URN size_attribute(AFF4_STREAM_SIZE);
+    URN stored_attribute(AFF4_STORED);
+    XSDInteger size;
+    URN stored;
+
+    // Counted locally so the threads do not share cache lines.
+    uint64_t count = 0;
+    for (size_t i = 0; i < READS_PER_THREAD; i++) {
+        const URN& subject = subjects[random() % subjects.size()];
+        if (store.Get(subject, size_attribute, size) == STATUS_OK &&
+            store.Get(subject, stored_attribute, stored) == STATUS_OK) {
+            count++;
+        }
+    }
+
+    found = count;
+}
+
+static void RunBenchmark() {
+    MemoryDataStore store;
+    std::vector<URN> subjects;
+
+    PopulateStore(store, subjects);
+
+    printf("%8s %12s %14s\n", "threads", "seconds", "reads/sec");
+
+    for (size_t thread_count = 1; thread_count <= 64; thread_count *= 2) {
+        std::vector<std::thread> threads;
+        std::vector<uint64_t> found(thread_count);
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < thread_count; i++) {
+            threads.emplace_back(ReadStore, std::ref(store), std::cref(subjects),
+                                 i + 1, std::ref(found[i]));
+        }
+
+        for (auto& thread: threads) {
+            thread.join();
+        }
+
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        // Every read is two Get() calls.
+        double reads = 2.0 * READS_PER_THREAD * thread_count;
+        printf("%8zu %12.3f %14.0f\n", thread_count, elapsed.count(),
+               reads / elapsed.count());
+    }
+}
+
+} // namespace aff4
+
+int main() {
+    aff4::RunBenchmark();
+    return 0;
+}
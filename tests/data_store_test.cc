@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 #include "aff4/libaff4.h"
 #include <iostream>
+#include <atomic>
+#include <thread>
 
 namespace aff4 {
 
@@ -60,4 +62,370 @@ TEST_F(MemoryDataStoreTest, TurtleSerializationTest) {
   EXPECT_STREQ(result.SerializeToString().c_str(), "foo");
 }
 
+
+TEST_F(MemoryDataStoreTest, QueryIndex) {
+  URN type(AFF4_TYPE);
+  store.Set(URN("a"), type, new URN(AFF4_IMAGE_TYPE));
+  store.Set(URN("b"), type, new URN(AFF4_IMAGE_TYPE));
+  store.Set(URN("c"), type, new URN(AFF4_MAP_TYPE));
+  store.Set(URN("c"), type, new URN(AFF4_IMAGE_TYPE), /* replace = */ false);
+
+  URN image_type(AFF4_IMAGE_TYPE);
+  EXPECT_EQ(3, store.Query(type, &image_type).size());
+  EXPECT_EQ(3, store.Query(type).size());
+
+  // Replacing a value removes the old value from the index.
+  store.Set(URN("a"), type, new URN(AFF4_MAP_TYPE));
+  auto results = store.Query(type, &image_type);
+  EXPECT_EQ(2, results.size());
+  EXPECT_EQ(0, results.count(URN("a")));
+
+  URN map_type(AFF4_MAP_TYPE);
+  store.DeleteSubject(URN("c"));
+  results = store.Query(type, &map_type);
+  EXPECT_EQ(1, results.size());
+  EXPECT_EQ(1, results.count(URN("a")));
+
+  // Values set after the predicate was first queried are indexed too.
+  store.Set(URN("d"), type, new URN(AFF4_MAP_TYPE));
+  EXPECT_EQ(2, store.Query(type, &map_type).size());
+
+  // Predicates set before their first query are found.
+  URN stored(AFF4_STORED);
+  store.Set(URN("a"), stored, new URN("volume"));
+  store.Set(URN("b"), stored, new URN("volume"));
+  URN volume("volume");
+  EXPECT_EQ(2, store.Query(stored, &volume).size());
+  EXPECT_EQ(0, store.Query(stored, &map_type).size());
+
+  store.Clear();
+  EXPECT_EQ(0, store.Query(type).size());
+  EXPECT_EQ(0, store.Query(URN("unknown")).size());
+}
+
+
+TEST_F(MemoryDataStoreTest, GetAttributes) {
+  store.Set(URN("hello"), URN("World"), new XSDString("foo"));
+  store.Set(URN("hello"), URN("Other"), new XSDInteger(5));
+  store.Set(URN("bye"), URN("World"), new XSDString("bar"));
+
+  AFF4_Attributes attributes = store.GetAttributes(URN("hello"));
+  EXPECT_EQ(2, attributes.size());
+  EXPECT_EQ("foo", attributes["World"][0]->SerializeToString());
+  EXPECT_EQ("5", attributes["Other"][0]->SerializeToString());
+
+  EXPECT_EQ(0, store.GetAttributes(URN("unknown")).size());
+  EXPECT_FALSE(store.HasURNWithAttribute(URN("bye"), URN("Other")));
+
+  store.DeleteSubject(URN("hello"));
+  EXPECT_FALSE(store.HasURN(URN("hello")));
+  EXPECT_TRUE(store.HasURNWithAttribute(URN("bye"), URN("World")));
+}
+
+
+TEST_F(MemoryDataStoreTest, TypedGet) {
+  store.Set(URN("hello"), URN("size"), new XSDInteger(5));
+  store.Set(URN("hello"), URN("size"), new XSDString("foo"), false);
+  store.Set(URN("hello"), URN("size"), new XSDInteger(7), false);
+  store.Set(URN("hello"), URN("target"), new URN("aff4://target"));
+
+  // The last value of the requested type is returned.
+  XSDInteger integer;
+  EXPECT_EQ(STATUS_OK, store.Get(URN("hello"), URN("size"), integer));
+  EXPECT_EQ(7, integer.value);
+
+  URN target;
+  EXPECT_EQ(STATUS_OK, store.Get(URN("hello"), URN("target"), target));
+  EXPECT_EQ("aff4://target", target.SerializeToString());
+  EXPECT_EQ(NOT_FOUND, store.Get(URN("hello"), URN("size"), target));
+  EXPECT_EQ(NOT_FOUND, store.Get(URN("hello"), URN("target"), integer));
+
+  // Subjects without a type are implied zip segments.
+  URN type;
+  EXPECT_EQ(STATUS_OK, store.Get(URN("hello"), URN(AFF4_TYPE), type));
+  EXPECT_EQ(AFF4_ZIP_SEGMENT_TYPE, type.SerializeToString());
+  EXPECT_EQ(NOT_FOUND, store.Get(URN("unknown"), URN(AFF4_TYPE), type));
+}
+
+
+TEST_F(MemoryDataStoreTest, ConcurrentAccess) {
+  const int kSubjects = 1000;
+  URN size(AFF4_STREAM_SIZE);
+
+  for (int i = 0; i < kSubjects; i++) {
+    store.Set(URN("subject").Append(std::to_string(i)), size,
+              new XSDInteger(i));
+  }
+
+  // Readers must always see a complete value while a writer keeps
+  // replacing them.
+  std::atomic<int> bad_reads(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&]() {
+        XSDInteger value;
+        for (int i = 0; i < kSubjects * 10; i++) {
+          URN subject = URN("subject").Append(std::to_string(i % kSubjects));
+          if (store.Get(subject, size, value) != STATUS_OK ||
+              value.value % kSubjects != i % kSubjects) {
+            bad_reads++;
+          }
+        }
+      });
+  }
+
+  threads.emplace_back([&]() {
+      for (int i = 0; i < kSubjects * 10; i++) {
+        store.Set(URN("subject").Append(std::to_string(i % kSubjects)), size,
+                  new XSDInteger(i));
+      }
+    });
+
+  for (auto& thread: threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(0, bad_reads);
+  EXPECT_EQ(kSubjects, store.Query(size).size());
+}
+
+
+TEST_F(MemoryDataStoreTest, LoadLargeTurtle) {
+  // Enough statements for the turtle to span several load chunks.
+  const int kSubjects = 20000;
+  URN description("http://aff4.org/Schema#description");
+  for (int i = 0; i < kSubjects; i++) {
+    URN subject = URN("aff4://volume").Append(std::to_string(i));
+    store.Set(subject, URN(AFF4_TYPE), new URN(AFF4_IMAGE_TYPE));
+    store.Set(subject, URN(AFF4_STREAM_SIZE), new XSDInteger(i));
+    store.Set(subject, description, new XSDString("append"));
+  }
+
+  std::unique_ptr<AFF4Stream> output = StringIO::NewStringIO();
+  store.DumpToTurtle(*output, "");
+  EXPECT_LT(1024 * 1024, output->Size());
+  output->Seek(0, 0);
+
+  MemoryDataStore new_store;
+  EXPECT_EQ(STATUS_OK, new_store.LoadFromTurtle(*output));
+
+  URN image_type(AFF4_IMAGE_TYPE);
+  EXPECT_EQ(kSubjects, new_store.Query(URN(AFF4_TYPE), &image_type).size());
+
+  XSDInteger size;
+  XSDString mode;
+  URN subject = URN("aff4://volume").Append("12345");
+  EXPECT_EQ(STATUS_OK, new_store.Get(subject, URN(AFF4_STREAM_SIZE), size));
+  EXPECT_EQ(12345, size.value);
+  EXPECT_EQ(STATUS_OK, new_store.Get(subject, description, mode));
+  EXPECT_EQ("append", mode.SerializeToString());
+}
+
+
+TEST_F(MemoryDataStoreTest, TurtleWriterParity) {
+  URN subject("aff4://e5a1b3c2-94a5-4a3e-9c4b-3d7a1e0c8f21/image");
+  store.Set(subject, URN(AFF4_TYPE), new URN(AFF4_IMAGE_TYPE));
+  store.Set(subject, URN(AFF4_TYPE), new URN(AFF4_MAP_TYPE), false);
+  store.Set(subject, URN(AFF4_STREAM_SIZE), new XSDInteger(1234567));
+  store.Set(subject, URN(AFF4_HASH_MD5), new MD5Hash("d41d8cd98f00b204e9800998ecf8427e"));
+  store.Set(subject, URN("http://aff4.org/Schema#flag"), new XSDBoolean(true));
+  store.Set(subject, URN("http://aff4.org/Schema#description"),
+            new XSDString("quote \" backslash \\ newline \n tab \t"));
+
+  // Subjects without a type are not written.
+  URN odd_subject("file:///tmp/a file with spaces>");
+  store.Set(odd_subject, URN(AFF4_TYPE), new URN(AFF4_IMAGE_TYPE));
+  store.Set(odd_subject, URN("http://aff4.org/Schema#disk/odd/predicate"),
+            new URN("aff4://target/with {braces}"));
+
+  // A local name may not start with a digit, so this is written in full.
+  URN digit_predicate("http://aff4.org/Schema#0digit");
+  store.Set(subject, digit_predicate, new XSDString("digit"));
+  EXPECT_EQ(nullptr, digit_predicate.GetDatatype());
+
+  for (bool use_raptor : {false, true}) {
+    store.use_raptor_serializer = use_raptor;
+    std::unique_ptr<AFF4Stream> output = StringIO::NewStringIO();
+    EXPECT_EQ(STATUS_OK, store.DumpToTurtle(*output, ""));
+    output->Seek(0, 0);
+    if (!use_raptor) {
+      EXPECT_NE(std::string::npos,
+                output->Read(output->Size()).find(
+                    "<http://aff4.org/Schema#0digit>"));
+      output->Seek(0, 0);
+    }
+
+    MemoryDataStore new_store;
+    EXPECT_EQ(STATUS_OK, new_store.LoadFromTurtle(*output));
+
+    for (const URN& urn: {subject, odd_subject}) {
+      AFF4_Attributes expected = store.GetAttributes(urn);
+      AFF4_Attributes loaded = new_store.GetAttributes(urn);
+      EXPECT_EQ(expected.size(), loaded.size());
+
+      for (const auto& it: expected) {
+        ASSERT_EQ(it.second.size(), loaded[it.first].size()) << it.first;
+        for (size_t i = 0; i < it.second.size(); i++) {
+          const RDFValue& expected_value = *it.second[i];
+          const RDFValue& loaded_value = *loaded[it.first][i];
+          EXPECT_TRUE(typeid(expected_value) == typeid(loaded_value));
+          EXPECT_EQ(expected_value.SerializeToString(),
+                    loaded_value.SerializeToString());
+        }
+      }
+    }
+  }
+}
+
+
+TEST_F(MemoryDataStoreTest, DumpChanges) {
+  URN description("http://aff4.org/Schema#description");
+  URN first("aff4://volume/first");
+  URN second("aff4://volume/second");
+  store.Set(first, URN(AFF4_TYPE), new URN(AFF4_IMAGE_TYPE));
+  store.Set(first, description, new XSDString("one"));
+
+  MemoryDataStore new_store;
+  {
+    std::unique_ptr<AFF4Stream> output = StringIO::NewStringIO();
+    EXPECT_EQ(STATUS_OK, store.DumpToTurtle(*output, ""));
+    output->Seek(0, 0);
+    EXPECT_EQ(STATUS_OK, new_store.LoadFromTurtle(*output));
+  }
+
+  store.track_changes = true;
+  uint64_t since = store.Generation();
+
+  store.Set(first, description, new XSDString("two"));
+  store.Set(first, description, new XSDString("three"), false);
+  store.Set(second, URN(AFF4_TYPE), new URN(AFF4_IMAGE_TYPE));
+  EXPECT_LT(since, store.Generation());
+
+  std::unique_ptr<AFF4Stream> delta = StringIO::NewStringIO();
+  EXPECT_EQ(STATUS_OK, store.DumpChangesToTurtle(*delta, "", since));
+  delta->Seek(0, 0);
+  EXPECT_EQ(STATUS_OK, new_store.MergeFromTurtle(*delta));
+
+  // The delta replaces all the old values of a changed pair.
+  AFF4_Attributes attributes = new_store.GetAttributes(first);
+  ASSERT_EQ(2, attributes[description.SerializeToString()].size());
+  EXPECT_EQ("two",
+            attributes[description.SerializeToString()][0]->SerializeToString());
+  EXPECT_EQ("three",
+            attributes[description.SerializeToString()][1]->SerializeToString());
+  EXPECT_EQ(1, attributes[AFF4_TYPE].size());
+  EXPECT_TRUE(new_store.HasURN(second));
+
+  // Nothing changed since the delta was taken.
+  since = store.Generation();
+  std::unique_ptr<AFF4Stream> empty = StringIO::NewStringIO();
+  EXPECT_EQ(STATUS_OK, store.DumpChangesToTurtle(*empty, "", since));
+  empty->Seek(0, 0);
+  MemoryDataStore empty_store;
+  EXPECT_EQ(STATUS_OK, empty_store.LoadFromTurtle(*empty));
+  EXPECT_FALSE(empty_store.HasURN(first));
+
+  // Deletions can not be expressed as a delta.
+  store.DeleteSubject(second);
+  EXPECT_EQ(NOT_IMPLEMENTED, store.DumpChangesToTurtle(*empty, "", since));
+}
+
+
+TEST_F(MemoryDataStoreTest, SetBatch) {
+  URN subject("aff4://volume/file");
+  store.Set(subject, URN(AFF4_STREAM_SIZE), new XSDInteger((uint64_t)1));
+
+  StatementBatch batch;
+  batch.reserve(3);
+  batch.Add(subject, AFF4_TYPE, std::make_shared<URN>(AFF4_IMAGE_TYPE));
+  batch.Add(subject, AFF4_TYPE, std::make_shared<URN>(AFF4_MAP_TYPE),
+            /* replace = */ false);
+  batch.Add(subject, AFF4_STREAM_SIZE,
+            std::make_shared<XSDInteger>((uint64_t)1234));
+
+  store.SetBatch(batch);
+  EXPECT_TRUE(batch.empty());
+
+  // Statements are applied in order with the same semantics as Set().
+  URN image_type(AFF4_IMAGE_TYPE);
+  URN map_type(AFF4_MAP_TYPE);
+  EXPECT_TRUE(store.HasURNWithAttributeAndValue(subject, AFF4_TYPE, image_type));
+  EXPECT_TRUE(store.HasURNWithAttributeAndValue(subject, AFF4_TYPE, map_type));
+
+  XSDInteger size;
+  EXPECT_EQ(STATUS_OK, store.Get(subject, URN(AFF4_STREAM_SIZE), size));
+  EXPECT_EQ(1234, size.value);
+  EXPECT_EQ(1, store.GetAttributes(subject)[AFF4_STREAM_SIZE].size());
+}
+
+
+TEST_F(MemoryDataStoreTest, ValueArena) {
+  URN subject("aff4://volume/file");
+  store.Set(subject, AFF4_STREAM_SIZE, store.MakeValue<XSDInteger>((uint64_t)1));
+  ValueArena* arena = store.Arena();
+  size_t chunk_bytes = arena->ChunkBytes();
+  EXPECT_LT(0, chunk_bytes);
+
+  // Replaced values are recycled rather than growing the arena.
+  for (uint64_t i = 0; i < 100000; i++) {
+    store.Set(subject, AFF4_STREAM_SIZE, store.MakeValue<XSDInteger>(i));
+  }
+  EXPECT_EQ(chunk_bytes, arena->ChunkBytes());
+
+  // Values outlive the store's arena.
+  std::vector<std::shared_ptr<RDFValue>> values;
+  EXPECT_EQ(STATUS_OK, store.Get(subject, AFF4_STREAM_SIZE, values));
+  store.Clear();
+  EXPECT_NE(arena, store.Arena());
+
+  ASSERT_EQ(1, values.size());
+  EXPECT_EQ("99999", values[0]->SerializeToString());
+}
+
+
+TEST_F(MemoryDataStoreTest, MakeValueWhileClearing) {
+  URN subject("aff4://volume/file");
+
+  // Values may be made while another thread replaces the arena.
+  std::atomic<bool> done(false);
+  std::thread clearer([&]() {
+      while (!done) {
+        store.Clear();
+      }
+    });
+
+  for (uint64_t i = 0; i < 100000; i++) {
+    std::shared_ptr<XSDInteger> value = store.MakeValue<XSDInteger>(i);
+    EXPECT_EQ(i, value->value);
+  }
+
+  done = true;
+  clearer.join();
+  EXPECT_TRUE(store.Arena() != nullptr);
+}
+
+TEST_F(MemoryDataStoreTest, SelectSubjectsByPrefix) {
+  URN image("aff4://volume/image");
+  for (const char* child: {"", "/0000", "/0001", "/0001/index", "data"}) {
+    store.Set(URN(image.value + child), AFF4_TYPE, new URN(AFF4_IMAGE_TYPE));
+  }
+  store.Set(URN("aff4://volume/imagf"), AFF4_TYPE, new URN(AFF4_IMAGE_TYPE));
+  store.Set(URN("aff4://volume"), AFF4_TYPE, new URN(AFF4_ZIP_TYPE));
+
+  std::vector<URN> children = store.SelectSubjectsByPrefix(
+      image.Append("0001"));
+  ASSERT_EQ(2, children.size());
+  EXPECT_EQ(image.value + "/0001", children[0].value);
+  EXPECT_EQ(image.value + "/0001/index", children[1].value);
+
+  EXPECT_EQ(5, store.SelectSubjectsByPrefix(image).size());
+
+  store.DeleteSubject(image.Append("0000"));
+  children = store.SelectSubjectsByPrefix(URN(image.value + "/"));
+  ASSERT_EQ(2, children.size());
+  EXPECT_EQ(image.value + "/0001", children[0].value);
+
+  EXPECT_EQ(0, store.SelectSubjectsByPrefix(URN("aff4://other")).size());
+}
+
 } // namespace aff4
@@ -0,0 +1,346 @@
+#include <gtest/gtest.h>
+#include "aff4/libaff4.h"
+#include "aff4/aff4_http.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include "utils.h"
+
+namespace aff4 {
+
+
+// A minimal HTTP server on the loopback interface which serves ranges
+// of a string, like an object store would.
+class RangeServer {
+ public:
+  explicit RangeServer(const std::string& content): content(content) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    EXPECT_EQ(0, bind(fd, (struct sockaddr*)&address, sizeof(address)));
+    EXPECT_EQ(0, listen(fd, 64));
+
+    socklen_t length = sizeof(address);
+    getsockname(fd, (struct sockaddr*)&address, &length);
+    port = ntohs(address.sin_port);
+
+    server = std::thread(&RangeServer::Serve, this);
+  }
+
+  ~RangeServer() {
+    shutdown(fd, SHUT_RDWR);
+    server.join();
+    close(fd);
+  }
+
+  std::string url(const std::string& path) const {
+    return aff4_sprintf("http://127.0.0.1:%d%s", port, path.c_str());
+  }
+
+  // The number of requests served.
+  std::atomic<int> requests{0};
+
+  // Fail this many of the following requests.
+  std::atomic<int> failures{0};
+
+  // Behave like servers which do not support ranges, or which send
+  // chunked responses.
+  bool ignore_ranges = false;
+  bool chunked = false;
+
+ private:
+  void Serve() {
+    while (true) {
+      int connection = accept(fd, nullptr, nullptr);
+      if (connection < 0) {
+        return;
+      }
+
+      Respond(connection);
+      close(connection);
+    }
+  }
+
+  void Respond(int connection) {
+    std::string request;
+    char buffer[4096];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+      ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+      if (received <= 0) {
+        return;
+      }
+      request.append(buffer, received);
+    }
+
+    requests++;
+
+    if (failures > 0) {
+      failures--;
+      Send(connection, "HTTP/1.1 500 Internal Server Error\r\n"
+           "Content-Length: 0\r\n\r\n");
+      return;
+    }
+
+    if (ignore_ranges) {
+      Send(connection, aff4_sprintf(
+          "HTTP/1.1 200 OK\r\n"
+          "Content-Length: %lld\r\n\r\n", (long long)content.size()) +
+           content);
+      return;
+    }
+
+    long long start = 0;
+    long long end = 0;
+    const size_t range = request.find("Range: bytes=");
+    ASSERT_NE(range, std::string::npos);
+    sscanf(request.c_str() + range, "Range: bytes=%lld-%lld", &start, &end);
+
+    if (start >= (long long)content.size()) {
+      Send(connection, aff4_sprintf(
+          "HTTP/1.1 416 Range Not Satisfiable\r\n"
+          "Content-Range: bytes */%lld\r\n"
+          "Content-Length: 0\r\n\r\n", (long long)content.size()));
+      return;
+    }
+
+    end = std::min(end, (long long)content.size() - 1);
+    if (chunked) {
+      Send(connection, aff4_sprintf(
+          "HTTP/1.1 206 Partial Content\r\n"
+          "Content-Range: bytes %lld-%lld/%lld\r\n"
+          "Transfer-Encoding: chunked\r\n\r\n"
+          "%llx\r\n", start, end, (long long)content.size(),
+          end - start + 1) + content.substr(start, end - start + 1) +
+           "\r\n0\r\n\r\n");
+      return;
+    }
+
+    Send(connection, aff4_sprintf(
+        "HTTP/1.1 206 Partial Content\r\n"
+        "Content-Range: bytes %lld-%lld/%lld\r\n"
+        "Content-Length: %lld\r\n\r\n",
+        start, end, (long long)content.size(), end - start + 1) +
+         content.substr(start, end - start + 1));
+  }
+
+  void Send(int connection, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+      ssize_t res = send(connection, data.data() + sent, data.size() - sent,
+                         MSG_NOSIGNAL);
+      if (res <= 0) {
+        return;
+      }
+      sent += res;
+    }
+  }
+
+  std::string content;
+  int fd;
+  int port = 0;
+  std::thread server;
+};
+
+
+class HTTPStreamTest: public ::testing::Test {
+ protected:
+  std::string filename = "/tmp/aff4_http_test.zip";
+
+  virtual void TearDown() {
+    unlink(filename.c_str());
+  }
+
+  static std::string TestData(size_t length) {
+    std::string data;
+    for (size_t i = 0; data.size() < length; i++) {
+      data += aff4_sprintf("%08llx", (unsigned long long)i * 7919);
+    }
+    data.resize(length);
+    return data;
+  }
+};
+
+
+TEST_F(HTTPStreamTest, ReadRanges) {
+  MemoryDataStore resolver;
+  const std::string content = TestData(1024 * 1024 + 123);
+  RangeServer server(content);
+
+  AFF4Flusher<AFF4Stream> stream;
+  EXPECT_OK(HTTPStream::NewHTTPStream(
+      &resolver, server.url("/bucket/object"), stream));
+  EXPECT_EQ(stream->Size(), content.size());
+
+  HTTPStream* http = dynamic_cast<HTTPStream*>(stream.get());
+  http->block_size = 64 * 1024;
+  http->cache_block_limit = 32;
+
+  // Reads within and across blocks, and past the end.
+  const aff4_off_t offsets[] = {0, 65530, 500000, 1024 * 1024 + 100, 12345};
+  for (aff4_off_t offset : offsets) {
+    stream->Seek(offset, SEEK_SET);
+    EXPECT_EQ(stream->Read(100), content.substr(offset, 100));
+  }
+
+  // Cached blocks are not fetched again.
+  const int requests = server.requests;
+  stream->Seek(500010, SEEK_SET);
+  EXPECT_EQ(stream->Read(10), content.substr(500010, 10));
+  EXPECT_EQ(server.requests, requests);
+
+  // ReadV fetches the blocks it needs together.
+  std::string first(200000, 0);
+  std::string second(10, 0);
+  std::vector<AFF4ReadRequest> read_requests;
+  read_requests.emplace_back(300000, &first[0], first.size());
+  read_requests.emplace_back(1024 * 1024 + 120, &second[0], second.size());
+  EXPECT_OK(stream->ReadV(read_requests));
+
+  EXPECT_EQ(first, content.substr(300000, first.size()));
+  EXPECT_EQ(read_requests[1].result_length, 3);
+  EXPECT_EQ(second.substr(0, 3), content.substr(1024 * 1024 + 120));
+}
+
+
+TEST_F(HTTPStreamTest, SequentialPrefetch) {
+  MemoryDataStore resolver;
+  const std::string content = TestData(512 * 1024);
+  RangeServer server(content);
+
+  AFF4Flusher<AFF4Stream> stream;
+  EXPECT_OK(HTTPStream::NewHTTPStream(&resolver, server.url("/"), stream));
+
+  HTTPStream* http = dynamic_cast<HTTPStream*>(stream.get());
+  http->block_size = 16 * 1024;
+  http->prefetch_blocks = 4;
+  EXPECT_OK(stream->SetAccessPattern(AFF4_ACCESS_SEQUENTIAL));
+
+  std::string data;
+  while (true) {
+    std::string chunk = stream->Read(10000);
+    if (chunk.empty()) {
+      break;
+    }
+    data += chunk;
+  }
+
+  EXPECT_EQ(data, content);
+
+  // Every block was fetched exactly once, mostly ahead of the reader.
+  EXPECT_EQ(http->cache_misses, content.size() / http->block_size);
+  EXPECT_GT(http->cache_hits, http->cache_misses);
+}
+
+
+TEST_F(HTTPStreamTest, Retries) {
+  MemoryDataStore resolver;
+  const std::string content = TestData(1000);
+  RangeServer server(content);
+
+  AFF4Flusher<AFF4Stream> stream;
+  EXPECT_OK(HTTPStream::NewHTTPStream(&resolver, server.url("/"), stream));
+
+  HTTPStream* http = dynamic_cast<HTTPStream*>(stream.get());
+  http->block_size = 100;
+
+  server.failures = 2;
+  EXPECT_EQ(stream->Read(100), content.substr(0, 100));
+
+  // Once the retries are used up the read fails.
+  http->max_retries = 1;
+  server.failures = 2;
+  stream->Seek(500, SEEK_SET);
+  EXPECT_EQ(stream->Read(100), "");
+
+  // The failed block is fetched again on the next read.
+  stream->Seek(500, SEEK_SET);
+  EXPECT_EQ(stream->Read(100), content.substr(500, 100));
+}
+
+
+TEST_F(HTTPStreamTest, IgnoredRanges) {
+  MemoryDataStore resolver;
+  const std::string content = TestData(100000);
+  RangeServer server(content);
+  server.ignore_ranges = true;
+
+  AFF4Flusher<AFF4Stream> stream;
+  EXPECT_OK(HTTPStream::NewHTTPStream(&resolver, server.url("/"), stream));
+  EXPECT_EQ(stream->Size(), content.size());
+
+  HTTPStream* http = dynamic_cast<HTTPStream*>(stream.get());
+  http->block_size = 1000;
+  http->max_retries = 0;
+
+  // The start of the file can be used, but later blocks would need the
+  // whole file before them.
+  EXPECT_EQ(stream->Read(100), content.substr(0, 100));
+
+  stream->Seek(50000, SEEK_SET);
+  EXPECT_EQ(stream->Read(100), "");
+}
+
+
+TEST_F(HTTPStreamTest, ChunkedResponse) {
+  MemoryDataStore resolver;
+  RangeServer server(TestData(1000));
+  server.chunked = true;
+
+  AFF4Flusher<AFF4Stream> stream;
+  EXPECT_EQ(HTTPStream::NewHTTPStream(&resolver, server.url("/"), stream),
+            PARSING_ERROR);
+}
+
+
+TEST_F(HTTPStreamTest, OpenVolume) {
+  std::string volume_data;
+  URN image_urn;
+
+  {
+    MemoryDataStore resolver;
+    AFF4Flusher<AFF4Stream> file;
+    AFF4Flusher<ZipFile> zip;
+    EXPECT_OK(NewFileBackedObject(&resolver, filename, "truncate", file));
+    EXPECT_OK(ZipFile::NewZipFile(&resolver, std::move(file), zip));
+
+    image_urn = zip->urn.Append("image.dd");
+
+    AFF4Flusher<AFF4Image> image;
+    EXPECT_OK(AFF4Image::NewAFF4Image(
+        &resolver, image_urn, zip.get(), image));
+    image->chunk_size = 1000;
+    image->chunks_per_segment = 10;
+    image->Write(TestData(100000));
+  }
+
+  {
+    MemoryDataStore resolver;
+    AFF4Flusher<AFF4Stream> file;
+    EXPECT_OK(NewFileBackedObject(&resolver, filename, "read", file));
+    volume_data = file->Read(file->Size());
+  }
+
+  RangeServer server(volume_data);
+  MemoryDataStore resolver;
+
+  AFF4Flusher<AFF4Stream> stream;
+  EXPECT_OK(HTTPStream::NewHTTPStream(
+      &resolver, server.url("/evidence/volume.aff4"), stream));
+
+  AFF4Flusher<AFF4Volume> zip;
+  EXPECT_OK(ZipFile::OpenZipFile(&resolver, std::move(stream), zip));
+
+  VolumeGroup volumes(&resolver);
+  volumes.AddVolume(std::move(zip));
+
+  AFF4Flusher<AFF4Image> image;
+  EXPECT_OK(AFF4Image::OpenAFF4Image(&resolver, image_urn, &volumes, image));
+  EXPECT_EQ(image->Read(200000), TestData(100000));
+}
+
+} // namespace aff4
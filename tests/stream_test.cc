@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 #include "aff4/libaff4.h"
 #include <unistd.h>
+#include <sys/stat.h>
+#include <set>
 
 namespace aff4 {
 
@@ -57,6 +59,50 @@ class StreamTest : public ::testing::Test {
 
   };
 
+  void test_AsyncStream(AFF4Stream &stream) {
+    std::string data(100000, 0);
+    for (size_t i = 0; i < data.size(); i++) {
+      data[i] = i % 251;
+    }
+
+    // Write in pieces, last piece first.
+    const size_t piece = 10000;
+    for (size_t i = 0; i < 10; i++) {
+      size_t offset = (9 - i) * piece;
+      EXPECT_EQ(STATUS_OK, stream.SubmitWrite(
+          offset, data.data() + offset, piece, i));
+    }
+
+    AFF4Completion completion;
+    std::set<uint64_t> tags;
+    while (stream.WaitForCompletion(completion) == STATUS_OK) {
+      EXPECT_EQ(STATUS_OK, completion.status);
+      EXPECT_EQ(piece, completion.length);
+      tags.insert(completion.tag);
+    }
+    EXPECT_EQ(10, tags.size());
+    EXPECT_EQ(0, stream.Tell());
+
+    // Read back, including a read past the end.
+    std::vector<std::string> buffers(11, std::string(piece, 0));
+    for (size_t i = 0; i < buffers.size(); i++) {
+      EXPECT_EQ(STATUS_OK, stream.SubmitRead(
+          i * piece, &buffers[i][0], piece, i));
+    }
+
+    while (stream.WaitForCompletion(completion) == STATUS_OK) {
+      EXPECT_EQ(STATUS_OK, completion.status);
+      if (completion.tag == 10) {
+        EXPECT_EQ(0, completion.length);
+      } else {
+        EXPECT_EQ(piece, completion.length);
+        EXPECT_EQ(data.substr(completion.tag * piece, piece),
+                  buffers[completion.tag]);
+      }
+    }
+
+    EXPECT_EQ(data, stream.Read(data.size() + 1));
+  }
 };
 
 TEST_F(StreamTest, StringIOTest) {
@@ -65,6 +111,11 @@ TEST_F(StreamTest, StringIOTest) {
   test_Stream(*stream);
 }
 
+TEST_F(StreamTest, StringIOAsyncTest) {
+  std::unique_ptr<AFF4Stream> stream = StringIO::NewStringIO();
+  test_AsyncStream(*stream);
+}
+
 class FileBackedStreamTest: public StreamTest {
  protected:
         std::string filename = "/tmp/test_filename.bin";
@@ -83,5 +134,205 @@ TEST_F(FileBackedStreamTest, FileBackedObjectIOTest) {
   test_Stream(*file);
 }
 
+TEST_F(FileBackedStreamTest, AsyncIOTest) {
+  MemoryDataStore resolver;
+  AFF4Flusher<FileBackedObject> file;
+  EXPECT_EQ(NewFileBackedObject(&resolver, filename,
+                                "truncate", file), STATUS_OK);
+  test_AsyncStream(*file);
+}
+
+TEST_F(FileBackedStreamTest, DirectIOTest) {
+  MemoryDataStore resolver;
+  std::string data(3 * 4096 + 123, 0);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = i % 251;
+  }
+
+  {
+    AFF4Flusher<FileBackedObject> file;
+    EXPECT_EQ(NewFileBackedObject(&resolver, filename,
+                                  "truncate", file), STATUS_OK);
+    EXPECT_EQ(STATUS_OK, file->Write(data.data(), data.size()));
+  }
+
+  AFF4Flusher<FileBackedObject> file;
+  EXPECT_EQ(NewFileBackedObject(&resolver, filename,
+                                "direct", file), STATUS_OK);
+  EXPECT_FALSE(file->properties.writable);
+
+  // Unaligned reads, including one crossing the end of the file.
+  file->Seek(100, SEEK_SET);
+  EXPECT_EQ(data.substr(100, 5000), file->Read(5000));
+  EXPECT_EQ(data.substr(5100), file->Read(10000));
+  EXPECT_EQ("", file->Read(10));
+
+  // An aligned read into an aligned buffer.
+  AlignedBuffer buffer(2 * 4096, 4096);
+  size_t length = buffer.size();
+  file->Seek(4096, SEEK_SET);
+  EXPECT_EQ(STATUS_OK, file->ReadBuffer(buffer.data(), &length));
+  EXPECT_EQ(data.substr(4096, 2 * 4096), std::string(buffer.data(), length));
+
+  // The tail of the file.
+  length = buffer.size();
+  file->Seek(3 * 4096, SEEK_SET);
+  EXPECT_EQ(STATUS_OK, file->ReadBuffer(buffer.data(), &length));
+  EXPECT_EQ(data.substr(3 * 4096), std::string(buffer.data(), length));
+}
+
+TEST_F(FileBackedStreamTest, ReadCacheTest) {
+  MemoryDataStore resolver;
+  AFF4Flusher<FileBackedObject> file;
+  EXPECT_EQ(NewFileBackedObject(&resolver, filename,
+                                "truncate", file), STATUS_OK);
+  file->cache_block_size = 100;
+  file->cache_block_limit = 6;
+
+  std::string data(1000, 0);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = i % 251;
+  }
+  EXPECT_EQ(STATUS_OK, file->Write(data.data(), data.size()));
+
+  // A read straddling two blocks is served from the cache.
+  file->Seek(90, SEEK_SET);
+  EXPECT_EQ(data.substr(90, 20), file->Read(20));
+  EXPECT_EQ(2, file->cache_misses);
+
+  file->Seek(95, SEEK_SET);
+  EXPECT_EQ(data.substr(95, 10), file->Read(10));
+  EXPECT_EQ(2, file->cache_hits);
+  EXPECT_EQ(2, file->cache_misses);
+
+  // Writes invalidate the cached blocks they cover.
+  file->Seek(98, SEEK_SET);
+  EXPECT_EQ(STATUS_OK, file->Write("XXXX", 4));
+  data.replace(98, 4, "XXXX");
+  file->Seek(90, SEEK_SET);
+  EXPECT_EQ(data.substr(90, 20), file->Read(20));
+
+  // A sequential scan does not evict the blocks in use before it.
+  file->Seek(200, SEEK_SET);
+  for (int i = 0; i < 8; i++) {
+    EXPECT_EQ(data.substr(200 + i * 99, 99), file->Read(99));
+  }
+
+  const uint64_t misses = file->cache_misses;
+  file->Seek(90, SEEK_SET);
+  EXPECT_EQ(data.substr(90, 20), file->Read(20));
+  EXPECT_EQ(misses, file->cache_misses);
+
+  // Reads past the end of the file.
+  file->Seek(990, SEEK_SET);
+  EXPECT_EQ(data.substr(990), file->Read(50));
+  EXPECT_EQ("", file->Read(50));
+}
+
+TEST_F(FileBackedStreamTest, AccessHintsTest) {
+  MemoryDataStore resolver;
+  AFF4Flusher<FileBackedObject> file;
+  EXPECT_EQ(NewFileBackedObject(&resolver, filename,
+                                "truncate", file), STATUS_OK);
+  EXPECT_EQ(STATUS_OK, file->Write("hello world", 11));
+
+  EXPECT_EQ(AFF4_ACCESS_NORMAL, file->properties.access_pattern);
+  EXPECT_EQ(STATUS_OK, file->SetAccessPattern(AFF4_ACCESS_RANDOM));
+  EXPECT_EQ(AFF4_ACCESS_RANDOM, file->properties.access_pattern);
+
+  file->Seek(0, SEEK_SET);
+  EXPECT_EQ("hello", file->Read(5));
+  EXPECT_EQ(1, file->cache_misses);
+
+  // Dropped data is read again from the file.
+  EXPECT_EQ(STATUS_OK, file->DropCachedData(0, 0));
+  file->Seek(6, SEEK_SET);
+  EXPECT_EQ("world", file->Read(5));
+  EXPECT_EQ(2, file->cache_misses);
+}
+
+TEST_F(FileBackedStreamTest, PreallocateTest) {
+  MemoryDataStore resolver;
+  AFF4Flusher<FileBackedObject> file;
+  EXPECT_EQ(NewFileBackedObject(&resolver, filename,
+                                "truncate", file), STATUS_OK);
+  file->preallocate = true;
+  file->preallocation_increment = 1024 * 1024;
+  EXPECT_EQ(STATUS_OK, file->Write("hello world", 11));
+
+  // Preallocation does not change the size of the file.
+  EXPECT_EQ(11, file->Size());
+  EXPECT_EQ(STATUS_OK, file->Seek(0, SEEK_END));
+  EXPECT_EQ(11, file->Tell());
+
+  struct stat st;
+#ifdef HAVE_FALLOCATE
+  EXPECT_EQ(0, stat(filename.c_str(), &st));
+  EXPECT_EQ(11, st.st_size);
+  EXPECT_LE(1024 * 1024, st.st_blocks * 512);
+#endif
+
+  EXPECT_EQ(STATUS_OK, file->TrimToSize());
+  EXPECT_EQ(0, stat(filename.c_str(), &st));
+  EXPECT_EQ(11, st.st_size);
+  EXPECT_GT(1024 * 1024, st.st_blocks * 512);
+
+  file->Seek(0, SEEK_SET);
+  EXPECT_EQ("hello world", file->Read(100));
+}
+
+TEST_F(FileBackedStreamTest, QueuedWriterTest) {
+  MemoryDataStore resolver;
+  AFF4Flusher<AFF4Stream> file;
+  EXPECT_EQ(NewFileBackedObject(&resolver, filename,
+                                "truncate", file), STATUS_OK);
+
+  AFF4Flusher<AFF4Stream> writer;
+  EXPECT_EQ(STATUS_OK, AFF4QueuedWriter::NewAFF4QueuedWriter(
+      &resolver, std::move(file), 1000, writer));
+  test_Stream(*writer);
+
+  // Writes larger than the queue and many small writes.
+  EXPECT_EQ(STATUS_OK, writer->Truncate());
+  std::string data(5000, 'x');
+  EXPECT_EQ(STATUS_OK, writer->Write(data));
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(STATUS_OK, writer->Write("0123456789"));
+    data += "0123456789";
+  }
+  EXPECT_EQ(STATUS_OK, writer->Flush());
+  EXPECT_EQ(0, writer->QueuedBytes());
+  EXPECT_EQ(data.size(), writer->Size());
+
+  writer.reset();
+
+  AFF4Flusher<FileBackedObject> result;
+  EXPECT_EQ(NewFileBackedObject(&resolver, filename,
+                                "read", result), STATUS_OK);
+  EXPECT_EQ(data, result->Read(data.size() + 1));
+}
+
+TEST_F(FileBackedStreamTest, QueuedWriterErrorTest) {
+  MemoryDataStore resolver;
+  {
+    AFF4Flusher<FileBackedObject> file;
+    EXPECT_EQ(NewFileBackedObject(&resolver, filename,
+                                  "truncate", file), STATUS_OK);
+  }
+
+  // The file is read only so writing to it fails.
+  AFF4Flusher<AFF4Stream> file;
+  EXPECT_EQ(NewFileBackedObject(&resolver, filename,
+                                "read", file), STATUS_OK);
+
+  AFF4Flusher<AFF4Stream> writer;
+  EXPECT_EQ(STATUS_OK, AFF4QueuedWriter::NewAFF4QueuedWriter(
+      &resolver, std::move(file), 1000, writer));
+
+  EXPECT_EQ(STATUS_OK, writer->Write("hello"));
+  EXPECT_EQ(IO_ERROR, writer->Flush());
+  EXPECT_EQ(IO_ERROR, writer->Write("hello"));
+}
+
 
 } // namespace aff4
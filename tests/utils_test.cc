@@ -1,6 +1,9 @@
 #include <gtest/gtest.h>
 #include "aff4/libaff4.h"
 #include <unistd.h>
+#include <cstring>
+#include <set>
+#include <vector>
 #include "utils.h"
 
 namespace aff4 {
@@ -16,4 +19,137 @@ TEST_F(AFF4UtilsTest, PathSplit) {
 }
 
 
+static std::string HexSHA256(const std::string& data) {
+  std::string digest = SHA256Digest(data.data(), data.size());
+  std::string result;
+  for (char ch : digest) {
+    result += aff4_sprintf("%02x", ch & 0xff);
+  }
+  return result;
+}
+
+// Test vectors from FIPS 180-4 and the NIST examples.
+TEST_F(AFF4UtilsTest, SHA256) {
+  EXPECT_EQ(HexSHA256(""),
+            "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  EXPECT_EQ(HexSHA256("abc"),
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  EXPECT_EQ(HexSHA256(
+                "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+            "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  EXPECT_EQ(HexSHA256(
+                "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+                "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu"),
+            "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1");
+
+  // 55 bytes leave room for the length in the last block, 56 do not.
+  EXPECT_EQ(HexSHA256(std::string(55, 'a')),
+            "9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318");
+  EXPECT_EQ(HexSHA256(std::string(56, 'a')),
+            "b35439a4ac6f0948b6d6f9e3c6af0f5f590ce20f1bde7090ef7970686ec6738a");
+  EXPECT_EQ(HexSHA256(std::string(64, 'a')),
+            "ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb");
+  EXPECT_EQ(HexSHA256(std::string(1000000, 'a')),
+            "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+
+TEST_F(AFF4UtilsTest, BufferPool) {
+  auto pool = BufferPool::NewBufferPool(64 * 1024, 2);
+  EXPECT_EQ(pool->buffer_size(), 64 * 1024);
+
+  // Released buffers are handed out again.
+  char* first;
+  {
+    PooledBuffer buffer = pool->Acquire();
+    ASSERT_TRUE(static_cast<bool>(buffer));
+    EXPECT_EQ(buffer.size(), 64 * 1024);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(buffer.data()) % 4096, 0);
+    first = buffer.data();
+  }
+
+  for (int i = 0; i < 10; i++) {
+    PooledBuffer buffer = pool->Acquire();
+    EXPECT_EQ(buffer.data(), first);
+  }
+  EXPECT_EQ(pool->allocations(), 1);
+
+  // Only max_free buffers are kept.
+  {
+    std::vector<PooledBuffer> buffers;
+    for (int i = 0; i < 4; i++) {
+      buffers.push_back(pool->Acquire());
+    }
+    EXPECT_EQ(pool->allocations(), 4);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    PooledBuffer a = pool->Acquire();
+    PooledBuffer b = pool->Acquire();
+  }
+  EXPECT_EQ(pool->allocations(), 4);
+
+  // Handles keep the pool alive.
+  PooledBuffer buffer = pool->Acquire();
+  pool.reset();
+  std::memset(buffer.data(), 1, buffer.size());
+}
+
+
+TEST_F(AFF4UtilsTest, BufferPoolHugePages) {
+  // Uses huge pages if any are reserved, otherwise falls back to
+  // ordinary memory.
+  auto pool = BufferPool::NewBufferPool(1024 * 1024, 4, true);
+
+  PooledBuffer buffer = pool->Acquire();
+  ASSERT_TRUE(static_cast<bool>(buffer));
+  EXPECT_EQ(buffer.size(), 1024 * 1024);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(buffer.data()) % (2 * 1024 * 1024), 0);
+  std::memset(buffer.data(), 1, buffer.size());
+}
+
+
+
+TEST_F(AFF4UtilsTest, BufferPoolHugePageMemory) {
+  // Small buffers share huge pages instead of each taking 2 MiB. This
+  // is the image writer's default: 32 KiB chunks, 1040 buffers live.
+  const size_t buffer_size = 32 * 1024;
+  const size_t count = 1040;
+  auto pool = BufferPool::NewBufferPool(buffer_size, count, true);
+
+  std::vector<PooledBuffer> buffers;
+  std::set<char*> seen;
+  for (size_t i = 0; i < count; i++) {
+    buffers.push_back(pool->Acquire());
+    ASSERT_TRUE(static_cast<bool>(buffers.back()));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(buffers.back().data()) % 4096, 0);
+    seen.insert(buffers.back().data());
+    std::memset(buffers.back().data(), (int)i, buffer_size);
+  }
+  EXPECT_EQ(seen.size(), count);
+
+  const size_t slab = 2 * 1024 * 1024;
+  EXPECT_LE(pool->allocated_bytes(), count * buffer_size + slab);
+
+  // The buffers do not overlap.
+  for (size_t i = 0; i < count; i++) {
+    EXPECT_EQ(buffers[i].data()[0], (char)i);
+    EXPECT_EQ(buffers[i].data()[buffer_size - 1], (char)i);
+  }
+
+  // Released buffers are reused rather than growing the pool.
+  const size_t allocated = pool->allocated_bytes();
+  buffers.clear();
+  for (size_t i = 0; i < count; i++) {
+    buffers.push_back(pool->Acquire());
+  }
+  EXPECT_EQ(pool->allocated_bytes(), allocated);
+
+  // Ordinary pools hold exactly their buffers.
+  auto plain = BufferPool::NewBufferPool(buffer_size, 4);
+  PooledBuffer a = plain->Acquire();
+  PooledBuffer b = plain->Acquire();
+  EXPECT_EQ(plain->allocated_bytes(), 2 * buffer_size);
+}
+
 }  // namespace aff4
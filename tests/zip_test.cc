@@ -202,4 +202,159 @@ TEST_F(ZipTest, ConcatenatedVolumes) {
 }
 
 
+/**
+ * Test that metadata changes are appended as delta members when the resolver
+ * tracks changes, and that they are merged back when the volume is opened.
+ */
+TEST_F(ZipTest, IncrementalMetadata) {
+  URN description("http://aff4.org/Schema#description");
+
+  for (int i = 1; i <= 2; i++) {
+    MemoryDataStore resolver;
+    resolver.track_changes = true;
+
+    AFF4Flusher<AFF4Stream> file;
+    EXPECT_EQ(NewFileBackedObject(&resolver, filename, "append", file),
+              STATUS_OK);
+
+    AFF4Flusher<ZipFile> zip;
+    EXPECT_EQ(ZipFile::OpenZipFile(&resolver, std::move(file), zip),
+              STATUS_OK);
+
+    resolver.Set(volume_urn, description,
+                 new XSDString("round " + std::to_string(i)));
+
+    AFF4Flusher<AFF4Stream> segment;
+    EXPECT_EQ(zip->CreateMemberStream(
+        volume_urn.Append("member" + std::to_string(i)), segment),
+              STATUS_OK);
+    segment->Write(data2);
+  }
+
+  MemoryDataStore resolver;
+
+  AFF4Flusher<AFF4Stream> file;
+  EXPECT_EQ(NewFileBackedObject(&resolver, filename, "read", file),
+            STATUS_OK);
+
+  AFF4Flusher<ZipFile> zip;
+  EXPECT_EQ(ZipFile::OpenZipFile(&resolver, std::move(file), zip),
+            STATUS_OK);
+
+  EXPECT_EQ(1, zip->members.count("information.turtle.1"));
+  EXPECT_EQ(1, zip->members.count("information.turtle.2"));
+
+  AFF4_Attributes attributes = resolver.GetAttributes(volume_urn);
+  ASSERT_EQ(1, attributes[description.SerializeToString()].size());
+  EXPECT_EQ("round 2",
+            attributes[description.SerializeToString()][0]->SerializeToString());
+
+  AFF4Flusher<AFF4Stream> segment;
+  EXPECT_EQ(zip->OpenMemberStream(volume_urn.Append("member2"), segment),
+            STATUS_OK);
+  EXPECT_EQ(data2, segment->Read(1000));
+}
+
+TEST_F(ZipTest, QueuedWriter) {
+  const std::string segment2_name = "Queued.txt";
+  {
+    MemoryDataStore resolver;
+
+    // Append to the volume through a queued writer.
+    AFF4Flusher<AFF4Stream> file;
+    EXPECT_EQ(NewFileBackedObject(&resolver, filename, "append", file),
+              STATUS_OK);
+
+    AFF4Flusher<AFF4Stream> writer;
+    EXPECT_EQ(STATUS_OK, AFF4QueuedWriter::NewAFF4QueuedWriter(
+        &resolver, std::move(file), 16, writer));
+
+    AFF4Flusher<ZipFile> zip;
+    EXPECT_EQ(ZipFile::OpenZipFile(&resolver, std::move(writer), zip),
+              STATUS_OK);
+
+    AFF4Flusher<AFF4Stream> segment;
+    EXPECT_EQ(zip->CreateMemberStream(
+        zip->urn.Append(segment2_name), segment), STATUS_OK);
+    segment->Write(data2);
+  }
+
+  MemoryDataStore resolver;
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<AFF4Volume> zip;
+  EXPECT_EQ(NewFileBackedObject(&resolver, filename, "read", file),
+            STATUS_OK);
+  EXPECT_EQ(ZipFile::OpenZipFile(&resolver, std::move(file), zip),
+            STATUS_OK);
+
+  AFF4Flusher<AFF4Stream> segment;
+  EXPECT_EQ(zip->OpenMemberStream(zip->urn.Append(segment_name), segment),
+            STATUS_OK);
+  EXPECT_EQ(data1, segment->Read(1000));
+
+  EXPECT_EQ(zip->OpenMemberStream(zip->urn.Append(segment2_name), segment),
+            STATUS_OK);
+  EXPECT_EQ(data2, segment->Read(1000));
+}
+
+TEST_F(ZipTest, DeflatedMember) {
+  const std::string segment2_name = "Deflated.txt";
+
+  // Several compressed chunks worth of data.
+  std::string data;
+  for (int i = 0; data.size() < 1024 * 1024; i++) {
+    data += aff4_sprintf("line %d of the deflated member\n", i * 7919);
+  }
+
+  {
+    MemoryDataStore resolver;
+    AFF4Flusher<AFF4Stream> file;
+    AFF4Flusher<ZipFile> zip;
+    EXPECT_EQ(NewFileBackedObject(&resolver, filename, "append", file),
+              STATUS_OK);
+    EXPECT_EQ(ZipFile::OpenZipFile(&resolver, std::move(file), zip),
+              STATUS_OK);
+
+    StringIO source(data);
+    EXPECT_EQ(zip->StreamAddMember(zip->urn.Append(segment2_name), source,
+                                   ZIP_DEFLATE), STATUS_OK);
+  }
+
+  MemoryDataStore resolver;
+  AFF4Flusher<AFF4Stream> file;
+  AFF4Flusher<AFF4Volume> zip;
+  EXPECT_EQ(NewFileBackedObject(&resolver, filename, "read", file),
+            STATUS_OK);
+
+  // The member was compressed.
+  EXPECT_LT(file->Size(), data.size() / 2);
+
+  EXPECT_EQ(ZipFile::OpenZipFile(&resolver, std::move(file), zip),
+            STATUS_OK);
+
+  AFF4Flusher<AFF4Stream> segment;
+  EXPECT_EQ(zip->OpenMemberStream(zip->urn.Append(segment2_name), segment),
+            STATUS_OK);
+  EXPECT_EQ(segment->Size(), data.size());
+
+  // Read it in odd sized pieces.
+  std::string result;
+  while (1) {
+    std::string piece = segment->Read(4093);
+    if (piece.empty()) {
+      break;
+    }
+    result += piece;
+  }
+  EXPECT_EQ(result, data);
+
+  // Seeking backwards and forwards reads the right data.
+  segment->Seek(500000, SEEK_SET);
+  EXPECT_EQ(segment->Read(1000), data.substr(500000, 1000));
+  segment->Seek(1000, SEEK_SET);
+  EXPECT_EQ(segment->Read(1000), data.substr(1000, 1000));
+  segment->Seek(900000, SEEK_SET);
+  EXPECT_EQ(segment->Read(1000), data.substr(900000, 1000));
+}
+
 } // namespace aff4
@@ -263,6 +263,10 @@ AFF4Status PmemImager::WriteMapObject_(const URN &map_urn) {
             &resolver, map_urn, volume, data_stream.get(),
             map_stream));
 
+    // Memory images have many zero pages - there is no point storing
+    // them.
+    map_stream->elide_constant_blocks = true;
+
     VolumeManager progress(&resolver, this);
     progress.ManageStream(map_stream.get());
 